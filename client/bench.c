@@ -0,0 +1,655 @@
+// bench: load generator for the DHCP/DNS server, printing request rates and reply latencies.
+//
+//   bench dhcp [options]     DISCOVER then REQUEST for -n clients, -w of them in flight at a time
+//   bench readers [options]  leases -n clients, then -t threads look them up with PTR queries for
+//                            -D seconds, first alone and then while one writer keeps renewing them
+//   bench reserve-file -f f  writes a reservations_file reserving 10.0.0.1 upward for -n clients
+//   bench reservations       DISCOVER for those clients, checking each is offered its reservation
+//   bench renewals           leases -n clients at once and shows when their T1 renewals would land
+//   bench names [options]    registers bench-<n>.lan for -n clients (option 12), then -t threads look
+//                            up random ones for -D seconds
+//   bench dns [options]      leases and names -n clients, then times one A, one PTR and one unknown
+//                            name query per client, -w in flight
+//
+// Options: -s server (127.0.0.1), -p dhcp_server_port (667), -c dhcp_client_port (668),
+//          -d dns_server_port (653), -n clients (10000), -w window (32), -t threads (4), -D seconds (5),
+//          -f file
+//
+// Replies come back to dhcp_client_port, so run it on the server's host with nothing else bound
+// there, a pool of at least -n addresses and rate_limit_mac/rate_limit_relay at 0.
+//
+// Build: gcc -Wall -O2 -o bench bench.c -lpthread
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define DHCP_SERVER_PORT 667
+#define DHCP_CLIENT_PORT 668
+#define DNS_SERVER_PORT 653
+#define MAX_THREADS 64
+#define FIRST_RESERVED 0x0a000001 // 10.0.0.1
+#define HISTOGRAM_BUCKETS 10
+#define DNS_DOMAIN "lan" // the server's default dns_domain
+#define REPLY_TIMEOUT_MS 500 // a window with no reply for this long is counted as lost
+
+typedef struct {
+    uint8_t op;
+    uint8_t htype;
+    uint8_t hlen;
+    uint8_t hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint32_t ciaddr;
+    uint32_t yiaddr;
+    uint32_t siaddr;
+    uint32_t giaddr;
+    uint8_t chaddr[16];
+    uint8_t sname[64];
+    uint8_t file[128];
+    uint8_t options[312];
+} DHCPPacket;
+
+const char *server = "127.0.0.1";
+int dhcp_server_port = DHCP_SERVER_PORT;
+int dhcp_client_port = DHCP_CLIENT_PORT;
+int dns_server_port = DNS_SERVER_PORT;
+uint32_t count = 10000;
+uint32_t window = 32;
+int threads = 4;
+int seconds = 5;
+const char *file;
+int hostnames; // send option 12 as bench-<n>
+
+// Per client, indexed by the xid it uses
+uint64_t *sent_at;
+uint64_t *latency;
+uint32_t *offered;
+uint32_t *server_ids;
+uint32_t *lease_times; // options 51 and 58 of the last reply, host order
+uint32_t *t1s;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Client n is MAC 02:00:nn:nn:nn:nn and uses xid n
+int build_message(uint32_t client, uint8_t type, DHCPPacket *packet) {
+    memset(packet, 0, sizeof(*packet));
+    packet->op = 1; // Boot Request
+    packet->htype = 1;
+    packet->hlen = 6;
+    packet->xid = htonl(client);
+    packet->chaddr[0] = 0x02;
+    uint32_t mac = htonl(client);
+    memcpy(&packet->chaddr[2], &mac, 4);
+
+    uint8_t *o = packet->options;
+    int i = 0;
+    o[i++] = 99; o[i++] = 130; o[i++] = 83; o[i++] = 99; // magic cookie
+    o[i++] = 53; o[i++] = 1; o[i++] = type;
+    if (type == 3) {
+        o[i++] = 50; o[i++] = 4; memcpy(&o[i], &offered[client], 4); i += 4;
+        o[i++] = 54; o[i++] = 4; memcpy(&o[i], &server_ids[client], 4); i += 4;
+    }
+    if (hostnames) {
+        int len = snprintf((char *)&o[i + 2], 64, "bench-%u", client);
+        o[i++] = 12; o[i++] = len; i += len;
+    }
+    o[i++] = 255;
+    return offsetof(DHCPPacket, options) + i;
+}
+
+// Returns the option's length and copies at most 'max' bytes of it, or -1 if it isn't there
+int find_option(const DHCPPacket *packet, int len, uint8_t code, void *out, int max) {
+    int end = len - (int)offsetof(DHCPPacket, options);
+    for (int i = 4; i + 1 < end && packet->options[i] != 255;) {
+        if (packet->options[i] == 0) {
+            i++;
+            continue;
+        }
+        int opt_len = packet->options[i + 1];
+        if (i + 2 + opt_len > end) {
+            break;
+        }
+        if (packet->options[i] == code) {
+            memcpy(out, &packet->options[i + 2], opt_len < max ? opt_len : max);
+            return opt_len;
+        }
+        i += 2 + opt_len;
+    }
+    return -1;
+}
+
+// Sends one 'type' message per client, keeping at most 'window' unanswered, and times each reply.
+// Replies are matched to clients by xid; returns how many were answered.
+uint32_t exchange_all(int sock, const struct sockaddr_in *to, uint8_t type) {
+    memset(sent_at, 0, count * sizeof(*sent_at));
+    memset(latency, 0, count * sizeof(*latency));
+    uint32_t next = 0, outstanding = 0, answered = 0;
+    DHCPPacket packet;
+    while (next < count || outstanding > 0) {
+        while (outstanding < window && next < count) {
+            int len = build_message(next, type, &packet);
+            sent_at[next] = now_ns();
+            if (sendto(sock, &packet, len, 0, (const struct sockaddr *)to, sizeof(*to)) == len) {
+                outstanding++;
+            }
+            next++;
+        }
+
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+            outstanding = 0; // the rest of this window is lost
+            continue;
+        }
+        int len = recv(sock, &packet, sizeof(packet), 0);
+        uint32_t client = ntohl(packet.xid);
+        if (len < (int)offsetof(DHCPPacket, options) + 4 || packet.op != 2 || client >= count ||
+            sent_at[client] == 0 || latency[client] != 0) {
+            continue; // not ours, or late
+        }
+        latency[client] = now_ns() - sent_at[client];
+        offered[client] = packet.yiaddr;
+        find_option(&packet, len, 54, &server_ids[client], 4);
+        if (find_option(&packet, len, 51, &lease_times[client], 4) == 4) {
+            lease_times[client] = ntohl(lease_times[client]);
+        }
+        if (find_option(&packet, len, 58, &t1s[client], 4) == 4) {
+            t1s[client] = ntohl(t1s[client]);
+        }
+        answered++;
+        if (outstanding > 0) {
+            outstanding--;
+        }
+    }
+    return answered;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// One line per run: rate and the 50th/99th percentile latency of the answered requests
+void report(const char *what, const uint64_t *latencies, uint32_t n, uint32_t answered, double seconds) {
+    uint64_t *sorted = malloc((answered + 1) * sizeof(*sorted));
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < n && k < answered; i++) {
+        if (latencies[i] != 0) {
+            sorted[k++] = latencies[i];
+        }
+    }
+    qsort(sorted, k, sizeof(*sorted), compare_u64);
+    printf("%-9s %7u of %7u answered in %6.2f s  %8.0f/s  p50 %6.0f us  p99 %6.0f us\n", what, answered, n,
+           seconds, answered / seconds, k ? sorted[k / 2] / 1e3 : 0, k ? sorted[k * 99 / 100] / 1e3 : 0);
+    free(sorted);
+}
+
+int open_client_socket(const char *address, int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &addr.sin_addr);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    int size = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return sock;
+}
+
+struct sockaddr_in server_address(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address %s\n", server);
+        exit(2);
+    }
+    return addr;
+}
+
+// Full DISCOVER/OFFER then REQUEST/ACK for every client
+int bench_dhcp() {
+    int sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    struct sockaddr_in to = server_address(dhcp_server_port);
+
+    uint64_t start = now_ns();
+    uint32_t answered = exchange_all(sock, &to, 1);
+    report("discover", latency, count, answered, (now_ns() - start) / 1e9);
+
+    start = now_ns();
+    answered = exchange_all(sock, &to, 3);
+    report("request", latency, count, answered, (now_ns() - start) / 1e9);
+    close(sock);
+    return 0;
+}
+
+// Standard query for 'name' (dotted text), recursion desired; returns its length
+int build_dns_query(uint8_t *buf, uint16_t id, const char *name, uint16_t type) {
+    uint16_t header[6] = { htons(id), htons(0x0100), htons(1), 0, 0, 0 };
+    memcpy(buf, header, sizeof(header));
+    int i = sizeof(header);
+    while (*name != '\0') {
+        const char *dot = strchr(name, '.');
+        int label = dot != NULL ? dot - name : (int)strlen(name);
+        buf[i++] = label;
+        memcpy(&buf[i], name, label);
+        i += label;
+        name += label + (dot != NULL);
+    }
+    buf[i++] = 0;
+    uint16_t qtype = htons(type), qclass = htons(1);
+    memcpy(&buf[i], &qtype, 2);
+    memcpy(&buf[i + 2], &qclass, 2);
+    return i + 4;
+}
+
+int build_name_query(uint8_t *buf, uint16_t id, uint32_t client) {
+    char name[64];
+    snprintf(name, sizeof(name), "bench-%u.%s", client, DNS_DOMAIN);
+    return build_dns_query(buf, id, name, 1);
+}
+
+int build_ptr_query(uint8_t *buf, uint16_t id, uint32_t ip) {
+    const uint8_t *b = (const uint8_t *)&ip;
+    char name[64];
+    snprintf(name, sizeof(name), "%u.%u.%u.%u.in-addr.arpa", b[3], b[2], b[1], b[0]);
+    return build_dns_query(buf, id, name, 12);
+}
+
+typedef struct {
+    pthread_t thread;
+    uint16_t qtype; // 1 for a client's A record, 12 for its address's PTR
+    uint32_t seed;
+    uint64_t answered;
+    uint64_t found; // NOERROR with an answer
+} Reader;
+
+int stop;
+
+// Keeps 'window' queries about random clients in flight until told to stop
+void *reader_thread(void *arg) {
+    Reader *r = arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to = server_address(dns_server_port);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&to, sizeof(to)) < 0) {
+        perror("DNS socket");
+        return NULL;
+    }
+    uint8_t buf[512];
+    uint32_t outstanding = 0;
+    uint16_t id = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        while (outstanding < window) {
+            uint32_t client = rand_r(&r->seed) % count;
+            int len = r->qtype == 12 ? build_ptr_query(buf, id++, offered[client])
+                                     : build_name_query(buf, id++, client);
+            if (send(sock, buf, len, 0) == len) {
+                outstanding++;
+            }
+        }
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+            outstanding = 0;
+            continue;
+        }
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 12) {
+            continue;
+        }
+        r->answered++;
+        if ((buf[3] & 0x0f) == 0 && (buf[6] | buf[7]) != 0) {
+            r->found++;
+        }
+        outstanding--;
+    }
+    close(sock);
+    return NULL;
+}
+
+typedef struct {
+    int sock;
+    struct sockaddr_in to;
+    uint64_t renewed;
+} Writer;
+
+// Renews every lease over and over: each ACK rewrites a lease record the readers are looking up
+void *writer_thread(void *arg) {
+    Writer *w = arg;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        w->renewed += exchange_all(w->sock, &w->to, 3);
+    }
+    return NULL;
+}
+
+// Runs the readers for 'seconds', with the writer too if one is given, and reports both sides
+void run_readers(const char *what, Writer *writer, uint16_t qtype) {
+    Reader readers[MAX_THREADS];
+    pthread_t writer_id;
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    if (writer != NULL) {
+        writer->renewed = 0;
+        pthread_create(&writer_id, NULL, writer_thread, writer);
+    }
+    for (int i = 0; i < threads; i++) {
+        memset(&readers[i], 0, sizeof(readers[i]));
+        readers[i].qtype = qtype;
+        readers[i].seed = i + 1;
+        pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+    }
+    uint64_t start = now_ns();
+    sleep(seconds);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    uint64_t answered = 0, found = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        answered += readers[i].answered;
+        found += readers[i].found;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    if (writer != NULL) {
+        pthread_join(writer_id, NULL);
+    }
+    printf("%-14s %d readers  %8.0f lookups/s (%llu of %llu found)", what, threads, answered / elapsed,
+           (unsigned long long)found, (unsigned long long)answered);
+    if (writer != NULL) {
+        printf("  writer %6.0f renewals/s", writer->renewed / elapsed);
+    }
+    printf("\n");
+}
+
+int bench_readers() {
+    Writer writer;
+    writer.sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    writer.to = server_address(dhcp_server_port);
+    exchange_all(writer.sock, &writer.to, 1);
+    uint32_t leased = exchange_all(writer.sock, &writer.to, 3);
+    printf("%u of %u clients leased\n", leased, count);
+
+    run_readers("readers alone", NULL, 12);
+    run_readers("with writer", &writer, 12);
+    close(writer.sock);
+    return 0;
+}
+
+// Client n gets 10.0.0.1 + n, matching the MACs build_message uses
+int write_reservations() {
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        perror(file);
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t ip = FIRST_RESERVED + i;
+        fprintf(f, "02:00:%02x:%02x:%02x:%02x %u.%u.%u.%u\n", i >> 24, (i >> 16) & 0xff, (i >> 8) & 0xff,
+                i & 0xff, ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+    }
+    if (fclose(f) != 0) {
+        perror(file);
+        return 1;
+    }
+    printf("Wrote %u reservations to %s\n", count, file);
+    return 0;
+}
+
+int bench_reservations() {
+    int sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    struct sockaddr_in to = server_address(dhcp_server_port);
+
+    uint64_t start = now_ns();
+    uint32_t answered = exchange_all(sock, &to, 1);
+    report("discover", latency, count, answered, (now_ns() - start) / 1e9);
+    uint32_t matched = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        matched += latency[i] != 0 && offered[i] == htonl(FIRST_RESERVED + i);
+    }
+    printf("%u of %u offers were the client's reservation\n", matched, answered);
+    close(sock);
+    return matched == count ? 0 : 1;
+}
+
+// When each client will renew, in seconds after the first ACK: how many land in the busiest second
+int bench_renewals() {
+    int sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    struct sockaddr_in to = server_address(dhcp_server_port);
+    exchange_all(sock, &to, 1);
+    memset(t1s, 0, count * sizeof(*t1s));
+    uint32_t answered = exchange_all(sock, &to, 3);
+    close(sock);
+
+    uint64_t first = UINT64_MAX, last = 0;
+    uint32_t n = 0, min_t1 = UINT32_MAX, max_t1 = 0, min_lease = UINT32_MAX, max_lease = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (latency[i] == 0 || t1s[i] == 0) {
+            continue;
+        }
+        uint64_t acked = sent_at[i] + latency[i];
+        first = acked < first ? acked : first;
+        last = acked > last ? acked : last;
+        min_t1 = t1s[i] < min_t1 ? t1s[i] : min_t1;
+        max_t1 = t1s[i] > max_t1 ? t1s[i] : max_t1;
+        min_lease = lease_times[i] < min_lease ? lease_times[i] : min_lease;
+        max_lease = lease_times[i] > max_lease ? lease_times[i] : max_lease;
+        n++;
+    }
+    if (n == 0) {
+        printf("%u ACKs, none with a T1\n", answered);
+        return 1;
+    }
+
+    // Renewal second of each client, counted per second and in HISTOGRAM_BUCKETS even buckets
+    uint32_t span = (uint32_t)((last - first) / 1000000000) + max_t1 - min_t1 + 1;
+    uint32_t *per_second = calloc(span + 1, sizeof(*per_second));
+    uint32_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+    uint32_t peak = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (latency[i] == 0 || t1s[i] == 0) {
+            continue;
+        }
+        uint32_t at = (uint32_t)((sent_at[i] + latency[i] - first) / 1000000000) + t1s[i] - min_t1;
+        at = at < span ? at : span;
+        per_second[at]++;
+        peak = per_second[at] > peak ? per_second[at] : peak;
+        histogram[(uint64_t)at * HISTOGRAM_BUCKETS / (span + 1)]++;
+    }
+    free(per_second);
+
+    printf("%u leases: lease %u-%u s, T1 %u-%u s\n", n, min_lease, max_lease, min_t1, max_t1);
+    printf("renewals spread over %u s, busiest second %u (%.2f%% of all)\n", span, peak, 100.0 * peak / n);
+    printf("histogram:");
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        printf(" %u", histogram[b]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// Lookup cost against the number of names: run with a small and a large -n and compare
+int bench_names() {
+    int sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    struct sockaddr_in to = server_address(dhcp_server_port);
+    hostnames = 1;
+    exchange_all(sock, &to, 1);
+    uint32_t registered = exchange_all(sock, &to, 3);
+    close(sock);
+    printf("%u of %u clients leased with a name\n", registered, count);
+    sleep(1); // names are published by a server task after the ACK
+
+    run_readers("name lookups", NULL, 1);
+    return 0;
+}
+
+// exchange_all for DNS: one query per client about its name (1), its address (12) or a name nobody
+// has (0). Replies are matched by id, so at most 65536 may be in flight.
+uint32_t dns_exchange_all(int sock, uint16_t kind, uint32_t *found) {
+    static uint32_t pending[65536];
+    memset(sent_at, 0, count * sizeof(*sent_at));
+    memset(latency, 0, count * sizeof(*latency));
+    uint32_t next = 0, outstanding = 0, answered = 0;
+    uint8_t buf[512];
+    char name[64];
+    *found = 0;
+    while (next < count || outstanding > 0) {
+        while (outstanding < window && next < count) {
+            uint16_t id = next & 0xffff;
+            int len;
+            if (kind == 12) {
+                len = build_ptr_query(buf, id, offered[next]);
+            } else if (kind == 1) {
+                len = build_name_query(buf, id, next);
+            } else {
+                snprintf(name, sizeof(name), "nobody-%u.%s", next, DNS_DOMAIN);
+                len = build_dns_query(buf, id, name, 1);
+            }
+            pending[id] = next;
+            sent_at[next] = now_ns();
+            if (send(sock, buf, len, 0) == len) {
+                outstanding++;
+            }
+            next++;
+        }
+
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+            outstanding = 0;
+            continue;
+        }
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 12) {
+            continue;
+        }
+        uint32_t client = pending[(buf[0] << 8) | buf[1]];
+        if (sent_at[client] == 0 || latency[client] != 0) {
+            continue;
+        }
+        latency[client] = now_ns() - sent_at[client];
+        answered++;
+        if ((buf[3] & 0x0f) == 0 && (buf[6] | buf[7]) != 0) {
+            (*found)++;
+        }
+        if (outstanding > 0) {
+            outstanding--;
+        }
+    }
+    return answered;
+}
+
+int bench_dns() {
+    int sock = open_client_socket("0.0.0.0", dhcp_client_port);
+    struct sockaddr_in to = server_address(dhcp_server_port);
+    hostnames = 1;
+    exchange_all(sock, &to, 1);
+    uint32_t leased = exchange_all(sock, &to, 3);
+    close(sock);
+    printf("%u of %u clients leased with a name\n", leased, count);
+    sleep(1); // names are published by a server task after the ACK
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    to = server_address(dns_server_port);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&to, sizeof(to)) < 0) {
+        perror("DNS socket");
+        return 1;
+    }
+    int size = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    const char *labels[] = { "A", "PTR", "nxdomain" };
+    uint16_t kinds[] = { 1, 12, 0 };
+    for (int k = 0; k < 3; k++) {
+        uint32_t found;
+        uint64_t start = now_ns();
+        uint32_t answered = dns_exchange_all(sock, kinds[k], &found);
+        report(labels[k], latency, count, answered, (now_ns() - start) / 1e9);
+        printf("          %u with an answer\n", found);
+    }
+    close(sock);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s dhcp|readers|reserve-file|reservations|renewals|names|dns\n"
+                    "          [-s server] [-p port] [-c client_port] [-d dns_port] [-n clients]\n"
+                    "          [-w window] [-t threads] [-D seconds] [-f file]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+    const char *mode = argv[1];
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) server = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) dhcp_server_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) dhcp_client_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) dns_server_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) window = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) file = argv[++i];
+        else usage(argv[0]);
+    }
+    if (count == 0 || window == 0 || window > 65536 || threads < 1 || threads > MAX_THREADS || seconds < 1) {
+        usage(argv[0]);
+    }
+
+    sent_at = calloc(count, sizeof(*sent_at));
+    latency = calloc(count, sizeof(*latency));
+    offered = calloc(count, sizeof(*offered));
+    server_ids = calloc(count, sizeof(*server_ids));
+    lease_times = calloc(count, sizeof(*lease_times));
+    t1s = calloc(count, sizeof(*t1s));
+    if (sent_at == NULL || latency == NULL || offered == NULL || server_ids == NULL || lease_times == NULL ||
+        t1s == NULL) {
+        fprintf(stderr, "Out of memory for %u clients\n", count);
+        return 1;
+    }
+
+    if (strcmp(mode, "dhcp") == 0) {
+        return bench_dhcp();
+    }
+    if (strcmp(mode, "readers") == 0) {
+        return bench_readers();
+    }
+    if (strcmp(mode, "reserve-file") == 0 && file != NULL) {
+        return write_reservations();
+    }
+    if (strcmp(mode, "reservations") == 0) {
+        return bench_reservations();
+    }
+    if (strcmp(mode, "renewals") == 0) {
+        return bench_renewals();
+    }
+    if (strcmp(mode, "names") == 0) {
+        return bench_names();
+    }
+    if (strcmp(mode, "dns") == 0) {
+        return bench_dns();
+    }
+    usage(argv[0]);
+    return 2;
+}
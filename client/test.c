@@ -4,19 +4,15 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #define SERVER_IP "192.168.0.18"
 #define DHCP_SERVER_PORT 667
 #define DHCP_CLIENT_PORT 668
+#define DNS_SERVER_PORT 653
 #define MAX_DHCP_PACKET_SIZE 1024
-
-#define MAX_DOMAIN_LENGTH 256
-#define MAX_IP_LENGTH 16
-
-typedef struct {
-    char domain[MAX_DOMAIN_LENGTH];
-    char ip[MAX_IP_LENGTH];
-} DNSQuery;
+#define MAX_DNS_PACKET_SIZE 512
+#define DNS_QUERY_ID 0x1234
 
 typedef struct {
     uint8_t op;
@@ -45,10 +41,17 @@ void send_dhcp_discover(int sock, struct sockaddr_in *server_addr) {
     packet.hlen = 6; // MAC address length
     packet.xid = random(); // Random transaction ID
 
+    // Magic cookie, the server drops requests without it
+    packet.options[0] = 99;
+    packet.options[1] = 130;
+    packet.options[2] = 83;
+    packet.options[3] = 99;
+
     // Set DHCP message type to DHCPDISCOVER
-    packet.options[0] = 53; // DHCP Message Type option
-    packet.options[1] = 1;  // Length
-    packet.options[2] = 1;  // DHCPDISCOVER
+    packet.options[4] = 53; // DHCP Message Type option
+    packet.options[5] = 1;  // Length
+    packet.options[6] = 1;  // DHCPDISCOVER
+    packet.options[7] = 255; // End option
 
     if (sendto(sock, &packet, sizeof(DHCPPacket), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
         perror("DHCP Discover sendto failed");
@@ -57,15 +60,97 @@ void send_dhcp_discover(int sock, struct sockaddr_in *server_addr) {
     }
 }
 
+// Standard A query: 12-byte header with one question, the name as length-prefixed labels, type A, class IN
 void send_dns_query(int sock, struct sockaddr_in *server_addr, const char *domain) {
-    DNSQuery query;
-    strncpy(query.domain, domain, MAX_DOMAIN_LENGTH - 1);
-    query.domain[MAX_DOMAIN_LENGTH - 1] = '\0';
+    uint8_t query[MAX_DNS_PACKET_SIZE];
+    memset(query, 0, 12);
+    query[0] = DNS_QUERY_ID >> 8;
+    query[1] = DNS_QUERY_ID & 0xff;
+    query[2] = 0x01; // Recursion desired
+    query[5] = 1;    // QDCOUNT
+    int length = 12;
+
+    const char *label = domain;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        size_t label_length = dot != NULL ? (size_t)(dot - label) : strlen(label);
+        if (label_length == 0 || label_length > 63 || length + 1 + label_length + 5 > sizeof(query)) {
+            fprintf(stderr, "Invalid domain name: %s\n", domain);
+            return;
+        }
+        query[length++] = label_length;
+        memcpy(&query[length], label, label_length);
+        length += label_length;
+        label += label_length + (dot != NULL);
+    }
+    query[length++] = 0;
+    query[length++] = 0; query[length++] = 1; // QTYPE A
+    query[length++] = 0; query[length++] = 1; // QCLASS IN
 
-    if (sendto(sock, &query, sizeof(DNSQuery), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+    if (sendto(sock, query, length, 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
         perror("DNS query sendto failed");
     } else {
-        printf("Sent DNS query for domain: %s\n", query.domain);
+        printf("Sent DNS query for domain: %s\n", domain);
+    }
+}
+
+// Returns the offset just past a (possibly compressed) name, or -1 if it runs off the reply
+int skip_dns_name(const uint8_t *reply, int length, int offset) {
+    while (offset < length) {
+        if ((reply[offset] & 0xc0) == 0xc0) {
+            return offset + 2 <= length ? offset + 2 : -1;
+        }
+        if (reply[offset] == 0) {
+            return offset + 1;
+        }
+        offset += 1 + reply[offset];
+    }
+    return -1;
+}
+
+// Waits for the answer to send_dns_query and prints its A records
+void receive_dns_response(int sock) {
+    uint8_t reply[MAX_DNS_PACKET_SIZE];
+    ssize_t received = recv(sock, reply, sizeof(reply), 0);
+    if (received < 0) {
+        perror("DNS recv failed");
+        return;
+    }
+    if (received < 12 || ((reply[0] << 8) | reply[1]) != DNS_QUERY_ID || !(reply[2] & 0x80)) {
+        printf("Received unknown DNS packet (size: %zd)\n", received);
+        return;
+    }
+
+    int rcode = reply[3] & 0x0f;
+    int question_count = (reply[4] << 8) | reply[5];
+    int answer_count = (reply[6] << 8) | reply[7];
+    printf("Received DNS response: rcode %d, %d answer(s)\n", rcode, answer_count);
+
+    int offset = 12;
+    for (int i = 0; i < question_count && offset >= 0; i++) {
+        offset = skip_dns_name(reply, received, offset);
+        offset = offset >= 0 && offset + 4 <= received ? offset + 4 : -1; // QTYPE, QCLASS
+    }
+    for (int i = 0; i < answer_count && offset >= 0; i++) {
+        offset = skip_dns_name(reply, received, offset);
+        if (offset < 0 || offset + 10 > received) {
+            break;
+        }
+        int type = (reply[offset] << 8) | reply[offset + 1];
+        int rdata_length = (reply[offset + 8] << 8) | reply[offset + 9];
+        offset += 10;
+        if (offset + rdata_length > received) {
+            break;
+        }
+        if (type == 1 && rdata_length == 4) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &reply[offset], ip, sizeof(ip));
+            printf("IP Address: %s\n", ip);
+        }
+        offset += rdata_length;
+    }
+    if (offset < 0) {
+        printf("DNS response is truncated\n");
     }
 }
 
@@ -94,9 +179,9 @@ int main() {
     dhcp_server_addr.sin_port = htons(DHCP_SERVER_PORT);
     inet_pton(AF_INET, SERVER_IP, &dhcp_server_addr.sin_addr);
 
-    // DNS server address (using the same IP but different port)
+    // DNS server address (same IP, the server answers DNS on its own port)
     dns_server_addr.sin_family = AF_INET;
-    dns_server_addr.sin_port = htons(DHCP_SERVER_PORT); // Using the same port for DNS
+    dns_server_addr.sin_port = htons(DNS_SERVER_PORT);
     inet_pton(AF_INET, SERVER_IP, &dns_server_addr.sin_addr);
 
     // Client address for binding
@@ -115,8 +200,11 @@ int main() {
     // Send DHCP Discover
     send_dhcp_discover(dhcp_sock, &dhcp_server_addr);
 
-    // Send DNS query (example.com)
+    // Send DNS query (example.com); the answer comes back on the DNS socket
     send_dns_query(dns_sock, &dns_server_addr, "example.com");
+    struct timeval timeout = { 2, 0 };
+    setsockopt(dns_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    receive_dns_response(dns_sock);
 
     // Receive and handle responses
     char buffer[MAX_DHCP_PACKET_SIZE];
@@ -132,15 +220,10 @@ int main() {
 
         if (received == sizeof(DHCPPacket)) {
             DHCPPacket *dhcp_response = (DHCPPacket *)buffer;
-            printf("Received DHCP packet (type: %d)\n", dhcp_response->options[2]);
+            printf("Received DHCP packet (type: %d)\n", dhcp_response->options[6]);
 
 
             // Handle DHCP response here
-        } else if (received == sizeof(DNSQuery)) {
-            DNSQuery *dns_response = (DNSQuery *)buffer;
-            printf("Received DNS response:\n");
-            printf("Domain: %s\n", dns_response->domain);
-            printf("IP Address: %s\n", dns_response->ip);
         } else {
             printf("Received unknown packet type (size: %zd)\n", received);
 
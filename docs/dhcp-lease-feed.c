@@ -0,0 +1,201 @@
+// dhcp-lease-feed: follows the DHCP server's lease change feed, one line per grant, renewal,
+// release, expiry or decline.
+//
+//   dhcp-lease-feed [-n segment] [-a]    follow the shared-memory ring (-a: start from the oldest event kept)
+//   dhcp-lease-feed -s socket            follow the server's lease_feed_socket instead
+//
+// The ring never waits for us: if we fall more than a ring behind, the events we missed are
+// reported as a gap and we carry on from the oldest one left.
+//
+// Build: gcc -Wall -O2 -o dhcp-lease-feed dhcp-lease-feed.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LEASE_FEED_SHM_NAME "/dhcp_lease_feed"
+#define LEASE_FEED_MAGIC "DHCPFEED"
+#define LEASE_FEED_VERSION 1
+#define LEASE_EVENT_GAP 255
+#define POLL_INTERVAL_US 50000 // while the ring has nothing new
+
+// Must match the layout documented next to LeaseEvent in test2.c
+typedef struct {
+    uint64_t seq;
+    int64_t time;
+    int64_t lease_start;
+    uint32_t ip; // network byte order
+    int32_t lease_time;
+    uint8_t mac[6];
+    uint8_t type;
+    uint8_t pad;
+    uint8_t reserved[8];
+} LeaseEvent;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t event_size;
+    uint32_t capacity;
+    uint64_t head;
+    uint32_t server_pid;
+    uint32_t pad;
+    int64_t started;
+    uint8_t reserved[16];
+} LeaseFeedHeader;
+
+const char *event_names[] = { "?", "grant", "renew", "release", "expire", "decline" };
+
+void format_time(int64_t t, char *out, size_t size) {
+    time_t when = t;
+    struct tm tm;
+    localtime_r(&when, &tm);
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+void print_event(const LeaseEvent *event) {
+    char when[32], ends[32], ip[16];
+    format_time(event->time, when, sizeof(when));
+    struct in_addr addr;
+    addr.s_addr = event->ip;
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    format_time(event->lease_start + event->lease_time, ends, sizeof(ends));
+    printf("%s  %-7s  %-15s  %02x:%02x:%02x:%02x:%02x:%02x  %s\n", when,
+           event->type < 6 ? event_names[event->type] : "?", ip,
+           event->mac[0], event->mac[1], event->mac[2], event->mac[3], event->mac[4], event->mac[5], ends);
+}
+
+// Same check as the server's lease_feed_read: -1 if the slot no longer (or not yet) holds 'seq'
+int read_event(const LeaseEvent *events, uint32_t capacity, uint64_t seq, LeaseEvent *out) {
+    const LeaseEvent *event = &events[seq & (capacity - 1)];
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != seq) {
+        return -1;
+    }
+    memcpy(out, event, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+int follow_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    uint64_t expected = 0;
+    LeaseEvent event;
+    size_t have = 0;
+    for (;;) {
+        ssize_t n = read(fd, (uint8_t *)&event + have, sizeof(event) - have);
+        if (n <= 0) {
+            fprintf(stderr, "Server closed the feed\n");
+            return n < 0 ? 1 : 0;
+        }
+        have += n;
+        if (have < sizeof(event)) {
+            continue;
+        }
+        have = 0;
+        if (event.type == LEASE_EVENT_GAP) {
+            printf("gap: %llu events lost\n", (unsigned long long)(expected != 0 ? event.seq - expected : 0));
+            expected = event.seq;
+            continue;
+        }
+        print_event(&event);
+        expected = event.seq + 1;
+    }
+}
+
+int follow_ring(const char *name, int from_oldest) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open (is the DHCP server running?)");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LeaseFeedHeader)) {
+        fprintf(stderr, "Lease feed %s is truncated\n", name);
+        return 1;
+    }
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const LeaseFeedHeader *header = (const LeaseFeedHeader *)base;
+    uint32_t capacity = header->capacity;
+    if (__atomic_load_n(&header->version, __ATOMIC_ACQUIRE) != LEASE_FEED_VERSION ||
+        memcmp(header->magic, LEASE_FEED_MAGIC, sizeof(header->magic)) != 0 ||
+        header->event_size != sizeof(LeaseEvent) || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        header->header_size + (size_t)capacity * header->event_size > (size_t)st.st_size) {
+        fprintf(stderr, "Lease feed %s has an unknown layout\n", name);
+        return 1;
+    }
+    const LeaseEvent *events = (const LeaseEvent *)(base + header->header_size);
+
+    // Our own cursor: the next event we want
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t cursor = head + 1;
+    if (from_oldest) {
+        cursor = head >= capacity ? head - capacity + 1 : 1;
+    }
+    for (;;) {
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (cursor > head) {
+            usleep(POLL_INTERVAL_US);
+            continue;
+        }
+        if (head - cursor >= capacity) {
+            printf("gap: %llu events lost\n", (unsigned long long)(head - capacity + 1 - cursor));
+            cursor = head - capacity + 1;
+        }
+        LeaseEvent event;
+        if (read_event(events, capacity, cursor, &event) < 0) {
+            continue; // overwritten while we looked; the next pass reports the gap
+        }
+        print_event(&event);
+        cursor++;
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n segment] [-a] | -s socket\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = LEASE_FEED_SHM_NAME;
+    const char *socket_path = NULL;
+    int from_oldest = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) name = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0) from_oldest = 1;
+        else usage(argv[0]);
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0); // one line per event, even into a pipe
+    return socket_path != NULL ? follow_socket(socket_path) : follow_ring(name, from_oldest);
+}
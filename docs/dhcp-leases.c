@@ -0,0 +1,175 @@
+// dhcp-leases: reads the DHCP server's lease table straight out of shared memory.
+//
+//   dhcp-leases [-n segment] [-a]        dump active leases (-a: every record)
+//   dhcp-leases [-n segment] <ip|mac>    show the lease for one address or client
+//   dhcp-leases -f snapshot ...          read a file written by the control socket's "snapshot"
+//
+// Build: gcc -Wall -O2 -o dhcp-leases dhcp-leases.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LEASE_SHM_NAME "/dhcp_leases"
+#define LEASE_SHM_MAGIC "DHCPLEAS"
+#define LEASE_SHM_VERSION 1
+
+// Must match the layout documented next to IPLease in test2.c
+typedef struct {
+    uint32_t seq; // odd while the server is updating the record
+    uint32_t ip;  // network byte order
+    uint8_t mac[6];
+    uint8_t state; // 0: free, 1: offered, 2: leased, 3: conflict
+    uint8_t pad;
+    int64_t lease_start;
+    int32_t lease_time;
+    uint32_t reserved;
+} IPLease;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t server_pid;
+    int64_t started;
+    uint8_t reserved[24];
+} LeaseTableHeader;
+
+const char *state_names[] = { "free", "offered", "leased", "conflict" };
+
+// Same seqlock read as the server's lease_read
+void lease_read(const IPLease *lease, IPLease *out) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&lease->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, lease, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&lease->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+int parse_mac(const char *text, uint8_t *mac) {
+    unsigned int b[6];
+    if (sscanf(text, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+        return -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        mac[i] = b[i];
+    }
+    return 0;
+}
+
+void print_lease(const IPLease *lease, time_t now) {
+    char ip[16];
+    struct in_addr addr;
+    addr.s_addr = lease->ip;
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+
+    long remaining = (long)(lease->lease_start + lease->lease_time - now);
+    printf("%-15s  %02x:%02x:%02x:%02x:%02x:%02x  %-7s  %ld\n", ip,
+           lease->mac[0], lease->mac[1], lease->mac[2], lease->mac[3], lease->mac[4], lease->mac[5],
+           lease->state < 4 ? state_names[lease->state] : "?", lease->state != 0 && remaining > 0 ? remaining : 0);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n segment | -f snapshot] [-a] [ip|mac]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = LEASE_SHM_NAME;
+    int from_file = 0;
+    int show_all = 0;
+    const char *query = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) name = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) { name = argv[++i]; from_file = 1; }
+        else if (strcmp(argv[i], "-a") == 0) show_all = 1;
+        else if (argv[i][0] == '-' || query != NULL) usage(argv[0]);
+        else query = argv[i];
+    }
+
+    uint32_t query_ip = 0;
+    uint8_t query_mac[6];
+    int by_mac = 0;
+    if (query != NULL) {
+        if (parse_mac(query, query_mac) == 0) {
+            by_mac = 1;
+        } else if (inet_pton(AF_INET, query, &query_ip) != 1) {
+            fprintf(stderr, "Not an IPv4 or MAC address: %s\n", query);
+            return 2;
+        }
+    }
+
+    int fd = from_file ? open(name, O_RDONLY) : shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(from_file ? name : "shm_open (is the DHCP server running?)");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LeaseTableHeader)) {
+        fprintf(stderr, "Lease table %s is truncated\n", name);
+        return 1;
+    }
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const LeaseTableHeader *header = (const LeaseTableHeader *)base;
+    if (__atomic_load_n(&header->version, __ATOMIC_ACQUIRE) != LEASE_SHM_VERSION ||
+        memcmp(header->magic, LEASE_SHM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(IPLease) ||
+        header->header_size + (size_t)header->capacity * header->record_size > (size_t)st.st_size) {
+        fprintf(stderr, "Lease table %s has an unknown layout\n", name);
+        return 1;
+    }
+
+    const IPLease *records = (const IPLease *)(base + header->header_size);
+    uint32_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    if (count > header->capacity) {
+        count = header->capacity;
+    }
+
+    time_t now = time(NULL);
+    int matched = 0;
+    if (query == NULL) {
+        printf("%-15s  %-17s  %-7s  %s\n", "IP", "MAC", "STATE", "EXPIRES_IN");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        IPLease lease;
+        lease_read(&records[i], &lease);
+        if (query != NULL) {
+            if (by_mac ? memcmp(lease.mac, query_mac, 6) != 0 || lease.state == 0 : lease.ip != query_ip) {
+                continue;
+            }
+        } else if (!show_all && lease.state == 0) {
+            continue;
+        }
+        print_lease(&lease, now);
+        matched++;
+    }
+
+    if (query != NULL && matched == 0) {
+        printf("%s: no lease\n", query);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,359 @@
+// dns-zonec: compiles a hosts or zone file into the DNS zone image the server maps with
+// its dns_zone_file setting. The image is served in place, so startup costs one mmap
+// however many names it holds.
+//
+//   dns-zonec <input> <image>
+//
+// Input lines are either "address name [alias...]" as in /etc/hosts, or zone style
+// "name [ttl] [IN] A address". '#' and ';' start comments; IPv6 and other record types
+// are skipped. A name listed with several addresses gets them all as A records.
+//
+// Build: gcc -Wall -O2 -o dns-zonec dns-zonec.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#define DNS_ZONE_MAGIC "DHCPZONE"
+#define DNS_ZONE_VERSION 1
+#define DNS_MAX_WIRE_NAME 255
+
+// Must match the layout documented next to DNSZoneHeader in test2.c
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t num_names;
+    uint32_t num_addrs;
+    uint32_t index_capacity;
+    uint32_t names_size;
+    uint64_t index_offset;
+    uint64_t records_offset;
+    uint64_t addrs_offset;
+    uint64_t names_offset;
+    uint64_t file_size;
+} DNSZoneHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t record; // record index + 1, 0 when empty
+} DNSSlot;
+
+typedef struct {
+    uint32_t name;
+    uint32_t addrs;
+    uint16_t num_addrs;
+    uint8_t name_len;
+    uint8_t pad;
+} DNSZoneRecord;
+
+// While compiling: each name's addresses are a chain through addr_next
+typedef struct {
+    uint32_t name;
+    uint8_t name_len;
+    uint16_t num_addrs;
+    int32_t first_addr;
+    int32_t last_addr;
+} Name;
+
+uint8_t *names;
+uint32_t names_used, names_capacity;
+Name *name_list;
+uint32_t num_names, name_capacity;
+uint32_t *addr_values;
+int32_t *addr_next;
+uint32_t num_addrs, values_capacity, next_capacity;
+DNSSlot *index_slots;
+uint32_t index_capacity;
+
+// Same hash as the server's hash_bytes
+uint64_t hash64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed) {
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash64(h);
+}
+
+// Same normalization as the server's dns_name_to_wire: lowercase, no trailing dot
+int dns_name_to_wire(const char *text, uint8_t *wire) {
+    int len = 0;
+    const char *label = text;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        int label_len = dot != NULL ? dot - label : (int)strlen(label);
+        if (label_len == 0 || label_len > 63 || len + 1 + label_len + 1 > DNS_MAX_WIRE_NAME) {
+            return -1;
+        }
+        wire[len++] = label_len;
+        for (int i = 0; i < label_len; i++) {
+            wire[len++] = tolower((unsigned char)label[i]);
+        }
+        if (dot == NULL) break;
+        label = dot + 1;
+    }
+    wire[len++] = 0;
+    return len > 1 ? len : -1;
+}
+
+void *grow(void *array, uint32_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    size_t grown = *capacity ? *capacity : 1024;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    if (grown > UINT32_MAX) {
+        fprintf(stderr, "Zone too large\n");
+        exit(1);
+    }
+    void *resized = realloc(array, grown * item_size);
+    if (resized == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    *capacity = grown;
+    return resized;
+}
+
+// Fills 'slots' from name_list; 'capacity' is a power of two larger than num_names
+void build_index(DNSSlot *slots, uint32_t capacity) {
+    memset(slots, 0, (size_t)capacity * sizeof(DNSSlot));
+    for (uint32_t i = 0; i < num_names; i++) {
+        uint32_t hash = (uint32_t)hash_bytes(names + name_list[i].name, name_list[i].name_len, 0);
+        uint32_t pos = hash & (capacity - 1);
+        while (slots[pos].record != 0) {
+            pos = (pos + 1) & (capacity - 1);
+        }
+        slots[pos].hash = hash;
+        slots[pos].record = i + 1;
+    }
+}
+
+void add_name(const uint8_t *wire, int len, uint32_t addr) {
+    if ((num_names + 1) * 4 > index_capacity * 3) {
+        uint32_t capacity = index_capacity ? index_capacity * 2 : 1024;
+        free(index_slots);
+        index_slots = malloc((size_t)capacity * sizeof(DNSSlot));
+        if (index_slots == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        index_capacity = capacity;
+        build_index(index_slots, index_capacity);
+    }
+
+    uint32_t hash = (uint32_t)hash_bytes(wire, len, 0);
+    uint32_t pos = hash & (index_capacity - 1);
+    Name *name = NULL;
+    for (; index_slots[pos].record != 0; pos = (pos + 1) & (index_capacity - 1)) {
+        Name *n = &name_list[index_slots[pos].record - 1];
+        if (index_slots[pos].hash == hash && n->name_len == len && memcmp(names + n->name, wire, len) == 0) {
+            name = n;
+            break;
+        }
+    }
+    if (name == NULL) {
+        names = grow(names, &names_capacity, (size_t)names_used + len, 1);
+        name_list = grow(name_list, &name_capacity, (size_t)num_names + 1, sizeof(Name));
+        name = &name_list[num_names];
+        name->name = names_used;
+        name->name_len = len;
+        name->num_addrs = 0;
+        name->first_addr = name->last_addr = -1;
+        memcpy(names + names_used, wire, len);
+        names_used += len;
+        index_slots[pos].hash = hash;
+        index_slots[pos].record = ++num_names;
+    }
+
+    for (int32_t a = name->first_addr; a >= 0; a = addr_next[a]) {
+        if (addr_values[a] == addr) {
+            return; // listed twice
+        }
+    }
+    if (name->num_addrs == UINT16_MAX) {
+        return;
+    }
+    addr_values = grow(addr_values, &values_capacity, (size_t)num_addrs + 1, sizeof(uint32_t));
+    addr_next = grow(addr_next, &next_capacity, (size_t)num_addrs + 1, sizeof(int32_t));
+    addr_values[num_addrs] = addr;
+    addr_next[num_addrs] = -1;
+    if (name->last_addr >= 0) {
+        addr_next[name->last_addr] = num_addrs;
+    } else {
+        name->first_addr = num_addrs;
+    }
+    name->last_addr = num_addrs++;
+    name->num_addrs++;
+}
+
+int add_text(const char *text, uint32_t addr, const char *path, long line_no) {
+    uint8_t wire[DNS_MAX_WIRE_NAME];
+    int len = dns_name_to_wire(text, wire);
+    if (len < 0) {
+        fprintf(stderr, "%s:%ld: invalid name %s\n", path, line_no, text);
+        return -1;
+    }
+    add_name(wire, len, addr);
+    return 0;
+}
+
+int parse_input(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int errors = 0;
+    long line_no = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) >= 0) {
+        line_no++;
+        line[strcspn(line, "#;\r\n")] = '\0';
+
+        char *save;
+        char *tokens[64];
+        int count = 0;
+        for (char *tok = strtok_r(line, " \t", &save); tok != NULL && count < 64; tok = strtok_r(NULL, " \t", &save)) {
+            tokens[count++] = tok;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        uint32_t addr;
+        if (inet_pton(AF_INET, tokens[0], &addr) == 1) {
+            // address name [alias...]
+            if (count < 2) {
+                fprintf(stderr, "%s:%ld: address without a name\n", path, line_no);
+                errors++;
+            }
+            for (int i = 1; i < count; i++) {
+                errors += add_text(tokens[i], addr, path, line_no) < 0;
+            }
+        } else if (strchr(tokens[0], ':') != NULL) {
+            continue; // IPv6 hosts entry
+        } else {
+            // name [ttl] [IN] type data
+            int i = 1;
+            if (i < count && isdigit((unsigned char)tokens[i][0])) i++;
+            if (i < count && strcasecmp(tokens[i], "IN") == 0) i++;
+            if (i + 1 >= count) {
+                fprintf(stderr, "%s:%ld: cannot parse line\n", path, line_no);
+                errors++;
+            } else if (strcasecmp(tokens[i], "A") == 0) {
+                if (inet_pton(AF_INET, tokens[i + 1], &addr) != 1) {
+                    fprintf(stderr, "%s:%ld: invalid address %s\n", path, line_no, tokens[i + 1]);
+                    errors++;
+                } else {
+                    errors += add_text(tokens[0], addr, path, line_no) < 0;
+                }
+            }
+        }
+    }
+    free(line);
+    fclose(file);
+    return errors > 0 ? -1 : 0;
+}
+
+size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+int write_image(const char *path) {
+    DNSZoneHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DNS_ZONE_MAGIC, sizeof(header.magic));
+    header.version = DNS_ZONE_VERSION;
+    header.header_size = sizeof(DNSZoneHeader);
+    header.num_names = num_names;
+    header.num_addrs = num_addrs;
+    header.names_size = names_used;
+
+    // At most 3/4 full, so a probe always ends at an empty slot
+    uint32_t capacity = 16;
+    while (capacity * 3 < (uint64_t)num_names * 4 + 4) {
+        capacity *= 2;
+    }
+    header.index_capacity = capacity;
+    header.index_offset = align8(sizeof(DNSZoneHeader));
+    header.records_offset = align8(header.index_offset + (size_t)capacity * sizeof(DNSSlot));
+    header.addrs_offset = align8(header.records_offset + (size_t)num_names * sizeof(DNSZoneRecord));
+    header.names_offset = align8(header.addrs_offset + (size_t)num_addrs * sizeof(uint32_t));
+    header.file_size = header.names_offset + names_used;
+
+    uint8_t *image = calloc(1, header.file_size);
+    if (image == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    memcpy(image, &header, sizeof(header));
+    build_index((DNSSlot *)(image + header.index_offset), capacity);
+
+    // Each name's addresses end up next to each other
+    DNSZoneRecord *records = (DNSZoneRecord *)(image + header.records_offset);
+    uint32_t *addrs = (uint32_t *)(image + header.addrs_offset);
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < num_names; i++) {
+        records[i].name = name_list[i].name;
+        records[i].name_len = name_list[i].name_len;
+        records[i].addrs = next;
+        records[i].num_addrs = name_list[i].num_addrs;
+        for (int32_t a = name_list[i].first_addr; a >= 0; a = addr_next[a]) {
+            addrs[next++] = addr_values[a];
+        }
+    }
+    memcpy(image + header.names_offset, names, names_used);
+
+    // Written beside the target and renamed, so a running server's image is never torn
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        perror(tmp_path);
+        free(image);
+        return -1;
+    }
+    int failed = fwrite(image, 1, header.file_size, out) != header.file_size;
+    failed |= fclose(out) != 0;
+    free(image);
+    if (failed || rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <hosts or zone file> <image>\n", argv[0]);
+        return 2;
+    }
+    if (parse_input(argv[1]) < 0) {
+        return 1;
+    }
+    if (write_image(argv[2]) < 0) {
+        return 1;
+    }
+    printf("%s: %u names, %u addresses\n", argv[2], num_names, num_addrs);
+    return 0;
+}
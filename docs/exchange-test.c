@@ -0,0 +1,61 @@
+// exchange-test: checks the server's per-worker pool of exchange frames. Exchanges that are
+// suspended at the same time (on a conflict probe or a replication ack) must never share a frame.
+//
+// Build: gcc -Wall -O2 -o exchange-test exchange-test.c -lpthread
+#define main dhcpd_main
+#include "test2.c"
+#undef main
+
+int failures;
+
+void check(int ok, const char *what) {
+    printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+    failures += !ok;
+}
+
+int main() {
+    // The frame pool as setup_worker builds it
+    Worker w;
+    memset(&w, 0, sizeof(w));
+    w.exchanges = calloc(MAX_EXCHANGES, sizeof(Exchange));
+    if (w.exchanges == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < MAX_EXCHANGES; i++) {
+        w.exchanges[i].next_free = i + 1 < MAX_EXCHANGES ? i + 1 : -1;
+    }
+
+    // Two exchanges in flight, then the first one finishes while the second is still suspended
+    Exchange *a = exchange_alloc(&w);
+    Exchange *b = exchange_alloc(&w);
+    check(a != NULL && b != NULL && a != b, "two exchanges at once get different frames");
+    exchange_free(&w, a);
+    Exchange *c = exchange_alloc(&w);
+    Exchange *d = exchange_alloc(&w);
+    check(c != NULL && d != NULL && c != b && d != b && c != d, "frames reused after a free stay distinct");
+    check(w.exchanges_in_use == 3, "exchanges_in_use counts the frames handed out");
+    exchange_free(&w, b);
+    exchange_free(&w, c);
+    exchange_free(&w, d);
+    check(w.exchanges_in_use == 0, "exchanges_in_use is back to 0 once all are freed");
+
+    // After that churn every frame can still be handed out exactly once, and then the pool is empty
+    uint8_t *seen = calloc(MAX_EXCHANGES, 1);
+    int distinct = 1;
+    for (int i = 0; i < MAX_EXCHANGES; i++) {
+        Exchange *x = exchange_alloc(&w);
+        if (x == NULL || seen[x - w.exchanges]) {
+            distinct = 0;
+            break;
+        }
+        seen[x - w.exchanges] = 1;
+    }
+    check(distinct, "all MAX_EXCHANGES frames are handed out once each");
+    check(exchange_alloc(&w) == NULL, "a full pool refuses another exchange");
+
+    free(seen);
+    free(w.exchanges);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
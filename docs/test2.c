@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +10,33 @@
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <linux/sock_diag.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/random.h>
+#include <linux/icmp.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
 
-#define MAX_CLIENTS 100
+#define MAX_CLIENTS 65536
 #define IP_POOL_START "192.168.1.100"
 #define IP_POOL_END "192.168.1.200"
 #define SERVER_IP "0.0.0.0"
@@ -19,14 +45,161 @@
 #define MAX_DHCP_PACKET_SIZE 1024
 #define LOG_FILE "dhcp_server.log"
 #define CONFIG_FILE "dhcp_config.txt"
-#define MAX_DNS_ENTRIES 100
 #define MAX_DOMAIN_NAME_LENGTH 256
 #define LEASE_THRESHOLD 0.8
+#define DNS_SERVER_PORT 653
+#define MAX_WORKERS 16
+#define TASK_THREADS 2 // default size of the pool for slow side work
+#define MAX_TASK_THREADS 16
+#define TASK_QUEUE_SIZE 1024 // per task thread, power of two
+#define LOG_BUFFER_SIZE (1 << 16) // log text waiting for the task pool to write it
+#define MAX_EVENTS 64
+#define RECV_BATCH 32
+#define LEASE_CLEANUP_INTERVAL 60 // seconds
+#define STATS_INTERVAL 60 // seconds
+#define IO_BACKEND_SOCKET 0
+#define IO_BACKEND_URING 1
+#define IO_BACKEND_PACKET 2
+#define PACKET_BLOCK_SIZE (1 << 16)
+#define PACKET_FRAME_SIZE 2048
+#define PACKET_RX_BLOCKS 64
+#define PACKET_TX_FRAMES 256
+#define DHCP_MAGIC_COOKIE 0x63825363
+#define DHCP_MIN_LENGTH 240 // fixed BOOTP header + magic cookie
+#define MAX_ALLOWED_HTYPES 8
+#define MAX_LEASEQUERY_REQUESTORS 16
+#define FILTER_DROP 0xff // placeholder jump target for the BPF builder
+#define FILTER_MAX_INSNS 48
+#define RATE_LIMIT_SETS 16384 // power of two; 4 ways each, 64k buckets in 2MB
+#define RATE_LIMIT_WAYS 4
+#define RATE_LIMIT_MAX_BURST 100000 // relay buckets hold ten bursts, in thousandths of a packet
+#define RATE_KEY_MAC 0x6d6163ULL
+#define RATE_KEY_RELAY 0x72656c6179ULL
+#define RATE_KEY_CIRCUIT 0x63697263ULL
+#define RECV_ROUNDS 16 // recvmmsg calls per wakeup, so queues see the backlog before we pick
+#define PACKET_QUEUE_DEPTH 1024
+#define PROCESS_BUDGET 64 // packets handled per loop pass before polling the sockets again
+#define QUEUE_RENEW 0
+#define QUEUE_REQUEST 1
+#define QUEUE_DISCOVER_RETRY 2
+#define QUEUE_DISCOVER 3
+#define NUM_QUEUES 4
+#define LEASE_INDEX_MIN 1024
+#define MAX_READER_THREADS 64
+#define MAX_RETIRED 64
+#define OFFER_TIMEOUT 60 // seconds an offered address stays reserved
+#define MAX_EXCHANGES 1024 // exchange frames per worker, power of two
+#define EXCHANGE_INDEX_BITS 10
+#define EXCHANGE_WAIT_NONE 0
+#define EXCHANGE_WAIT_TIMER 1
+#define EXCHANGE_WAIT_ECHO 2 // an ICMP echo reply, or the deadline
+#define EXCHANGE_WAIT_REPLICATED 3 // the standby acknowledging the journal up to journal_seq
+#define REPL_JOURNAL_SIZE 65536 // lease writes a reconnecting standby can catch up on, power of two
+#define REPL_BATCH 256 // records per message
+#define REPL_MAX_RECORDS REPL_BATCH
+#define REPL_HEARTBEAT_MS 200
+#define REPL_FAILOVER_MS 3000
+#define REPL_HELLO 1        // standby: last applied seq of 'stream'
+#define REPL_RECORDS 2      // count records from seq on, or part of a snapshot if seq is 0
+#define REPL_SNAPSHOT 3     // the whole table follows, drop what you have
+#define REPL_SNAPSHOT_END 4 // the snapshot covers the journal up to seq
+#define REPL_HEARTBEAT 5
+#define REPL_ACK 6          // standby: applied up to seq
+#define MAX_LB_SERVERS 16 // servers sharing a segment's clients
+#define LB_FAILOVER_SECS 3 // a server not heard from for this long has its clients taken over
+#define LB_MAGIC "DHCPLB1"
+#define CONFLICT_PROBE_CACHE 60 // seconds an address that didn't answer is offered without probing
+#define LEASE_FEED_SHM_NAME "/dhcp_lease_feed"
+#define LEASE_FEED_MAGIC "DHCPFEED"
+#define LEASE_FEED_VERSION 1
+#define LEASE_FEED_SIZE 16384 // events kept for consumers, power of two
+#define LEASE_EVENT_GRANT 1
+#define LEASE_EVENT_RENEW 2
+#define LEASE_EVENT_RELEASE 3
+#define LEASE_EVENT_EXPIRE 4
+#define LEASE_EVENT_DECLINE 5 // the client found the address in use
+#define LEASE_EVENT_GAP 255   // socket feed only: the events before 'seq' were overwritten unread
+#define MAX_FEED_CONNS 8
+#define LEASE_SHM_NAME "/dhcp_leases"
+#define LEASE_SHM_MAGIC "DHCPLEAS"
+#define LEASE_SHM_VERSION 1
+#define MAX_POOLS 16
+#define POOL_OPTIONS_MAX 32
+#define LRU_UNLINKED -2
+#define DNS_MAX_WIRE_NAME 255
+#define DNS_MAX_ADDRS 32768 // A records per name
+#define DNS_INDEX_MIN 1024
+#define DNS_ADDR_CLASSES 16 // address block sizes 1 to DNS_MAX_ADDRS
+#define DNS_MAX_NAMES 65536 // client names registered at once
+#define DNS_COMPACT_MIN 16384 // bytes of dead names before the arena is rewritten
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_UDP 512 // no EDNS: replies that don't fit are truncated
+#define DNS_MAX_ANSWERS 64
+#define DNS_A_ANSWER_SIZE 16 // compressed owner, type, class, TTL, rdlength, address
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define DNS_CLASS_ANY 255
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_NOTIMP 4
+#define DNS_RCODE_REFUSED 5
+#define DNS_DOMAIN "lan"
+#define DNS_ZONE_MAGIC "DHCPZONE"
+#define DNS_ZONE_VERSION 1
+#define DNS_TYPE_SOA 6
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_MAX_UPSTREAMS 4
+#define DNS_MAX_PENDING 1024 // upstream queries in flight
+#define DNS_MAX_WAITERS 16   // clients sharing one in-flight query
+#define DNS_UPSTREAM_TIMEOUT_MS 1500
+#define DNS_UPSTREAM_TRIES 3
+#define DNS_CACHE_SETS 1024  // power of two; 4 ways each
+#define DNS_CACHE_WAYS 4
+#define DNS_CACHE_MAX_TTLS 32 // records per cached response
+#define DNS_CACHE_MAX_TTL 86400
+#define DNS_NEGATIVE_MAX_TTL 900
+#define ALLOC_HASH_SEED 0x616c6c6f63ULL
+#define RESERVATION_BUCKET_LOAD 4 // average keys per hash-and-displace bucket
+#define RESERVATION_MAX_BUCKET 64
+#define RESERVATION_MAX_TRIES (1 << 16)
+#define CONTROL_SOCKET "dhcp_control.sock"
+#define LEASE_SNAPSHOT_FILE "dhcp_leases.snapshot"
+#define MAX_CONTROL_CONNS 8
+#define CONTROL_BATCH 256 // records a dump advances per loop pass
+#define CONTROL_JOB_NONE 0
+#define CONTROL_JOB_DUMP 1
+#define CONTROL_JOB_SNAPSHOT 2
+#define MAX_BULK_CONNS 4
+#define BULK_MAX_MESSAGE 1024 // longest bulk leasequery message we accept
+#define URING_ENTRIES 256
+#define URING_GROUPS 2 // provided buffer group per socket: 0 = DHCP, 1 = DNS
+#define URING_BUFFERS 256 // per group, must be a power of two
+#define URING_BUFFER_SIZE 1024 // io_uring_recvmsg_out + source address + datagram
+#define URING_SEND_SLOTS 256
+#define URING_OP_RECV 1ULL
+#define URING_OP_SEND 2ULL
+#define URING_TAG(op, index) (((op) << 32) | (uint64_t)(index))
+
+// Stackless coroutines for handlers that span several events, in the protothreads style:
+// CO_AWAIT records where to resume and returns to the loop. Locals don't survive it, so
+// anything needed afterwards lives in the frame.
+#define CO_BEGIN(x) switch ((x)->resume) { case 0:
+#define CO_AWAIT(x) do { (x)->resume = __LINE__; return 0; case __LINE__:; } while (0)
+#define CO_RETURN(x) return 1
+#define CO_END(x) } return 1
 
 FILE *log_file = NULL;
 int server_running = 1;
 
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;      // the pending log buffer
+pthread_mutex_t log_file_mutex = PTHREAD_MUTEX_INITIALIZER; // log_file, held while writing it
+char log_buffers[2][LOG_BUFFER_SIZE]; // one fills while the other is written
+int log_pending_buffer;
+int log_pending_len;
+int log_flush_queued;
+int log_reopen_requested;
 pthread_mutex_t lease_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
@@ -47,60 +220,647 @@ typedef struct {
     uint8_t options[312];
 } DHCPPacket;
 
+// The lease table lives in the shared-memory segment LEASE_SHM_NAME so tools such as
+// dhcp-leases can read it without talking to the server. Layout (version 1, host byte
+// order unless noted): a 64-byte LeaseTableHeader followed by 'capacity' 32-byte IPLease
+// records, of which the first 'count' are in use. Records are seqlocked: copy one while
+// 'seq' is even and unchanged before and after the copy. Keep dhcp-leases.c in sync.
 typedef struct {
-    char ip[16];
-    char mac[18];
-    time_t lease_start;
-    int lease_time;
-    int state; // 0: free, 1: offered, 2: leased
+    uint32_t seq; // odd while a writer is updating the record
+    uint32_t ip;  // network byte order
+    uint8_t mac[6];
+    uint8_t state; // 0: free, 1: offered, 2: leased, 3: conflict (quarantined until expiry)
+    uint8_t pad;
+    int64_t lease_start; // unix time
+    int32_t lease_time;  // seconds
+    uint32_t reserved;
 } IPLease;
 
+typedef struct {
+    char magic[8];        // LEASE_SHM_MAGIC, not NUL-terminated
+    uint32_t version;     // LEASE_SHM_VERSION
+    uint32_t header_size; // offset of the first record
+    uint32_t record_size; // sizeof(IPLease)
+    uint32_t capacity;
+    uint32_t count;       // records in use, published with a release store
+    uint32_t server_pid;
+    int64_t started;      // unix time the server created the segment
+    uint8_t reserved[24];
+} LeaseTableHeader;
+
+_Static_assert(sizeof(IPLease) == 32, "IPLease is part of the shared lease table layout");
+_Static_assert(sizeof(LeaseTableHeader) == 64, "LeaseTableHeader is part of the shared lease table layout");
+
+// Lease change feed segment lease_feed_shm (version 1, host byte order unless noted): a 64-byte
+// LeaseFeedHeader followed by 'capacity' 48-byte LeaseEvent slots. Event n (counting from 1)
+// goes in slot n & (capacity - 1); 'head' is the newest. A slot holds event n while its 'seq'
+// reads n before and after the copy; anything else means it was overwritten. Keep
+// dhcp-lease-feed.c in sync.
+typedef struct {
+    uint64_t seq;
+    int64_t time;        // unix time of the change
+    int64_t lease_start; // of the lease granted or ended; of the quarantine for a decline
+    uint32_t ip;         // network byte order
+    int32_t lease_time;
+    uint8_t mac[6];
+    uint8_t type; // LEASE_EVENT_*
+    uint8_t pad;
+    uint8_t reserved[8];
+} LeaseEvent;
+
+typedef struct {
+    char magic[8]; // LEASE_FEED_MAGIC, not NUL-terminated
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t event_size;
+    uint32_t capacity;
+    uint64_t head; // published with a release store
+    uint32_t server_pid;
+    uint32_t pad;
+    int64_t started;
+    uint8_t reserved[16];
+} LeaseFeedHeader;
+
+_Static_assert(sizeof(LeaseEvent) == 48, "LeaseEvent is part of the lease feed layout");
+_Static_assert(sizeof(LeaseFeedHeader) == 64, "LeaseFeedHeader is part of the lease feed layout");
+
+// Open-addressing index from IP or MAC to a lease record, replaced whole when it grows
+typedef struct {
+    uint32_t capacity; // power of two
+    uint32_t used;     // live entries plus tombstones
+    int32_t slots[];   // record index + 1; 0 empty, -1 tombstone
+} LeaseIndex;
+
+typedef struct {
+    uint64_t epoch; // 0 while the thread is outside a lookup
+    uint8_t pad[56];
+} ReaderEpoch;
+
+typedef struct {
+    void *ptr;
+    uint64_t epoch;
+} RetiredPointer;
+
+// One DNS name: offsets into the name arena and the address pool
+typedef struct {
+    uint32_t name;  // arena offset of the lowercase wire-format name
+    uint32_t addrs; // first address in the pool
+    uint16_t num_addrs;
+    uint16_t addr_capacity;
+    uint8_t name_len; // 0 once reclaimed
+    uint8_t dynamic;  // registered for a lease, counts against dns_max_names
+} DNSRecord;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t record; // record index + 1, 0 when empty
+} DNSSlot;
+
+typedef struct {
+    uint8_t *arena;
+    uint32_t arena_used;
+    uint32_t arena_capacity;
+    uint32_t arena_dead; // bytes of reclaimed names
+    DNSRecord *records;
+    uint32_t num_records; // including reclaimed ones
+    uint32_t records_capacity;
+    uint32_t free_record; // first reclaimed record + 1, linked through 'addrs'
+    uint32_t num_dynamic;
+    uint32_t *addrs; // A records, network byte order
+    uint32_t addrs_used;
+    uint32_t addrs_capacity;
+    uint32_t free_addrs[DNS_ADDR_CLASSES]; // per block size: first free block + 1, linked through its first entry
+    DNSSlot *index;  // power-of-two capacity, at most 3/4 full
+    uint32_t index_capacity;
+} DNSTable;
+
+// Zone image compiled by dns-zonec and mapped read-only from dns_zone_file. Layout
+// (version 1, host byte order, offsets from the start of the file, 8-byte aligned): a
+// DNSZoneHeader, 'index_capacity' DNSSlots hashed with hash_bytes() as in the live table,
+// 'num_names' DNSZoneRecords, 'num_addrs' addresses in network byte order, then the
+// lowercase wire-format names. Keep dns-zonec.c in sync.
+typedef struct {
+    char magic[8]; // DNS_ZONE_MAGIC
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t num_names;
+    uint32_t num_addrs;
+    uint32_t index_capacity; // power of two, at most 3/4 full
+    uint32_t names_size;
+    uint64_t index_offset;
+    uint64_t records_offset;
+    uint64_t addrs_offset;
+    uint64_t names_offset;
+    uint64_t file_size;
+} DNSZoneHeader;
+
+typedef struct {
+    uint32_t name;  // offset into the names section
+    uint32_t addrs; // first address
+    uint16_t num_addrs;
+    uint8_t name_len;
+    uint8_t pad;
+} DNSZoneRecord;
+
+typedef struct {
+    const void *base;
+    size_t size;
+    const DNSZoneHeader *header; // NULL when no zone is mapped
+    const DNSSlot *index;
+    const DNSZoneRecord *records;
+    const uint32_t *addrs;
+    const uint8_t *names;
+} DNSZone;
+
+struct Worker;
+
+// Frame of a multi-step exchange; the handler returns 1 when it is done, 0 at an await
+typedef struct Exchange {
+    int (*handler)(struct Worker *w, struct Exchange *x);
+    int resume; // CO_AWAIT point, 0: start
+    int in_use;
+    int pooled; // 0 for a frame on the stack, which can't await
+    int next_free;
+    uint16_t generation; // bumped on reuse, so a late reply can't resume the wrong exchange
+    int wait;   // EXCHANGE_WAIT_*
+    int result; // of the last await: 1 when the echo was answered
+    uint32_t deadline_ms;
+    uint16_t seq; // of the echo awaited
+    uint32_t wait_ip;
+    uint64_t journal_seq; // of the lease write awaited
+    // The DISCOVER handler's state
+    DHCPPacket packet;
+    struct sockaddr_in client_addr;
+    uint32_t ip;
+    int lease;
+    uint32_t lease_time, t1, t2;
+    int attempt;
+} Exchange;
+
+// A lease's DNS registration to apply; an empty name only removes the old one
+typedef struct {
+    int32_t lease; // lease record index
+    uint32_t ip;
+    uint8_t name_len;
+    uint8_t name[DNS_MAX_WIRE_NAME];
+} DNSUpdate;
+
+typedef struct {
+    uint16_t id; // the client's query ID
+    struct sockaddr_in addr;
+} DNSWaiter;
+
+// An upstream query in flight, found by its random ID through dns_pending_by_id
+typedef struct {
+    uint8_t in_use;
+    uint8_t tries;
+    uint8_t name_len;
+    uint16_t qtype;
+    uint16_t upstream_id;
+    uint64_t key; // dns_cache_key() of the question
+    int upstream_index;
+    struct sockaddr_in upstream; // only this address may answer
+    uint32_t sent_ms;
+    int num_waiters;
+    DNSWaiter waiters[DNS_MAX_WAITERS];
+    uint8_t query[DNS_HEADER_SIZE + DNS_MAX_WIRE_NAME + 4]; // as sent, for retries
+    size_t query_len;
+} DNSPending;
+
+// A cached upstream response, stored whole; the TTL fields are aged in place on a hit
+typedef struct {
+    uint64_t key; // 0 when empty
+    uint32_t stored;  // monotonic seconds
+    uint32_t expires;
+    uint16_t qtype;
+    uint16_t len;
+    uint8_t name_len;
+    uint8_t num_ttls;
+    uint16_t ttl_offsets[DNS_CACHE_MAX_TTLS];
+    uint8_t name[DNS_MAX_WIRE_NAME];
+    uint8_t response[DNS_MAX_UDP];
+} DNSCacheEntry;
+
+typedef struct {
+    uint8_t lock;
+    DNSCacheEntry entries[DNS_CACHE_WAYS];
+} DNSCacheSet;
+
+// Raw query format sent by client/test.c, answered in place
 typedef struct {
     char domain[MAX_DOMAIN_NAME_LENGTH];
     char ip[16];
-} DNSEntry;
+} DNSQuery;
+
+typedef struct {
+    uint8_t data[MAX_DHCP_PACKET_SIZE];
+    struct sockaddr_in addr;
+    struct iovec iov;
+    struct msghdr msg;
+    int next_free;
+} UringSendSlot;
+
+// Raw io_uring (no liburing): multishot recvmsg on provided buffer rings, batched sendmsg
+typedef struct {
+    int ring_fd;
+    int event_fd;
+    void *sq_ring_ptr;
+    void *cq_ring_ptr;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // published to *sq_tail on submit
+    unsigned sq_pending;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring[URING_GROUPS];
+    uint8_t *buffers[URING_GROUPS];
+    struct msghdr recv_msg[URING_GROUPS];
+    UringSendSlot *send_slots;
+    int free_send_slot;
+} IoUring;
+
+// AF_PACKET socket with TPACKET_V3 RX and TX rings mapped back to back
+typedef struct {
+    int fd;
+    int ifindex;
+    uint8_t mac[6];
+    uint32_t ip;
+    uint8_t *map;
+    size_t map_size;
+    size_t rx_size;
+    struct tpacket_req3 rx_req;
+    struct tpacket_req3 tx_req;
+    unsigned rx_block;
+    unsigned tx_frame;
+    unsigned tx_pending;
+} PacketRing;
+
+typedef struct {
+    DHCPPacket packet;
+    struct sockaddr_in addr;
+    uint64_t rx_ns;
+    uint8_t msg_type;
+} QueuedPacket;
+
+// Ring buffer, touched only by its worker (count is read by the stats printer)
+typedef struct {
+    QueuedPacket *items;
+    int head;
+    int count;
+} PacketQueue;
+
+// Address range handed out to one subnet; addresses kept in host byte order for range math
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t subnet_mask; // network byte order
+    uint32_t router;      // network byte order
+    int lease_time;
+    int jitter_percent;         // leases are shortened by up to this much
+    int busy_lease_time;        // used instead of lease_time above busy_threshold_percent, 0 = never
+    int busy_threshold_percent;
+    uint8_t options[POOL_OPTIONS_MAX]; // prebuilt server id, mask, router and DNS options
+    int options_len;
+    uint64_t *reserved; // bit per address held for a reservation, NULL without reservations
+} Pool;
+
+typedef struct {
+    uint8_t mac[6];
+    uint16_t pad;
+    uint32_t ip; // network byte order
+} Reservation;
+
+// Mutable allocation state of one pool, rebuilt for each config generation
+typedef struct {
+    uint32_t start; // host byte order, as in Pool
+    uint32_t end;
+    uint32_t next_fresh; // addresses below this all have a lease record
+    uint32_t used;       // offered or leased records
+    int32_t head;        // least recently released free record, -1 if none
+    int32_t tail;
+} PoolAllocator;
+
+// Minimal perfect hash over the reserved MACs, see reservation_slot()
+typedef struct {
+    uint64_t seed;
+    uint32_t num_buckets;
+    uint32_t size;
+    int32_t *displacements; // per bucket: seed for the second hash, or -(slot + 1)
+    Reservation *slots;
+} ReservationTable;
+
+// Everything a reload can change, built completely before it is published and never
+// modified afterwards; workers read it through their own pointer without locking
+typedef struct Config {
+    uint64_t generation;
+    struct Config *next; // retired list
+    uint32_t server_ip;  // network byte order
+    int default_lease_time;
+    int lease_jitter_percent;     // defaults for pools that don't set their own
+    int busy_lease_time;
+    int busy_threshold_percent;
+    Pool pools[MAX_POOLS];
+    int num_pools;
+    int allowed_htypes[MAX_ALLOWED_HTYPES];
+    int num_allowed_htypes;
+    uint8_t htype_allowed[256];
+    uint32_t rate_limit_mac;     // DISCOVER/REQUEST per second per client
+    uint32_t rate_limit_relay;   // per relay agent
+    uint32_t rate_limit_circuit; // per circuit-id
+    uint32_t rate_limit_burst;
+    int queue_deadline_ms;   // queued packets older than this are dropped unanswered
+    int discover_retry_secs; // DISCOVERs with secs >= this are served before fresh ones
+    uint32_t dns_ttl;
+    uint8_t dns_domain[DNS_MAX_WIRE_NAME]; // suffix of PTR names made up for leases, wire format
+    int dns_domain_len;
+    int dns_register; // publish client hostnames (options 81/12) under dns_domain
+    struct sockaddr_in upstreams[DNS_MAX_UPSTREAMS]; // other names are forwarded here
+    int num_upstreams;
+    int conflict_probe_ms; // ping fresh addresses this long before offering them, 0: don't
+    int conflict_probe_attempts; // pings per address
+    int conflict_quarantine_secs; // for addresses that answered or were declined
+    int replication_wait_ms; // longest an ACK waits for the standby to have the lease, 0: don't wait
+    int lb_max_secs; // serve another server's clients once they've been trying this long, 0: never
+    uint32_t leasequery_requestors[MAX_LEASEQUERY_REQUESTORS]; // network byte order; none: leasequery refused
+    int num_leasequery_requestors;
+    ReservationTable reservations;
+} Config;
+
+// Side work kept off the packet path: 'run' executes on a task thread, then 'complete', if
+// set, runs back on the owner's loop. Embedded at the start of a larger struct
+typedef struct Task {
+    struct Task *next;
+    void (*run)(struct Task *task);
+    void (*complete)(struct Worker *w, struct Task *task);
+    int owner; // worker id, -1 when there is no completion
+} Task;
+
+// One per thread: a single non-blocking epoll loop over its own sockets
+typedef struct Worker {
+    int id;
+    int epoll_fd;
+    int dhcp_sock;
+    int dns_sock;
+    int upstream_sock; // forwarded DNS queries and their answers
+    int timer_fd;  // worker 0 only
+    int signal_fd; // worker 0 only
+    int wake_fd;   // eventfd used to interrupt epoll_wait on shutdown
+    int control_fd; // worker 0 only, -1 when disabled
+    int bulk_fd;    // worker 0 only, bulk leasequery listener or -1
+    int feed_fd;    // worker 0 only, lease feed socket listener or -1
+    uint64_t ticks;
+    int io_backend;
+    Config *config;              // snapshot used for the current loop pass
+    uint64_t config_generation;  // read by reclaim_configs()
+    IoUring ring;
+    PacketRing packet;
+    PacketQueue queues[NUM_QUEUES]; // admission queues, highest priority first
+    Task *completed; // finished tasks, pushed by task threads before they signal wake_fd
+    Exchange *exchanges; // frame pool
+    int free_exchange;   // head of the free list, -1 when all are in use
+    int exchanges_in_use;
+    int exchange_timer_fd; // fires at the earliest exchange deadline
+    int exchange_timer_armed;
+    uint32_t exchange_timer_ms;
+    int probe_sock; // ICMP, -1 when conflict probing is unavailable
+    int probe_raw;  // 1: raw socket, 0: ping socket
+    uint16_t probe_ident;
+    int replication_waiters; // exchanges holding an ACK for the standby
+    pthread_t thread;
+} Worker;
+
+typedef struct {
+    Task *inbox; // lock-free stack that submitters push onto
+    uint8_t lock; // guards the ring against thieves
+    uint32_t head;
+    uint32_t tail;
+    Task *ring[TASK_QUEUE_SIZE];
+    pthread_t thread;
+} __attribute__((aligned(128))) TaskQueue;
+
+// An admin connection; a long answer is produced a batch at a time as the client drains it
+typedef struct {
+    int fd; // -1 when the slot is free
+    char in[256];
+    int in_len;
+    char out[16384];
+    int out_len;
+    int out_off;
+    int job;    // CONTROL_JOB_*
+    int cursor; // next lease record
+    int job_end;
+    int dump_all;
+    int closing;
+    struct SnapshotTask *snapshot; // while a snapshot is being written for this connection
+} ControlConn;
+
+// A bulk leasequery connection (RFC 6926): DHCP messages both ways, each after a two-byte
+// length. A query for every binding is answered from a private copy of the table
+typedef struct {
+    int fd; // -1 when the slot is free
+    uint8_t in[2 + BULK_MAX_MESSAGE];
+    int in_len;
+    uint8_t out[16384];
+    int out_len;
+    int out_off;
+    DHCPPacket query; // being answered
+    IPLease *snapshot; // while a whole-table answer streams
+    int count;
+    int cursor;
+    time_t now;
+} BulkConn;
+
+// A lease feed socket consumer; it is sent LeaseEvents from its own cursor
+typedef struct {
+    int fd; // -1 when the slot is free
+    uint64_t cursor; // next event to send
+    uint8_t out[256 * sizeof(LeaseEvent)];
+    int out_len;
+    int out_off;
+} FeedConn;
+
+typedef struct SnapshotTask {
+    Task task;
+    ControlConn *conn; // NULL once the connection is gone
+    int count;
+    int error;
+} SnapshotTask;
+
+typedef struct {
+    uint64_t seq;
+    IPLease lease;
+} JournalEntry;
+
+// Every replication message starts with this, followed by 'count' IPLease records
+typedef struct {
+    uint8_t type; // REPL_*
+    uint8_t pad[3];
+    uint32_t count;
+    uint64_t seq;
+    uint64_t stream; // picked at random each time a server becomes active
+} ReplHeader;
+
+// Counters shared by all workers, bumped with relaxed atomics
+typedef struct {
+    uint64_t packets_received;
+    uint64_t packets_malformed; // got past (or around) the kernel filter but failed validation
+    uint64_t replies_sent;
+    uint64_t rate_limited_mac;
+    uint64_t rate_limited_relay;
+    uint64_t rate_limited_circuit;
+    uint64_t rate_limit_evictions;
+    uint64_t shed_deadline;
+    uint64_t shed_overflow;
+    uint64_t dns_answered;
+    uint64_t dns_nxdomain;
+    uint64_t dns_rejected; // FORMERR, NOTIMP or REFUSED
+    uint64_t dns_forwarded;
+    uint64_t dns_cache_hits;
+    uint64_t dns_upstream_failures;
+    uint64_t dns_names_refused; // client names beyond dns_max_names
+    uint64_t conflict_probes;
+    uint64_t conflicts_found;
+    uint64_t tasks_run;
+    uint64_t tasks_stolen;
+    uint64_t log_lines_dropped; // the log buffer was full
+    uint64_t replication_records;
+    uint64_t lb_not_ours; // left to the server owning the client's hash bucket
+    uint64_t leasequeries;
+    uint64_t bulk_leasequeries;
+    uint64_t leasequeries_refused; // from a host not in leasequery_requestors
+    uint64_t feed_gaps; // socket consumers that fell a ring behind
+} ServerStats;
+
+typedef struct {
+    uint64_t key;
+    uint32_t last_ms;
+    uint32_t tokens; // thousandths of a packet
+} RateLimitEntry;
+
+typedef struct {
+    uint8_t lock;
+    RateLimitEntry entries[RATE_LIMIT_WAYS];
+} __attribute__((aligned(128))) RateLimitSet;
+
+ServerStats stats;
+RateLimitSet rate_limiter[RATE_LIMIT_SETS];
+#define STAT_INC(field) __atomic_add_fetch(&stats.field, 1, __ATOMIC_RELAXED)
 
-IPLease ip_leases[MAX_CLIENTS];
+LeaseTableHeader *lease_table;
+size_t lease_table_size;
+IPLease *ip_leases;
 int num_leases = 0;
+int max_leases;
+char lease_shm_name[NAME_MAX];
+char control_socket_path[108]; // sun_path size; empty disables the socket
+char lease_snapshot_file[PATH_MAX];
+char dns_zone_file[PATH_MAX]; // empty: no compiled zone
+char replication_peer_text[64]; // ip:port, empty: no replication
+char replication_role[16];
+int replication_port;
+int replication_heartbeat_ms;
+int replication_failover_ms;
+char lb_servers_text[256]; // ip:port of every server sharing the clients, in index order
+int lb_index;
+int lb_failover_secs;
+int dns_max_names;
+struct sockaddr_in lb_servers[MAX_LB_SERVERS];
+int num_lb_servers = 0; // 0 or 1: every client is ours
+int lb_sock = -1; // heartbeats, worker 0 only
+uint32_t lb_last_heard_ms[MAX_LB_SERVERS]; // worker 0 only
+uint32_t lb_alive; // bit per server believed up, written by worker 0
+char lease_snapshot_tmp[PATH_MAX + 4];
+ControlConn control_conns[MAX_CONTROL_CONNS]; // worker 0 only
+int bulk_leasequery_port; // TCP, 0: no bulk leasequery
+char lease_feed_shm[NAME_MAX]; // empty: the feed is only kept for the socket, if any
+char lease_feed_socket[108];   // empty: no socket
+int lease_feed_size;
+LeaseFeedHeader *lease_feed; // NULL when there is neither
+size_t lease_feed_bytes;
+LeaseEvent *lease_events;
+int lease_feed_sleeping; // worker 0 has sent everything and waits on feed_event_fd
+int feed_event_fd = -1;
+FeedConn feed_conns[MAX_FEED_CONNS]; // worker 0 only
+BulkConn bulk_conns[MAX_BULK_CONNS]; // worker 0 only
+LeaseIndex *ip_index;
+LeaseIndex *mac_index;
 
-DNSEntry dns_table[MAX_DNS_ENTRIES];
-int dns_entries = 0;
+int32_t *lru_prev; // per lease record, LRU_UNLINKED when not on a free list
+int32_t *lru_next;
+PoolAllocator allocators[MAX_POOLS];
+int num_allocators = 0;
+uint64_t alloc_generation = 0;
 
-char ip_pool_start[16];
-char ip_pool_end[16];
-char server_ip[16];
+ReaderEpoch reader_epochs[MAX_READER_THREADS];
+int num_reader_slots = 0;
+uint64_t global_epoch = 1;
+RetiredPointer retired[MAX_RETIRED]; // writer-only, under lease_mutex
+int num_retired = 0;
+
+DNSTable dns;
+DNSZone dns_zone;
+pthread_rwlock_t dns_lock = PTHREAD_RWLOCK_INITIALIZER;
+uint32_t *lease_dns_names; // per lease record: its registered name's record index + 1, or 0
+DNSUpdate *dns_updates;    // queued under dns_updates_mutex, itself taken under lease_mutex
+int num_dns_updates;
+int dns_updates_capacity;
+int dns_update_queued;     // dns_update_task is on the pool and hasn't taken the queue yet
+pthread_mutex_t dns_updates_mutex = PTHREAD_MUTEX_INITIALIZER;
+DNSUpdate *dns_batch;      // the updates being applied, under dns_lock
+int dns_batch_capacity;
+DNSPending dns_pending[DNS_MAX_PENDING];
+uint16_t dns_pending_by_id[65536]; // upstream ID -> pending index + 1
+pthread_mutex_t dns_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t dns_id_seed;
+uint64_t dns_id_counter;
+unsigned dns_next_upstream;
+DNSCacheSet dns_cache[DNS_CACHE_SETS];
+uint32_t *probe_clean_until; // per lease record: monotonic second until which it needs no probe
+
+// Settings below are read once at startup; everything reloadable lives in Config
 int dhcp_server_port;
 int dhcp_client_port;
-int default_lease_time;
+int dns_server_port;
+int num_workers;
+int io_backend;
+char packet_interface[IFNAMSIZ];
 
-void load_config() {
-    FILE *config_file = fopen(CONFIG_FILE, "r");
-    if (config_file == NULL) {
-        fprintf(stderr, "Error opening config file. Using default values.\n");
-        strcpy(ip_pool_start, IP_POOL_START);
-        strcpy(ip_pool_end, IP_POOL_END);
-        strcpy(server_ip, SERVER_IP);
-        dhcp_server_port = DHCP_SERVER_PORT;
-        dhcp_client_port = DHCP_CLIENT_PORT;
-        default_lease_time = 86400; // 24 hours
-        return;
-    }
+Config *current_config;
+Config *retired_configs; // under config_mutex
+pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+int reload_running = 0;
+Task reload_task;
+Task log_flush_task;
+Task dns_update_task;
+int snapshot_running = 0; // worker 0 only
 
-    char line[256];
-    while (fgets(line, sizeof(line), config_file)) {
-        char key[64], value[64];
-        if (sscanf(line, "%63[^=]=%63s", key, value) == 2) {
-            if (strcmp(key, "ip_pool_start") == 0) strcpy(ip_pool_start, value);
-            else if (strcmp(key, "ip_pool_end") == 0) strcpy(ip_pool_end, value);
-            else if (strcmp(key, "server_ip") == 0) strcpy(server_ip, value);
-            else if (strcmp(key, "dhcp_server_port") == 0) dhcp_server_port = atoi(value);
-            else if (strcmp(key, "dhcp_client_port") == 0) dhcp_client_port = atoi(value);
-            else if (strcmp(key, "default_lease_time") == 0) default_lease_time = atoi(value);
-        }
-    }
+Worker workers[MAX_WORKERS];
+TaskQueue *task_queues;
+int task_threads;
+int task_pool_running = 0;
+int task_sleepers = 0;
+int task_wake_fd = -1;
+
+int dhcp_serving = 1; // 0 while standing by for the replication peer
+struct sockaddr_in replication_peer;
+int replication_primary;
+JournalEntry *journal; // NULL without replication
+uint64_t journal_head; // seq of the newest entry, written under lease_mutex
+uint64_t journal_stream;
+uint64_t replication_acked;
+int replication_connected;
+int replication_sleeping;
+int replication_event_fd = -1;
+uint32_t task_next_queue;
 
-    fclose(config_file);
-}
 int create_and_bind_socket(int port) {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
@@ -140,27 +900,260 @@ int create_and_bind_socket(int port) {
 
     return sock;
 }
-void add_dns_entry(const char* domain, const char* ip) {
-    if (dns_entries < MAX_DNS_ENTRIES) {
-        strncpy(dns_table[dns_entries].domain, domain, MAX_DOMAIN_NAME_LENGTH - 1);
-        strncpy(dns_table[dns_entries].ip, ip, 15);
-        dns_entries++;
-        printf("Added DNS entry: %s -> %s\n", domain, ip);
+// Task pool. A worker pushes onto a task thread's inbox with a single CAS. The thread moves
+// its inbox into a ring it pops from the front, and an idle thread takes half of another's
+// ring from the back, so one slow task doesn't strand the ones queued behind it
+void push_task_stack(Task **top, Task *task) {
+    Task *head = __atomic_load_n(top, __ATOMIC_RELAXED);
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(top, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Takes the whole stack, oldest task first
+Task *take_task_stack(Task **top) {
+    Task *list = __atomic_exchange_n(top, NULL, __ATOMIC_ACQUIRE);
+    Task *ordered = NULL;
+    while (list != NULL) {
+        Task *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    return ordered;
+}
+
+void task_queue_lock(TaskQueue *q) {
+    while (__atomic_test_and_set(&q->lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&q->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+}
+
+void task_queue_unlock(TaskQueue *q) {
+    __atomic_clear(&q->lock, __ATOMIC_RELEASE);
+}
+
+// 'owner' is the worker whose loop runs task->complete, -1 if there is nothing to complete.
+// Before the pool starts and after it stops, the task runs on the caller instead
+void submit_task(Task *task, int owner) {
+    task->owner = owner;
+    if (!__atomic_load_n(&task_pool_running, __ATOMIC_ACQUIRE)) {
+        void (*complete)(struct Worker *, struct Task *) = task->complete;
+        task->run(task);
+        if (complete != NULL) {
+            complete(&workers[owner], task);
+        }
+        return;
+    }
+    int q = owner >= 0 ? owner % task_threads : (int)(__atomic_fetch_add(&task_next_queue, 1, __ATOMIC_RELAXED) % task_threads);
+    push_task_stack(&task_queues[q].inbox, task);
+
+    // Pairs with the fence in task_thread: either it sees the task or we see it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&task_sleepers, __ATOMIC_RELAXED) > 0) {
+        uint64_t one = 1;
+        if (write(task_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+// Pops from the front of the thread's own ring, refilling it from the inbox when empty
+Task *task_take(TaskQueue *q) {
+    task_queue_lock(q);
+    if (q->head == q->tail) {
+        Task *list = take_task_stack(&q->inbox);
+        while (list != NULL && q->tail - q->head < TASK_QUEUE_SIZE) {
+            q->ring[q->tail++ % TASK_QUEUE_SIZE] = list;
+            list = list->next;
+        }
+        while (list != NULL) { // the ring is full, the rest waits its turn
+            Task *next = list->next;
+            push_task_stack(&q->inbox, list);
+            list = next;
+        }
+    }
+    Task *task = q->head != q->tail ? q->ring[q->head++ % TASK_QUEUE_SIZE] : NULL;
+    task_queue_unlock(q);
+    return task;
+}
+
+// Moves half of the first busy ring found into this thread's ring and pops one. A thread
+// stuck in a slow task hasn't moved its inbox yet, so that is fair game too
+Task *task_steal(TaskQueue *self) {
+    int id = self - task_queues;
+    for (int k = 1; k < task_threads; k++) {
+        TaskQueue *victim = &task_queues[(id + k) % task_threads];
+        Task *stolen[TASK_QUEUE_SIZE / 2];
+        int n = 0;
+        task_queue_lock(victim);
+        uint32_t half = (victim->tail - victim->head + 1) / 2;
+        while (n < (int)half) {
+            stolen[n++] = victim->ring[--victim->tail % TASK_QUEUE_SIZE];
+        }
+        task_queue_unlock(victim);
+        if (n == 0) {
+            Task *list = take_task_stack(&victim->inbox);
+            while (list != NULL) {
+                Task *next = list->next;
+                if (n < TASK_QUEUE_SIZE / 2) {
+                    stolen[n++] = list;
+                } else {
+                    push_task_stack(&self->inbox, list);
+                }
+                list = next;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        __atomic_add_fetch(&stats.tasks_stolen, n, __ATOMIC_RELAXED);
+        // Only this thread adds to its ring, and it was empty, so everything fits
+        task_queue_lock(self);
+        for (int i = 1; i < n; i++) {
+            self->ring[self->tail++ % TASK_QUEUE_SIZE] = stolen[i];
+        }
+        task_queue_unlock(self);
+        return stolen[0];
+    }
+    return NULL;
+}
+
+// Queued work in a ring counts too: its owner may be stuck in a slow task, and a sleeping
+// thread would never steal it
+int task_pool_idle() {
+    for (int i = 0; i < task_threads; i++) {
+        TaskQueue *q = &task_queues[i];
+        task_queue_lock(q);
+        int empty = q->head == q->tail;
+        task_queue_unlock(q);
+        if (!empty || __atomic_load_n(&q->inbox, __ATOMIC_RELAXED) != NULL) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-const char* lookup_dns(const char* domain) {
-    for (int i = 0; i < dns_entries; i++) {
-        if (strcmp(dns_table[i].domain, domain) == 0) {
-            printf("Found DNS entry for %s: %s\n", domain, dns_table[i].ip);
-            return dns_table[i].ip;
+// Runs tasks until the pool stops and nothing is left; a finished task with a completion
+// goes to its owner's list, and the owner's wake eventfd brings it into its loop
+void *task_thread(void *arg) {
+    TaskQueue *q = arg;
+    for (;;) {
+        Task *task = task_take(q);
+        if (task == NULL) {
+            task = task_steal(q);
+        }
+        if (task != NULL) {
+            STAT_INC(tasks_run);
+            if (task->complete == NULL) {
+                task->run(task); // may free the task
+                continue;
+            }
+            task->run(task);
+            Worker *w = &workers[task->owner];
+            push_task_stack(&w->completed, task);
+            uint64_t one = 1;
+            if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("eventfd write failed");
+            }
+            continue;
+        }
+
+        __atomic_add_fetch(&task_sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int running = __atomic_load_n(&task_pool_running, __ATOMIC_ACQUIRE);
+        if (task_pool_idle()) {
+            if (!running) {
+                __atomic_sub_fetch(&task_sleepers, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            uint64_t value;
+            if (read(task_wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+                perror("eventfd read failed");
+            }
         }
+        __atomic_sub_fetch(&task_sleepers, 1, __ATOMIC_RELAXED);
     }
-    printf("No DNS entry found for %s\n", domain);
     return NULL;
 }
 
+// Called by a worker when its wake eventfd fires
+void complete_tasks(Worker *w) {
+    Task *task = take_task_stack(&w->completed);
+    while (task != NULL) {
+        Task *next = task->next;
+        task->complete(w, task);
+        task = next;
+    }
+}
+
+// Lets the task threads finish what was submitted, then joins them
+void stop_task_pool() {
+    if (task_queues == NULL) {
+        return;
+    }
+    __atomic_store_n(&task_pool_running, 0, __ATOMIC_RELEASE);
+    uint64_t wake = task_threads;
+    if (write(task_wake_fd, &wake, sizeof(wake)) < 0) {
+        perror("eventfd write failed");
+    }
+    for (int i = 0; i < task_threads; i++) {
+        pthread_join(task_queues[i].thread, NULL);
+    }
+    close(task_wake_fd);
+    free(task_queues);
+    task_queues = NULL;
+}
+
+int start_task_pool() {
+    task_queues = calloc(task_threads, sizeof(TaskQueue));
+    task_wake_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC); // blocking: idle task threads sleep in read()
+    if (task_queues == NULL || task_wake_fd < 0) {
+        perror("Task pool setup failed");
+        return -1;
+    }
+    __atomic_store_n(&task_pool_running, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < task_threads; i++) {
+        if (pthread_create(&task_queues[i].thread, NULL, task_thread, &task_queues[i]) != 0) {
+            task_threads = i;
+            stop_task_pool();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes out whatever write_log buffered; flushes run one at a time, in order
+void flush_log_task(Task *task) {
+    (void)task; // always log_flush_task
+    pthread_mutex_lock(&log_file_mutex);
+    pthread_mutex_lock(&log_mutex);
+    char *data = log_buffers[log_pending_buffer];
+    int len = log_pending_len;
+    int reopen = log_reopen_requested;
+    log_pending_buffer ^= 1;
+    log_pending_len = 0;
+    log_flush_queued = 0;
+    log_reopen_requested = 0;
+    pthread_mutex_unlock(&log_mutex);
+
+    if (reopen) { // so the log can be rotated underneath us
+        if (log_file != NULL) {
+            fclose(log_file);
+        }
+        log_file = fopen(LOG_FILE, "a");
+    }
+    if (log_file != NULL && len > 0) {
+        fwrite(data, 1, len, log_file);
+        fflush(log_file);
+    }
+    pthread_mutex_unlock(&log_file_mutex);
+}
+
 void init_log() {
+    log_flush_task.run = flush_log_task;
     log_file = fopen(LOG_FILE, "a");
     if (log_file == NULL) {
         perror("Error opening log file");
@@ -169,447 +1162,6078 @@ void init_log() {
 }
 
 void close_log() {
+    flush_log_task(&log_flush_task);
     if (log_file != NULL) {
         fclose(log_file);
     }
 }
 
+// Only appends to a buffer; the disk write happens on the task pool
 void write_log(const char *message) {
-    if (log_file == NULL) {
-        return;
-    }
-
     time_t now;
     time(&now);
-    char *date = ctime(&now);
+    char date[32];
+    ctime_r(&now, date);
     date[strlen(date) - 1] = '\0'; // Remove newline
 
     pthread_mutex_lock(&log_mutex);
-    fprintf(log_file, "[%s] %s\n", date, message);
-    fflush(log_file);
+    int room = LOG_BUFFER_SIZE - log_pending_len;
+    int n = snprintf(log_buffers[log_pending_buffer] + log_pending_len, room, "[%s] %s\n", date, message);
+    if (n < room) {
+        log_pending_len += n;
+    } else {
+        STAT_INC(log_lines_dropped);
+    }
+    int queue = !log_flush_queued;
+    log_flush_queued = 1;
     pthread_mutex_unlock(&log_mutex);
-}
-
-uint32_t get_next_available_ip() {
-    uint32_t start_ip = inet_addr(ip_pool_start);
-    uint32_t end_ip = inet_addr(ip_pool_end);
-
-    for (uint32_t ip = ntohl(start_ip); ip <= ntohl(end_ip); ip++) {
-        char ip_str[16];
-        struct in_addr addr;
-        addr.s_addr = htonl(ip);
-        inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
 
-        int available = 1;
-        for (int i = 0; i < num_leases; i++) {
-            if (strcmp(ip_leases[i].ip, ip_str) == 0 && ip_leases[i].state != 0) {
-                available = 0;
-                break;
-            }
-        }
-
-        if (available) {
-            return htonl(ip);
-        }
+    if (queue) {
+        submit_task(&log_flush_task, -1);
     }
-
-    write_log("Error: IP address pool exhausted");
-    return 0; // No available IPs
 }
 
-void add_dhcp_option(uint8_t *options, int *offset, uint8_t option_code, uint8_t option_length, uint8_t *option_value) {
-    options[(*offset)++] = option_code;
-    options[(*offset)++] = option_length;
-    memcpy(&options[*offset], option_value, option_length);
-    *offset += option_length;
+uint64_t hash64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
 }
 
-void handle_dhcp_discover(DHCPPacket *packet, struct sockaddr_in *client_addr) {
-    char log_message[256];
-    snprintf(log_message, sizeof(log_message), "Handling DHCP Discover from %s", inet_ntoa(client_addr->sin_addr));
-    write_log(log_message);
-
-    DHCPPacket response;
-    memset(&response, 0, sizeof(DHCPPacket));
+uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed) {
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash64(h);
+}
 
-    response.op = 2; // Boot Reply
-    response.htype = packet->htype;
-    response.hlen = packet->hlen;
-    response.xid = packet->xid;
-    response.yiaddr = get_next_available_ip();
-    response.siaddr = inet_addr(server_ip);
-    memcpy(response.chaddr, packet->chaddr, 16);
+void format_mac(const uint8_t *mac, char *out) {
+    snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
 
-    int option_offset = 0;
-    uint8_t dhcp_msg_type = 2; // DHCP Offer
-    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+int parse_mac(const char *text, uint8_t *mac) {
+    unsigned int b[6];
+    if (sscanf(text, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+        return -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        mac[i] = b[i];
+    }
+    return 0;
+}
 
-    uint32_t lease_time = htonl(default_lease_time);
-    add_dhcp_option(response.options, &option_offset, 51, 4, (uint8_t*)&lease_time);
+void format_ip(uint32_t ip, char *out) {
+    struct in_addr addr;
+    addr.s_addr = ip;
+    inet_ntop(AF_INET, &addr, out, 16);
+}
 
-    uint32_t server_id = inet_addr(server_ip);
-    add_dhcp_option(response.options, &option_offset, 54, 4, (uint8_t*)&server_id);
+// Lease records never move: there is one per address, reused when the address changes hands,
+// so a reader only needs the record's sequence counter. Writers still serialize on lease_mutex.
+void lease_write_begin(IPLease *lease) {
+    __atomic_store_n(&lease->seq, lease->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    // Add subnet mask option
-    uint32_t subnet_mask = htonl(0xFFFFFF00); // 255.255.255.0
-    add_dhcp_option(response.options, &option_offset, 1, 4, (uint8_t*)&subnet_mask);
+void lease_write_end(IPLease *lease) {
+    __atomic_store_n(&lease->seq, lease->seq + 1, __ATOMIC_RELEASE);
+}
 
-    // Add router option (default gateway)
-    uint32_t router = inet_addr(server_ip); // Using server IP as gateway
-    add_dhcp_option(response.options, &option_offset, 3, 4, (uint8_t*)&router);
+void lease_read(const IPLease *lease, IPLease *out) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&lease->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            __builtin_ia32_pause(); // writer in the middle of an update
+            continue;
+        }
+        memcpy(out, lease, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&lease->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+        __builtin_ia32_pause();
+    }
+}
 
-    // Add DNS server option
-    add_dhcp_option(response.options, &option_offset, 6, 4, (uint8_t*)&server_id);
+// Epoch-based reclamation for the index tables: a reader announces the epoch it entered in,
+// and a replaced table is freed only once every active reader entered after it was retired
+int reader_slot() {
+    static __thread int slot = -1;
+    if (slot < 0) {
+        slot = __atomic_fetch_add(&num_reader_slots, 1, __ATOMIC_RELAXED);
+    }
+    return slot < MAX_READER_THREADS ? slot : -1;
+}
 
-    response.options[option_offset++] = 255; // End option
+void reader_enter() {
+    int slot = reader_slot();
+    if (slot < 0) {
+        pthread_mutex_lock(&lease_mutex); // more threads than slots: read like a writer
+        return;
+    }
+    __atomic_store_n(&reader_epochs[slot].epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
+void reader_exit() {
+    int slot = reader_slot();
+    if (slot < 0) {
+        pthread_mutex_unlock(&lease_mutex);
         return;
     }
+    __atomic_store_n(&reader_epochs[slot].epoch, 0, __ATOMIC_RELEASE);
+}
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(dhcp_server_port);
+// Called with lease_mutex held
+void reclaim_retired() {
+    uint64_t oldest = UINT64_MAX;
+    int slots = __atomic_load_n(&num_reader_slots, __ATOMIC_RELAXED);
+    for (int i = 0; i < slots && i < MAX_READER_THREADS; i++) {
+        uint64_t epoch = __atomic_load_n(&reader_epochs[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
 
-    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Bind failed: %s", strerror(errno));
-        write_log(error_msg);
-        perror("Bind failed");
-        close(sock);
-        return ;
+    int kept = 0;
+    for (int i = 0; i < num_retired; i++) {
+        if (retired[i].epoch < oldest) {
+            free(retired[i].ptr);
+        } else {
+            retired[kept++] = retired[i];
+        }
     }
+    num_retired = kept;
+}
 
-    client_addr->sin_port = htons(dhcp_client_port);
+void retire_pointer(void *ptr) {
+    while (num_retired == MAX_RETIRED) {
+        reclaim_retired(); // only a reader stuck mid-lookup can hold this up
+    }
+    retired[num_retired].ptr = ptr;
+    retired[num_retired].epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    num_retired++;
+    reclaim_retired();
+}
 
-    if (sendto(sock, &response, sizeof(DHCPPacket), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("Sendto failed");
-    } else {
-        write_log("Sent DHCP Offer to client");
+LeaseIndex *lease_index_create(uint32_t capacity) {
+    LeaseIndex *index = calloc(1, sizeof(LeaseIndex) + capacity * sizeof(int32_t));
+    if (index != NULL) {
+        index->capacity = capacity;
     }
+    return index;
+}
 
-    close(sock);
+uint64_t lease_key_hash(const IPLease *lease, int by_mac) {
+    return by_mac ? hash_bytes(lease->mac, 6, 0) : hash64(lease->ip);
 }
 
-void handle_dhcp_request(DHCPPacket *packet, struct sockaddr_in *client_addr) {
-    char log_message[256];
-    snprintf(log_message, sizeof(log_message), "Handling DHCP Request from %s", inet_ntoa(client_addr->sin_addr));
-    write_log(log_message);
+int lease_key_equal(const IPLease *lease, const void *key, int by_mac) {
+    return by_mac ? memcmp(lease->mac, key, 6) == 0 : lease->ip == *(const uint32_t *)key;
+}
 
-    DHCPPacket response;
-    memset(&response, 0, sizeof(DHCPPacket));
+// Writer side: grows (or purges tombstones from) an index by building a new one and swapping it in
+int lease_index_rebuild(LeaseIndex **root, int by_mac) {
+    LeaseIndex *old = *root;
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < old->capacity; i++) {
+        if (old->slots[i] > 0) live++;
+    }
+    uint32_t capacity = LEASE_INDEX_MIN;
+    while (capacity < live * 4) {
+        capacity *= 2;
+    }
+
+    LeaseIndex *index = lease_index_create(capacity);
+    if (index == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < old->capacity; i++) {
+        int32_t value = old->slots[i];
+        if (value <= 0) continue;
+        uint32_t pos = lease_key_hash(&ip_leases[value - 1], by_mac) & (capacity - 1);
+        while (index->slots[pos] != 0) {
+            pos = (pos + 1) & (capacity - 1);
+        }
+        index->slots[pos] = value;
+        index->used++;
+    }
+
+    __atomic_store_n(root, index, __ATOMIC_SEQ_CST);
+    retire_pointer(old);
+    return 0;
+}
+
+// Writer side: slot holding 'key', or -1
+int lease_index_find_locked(LeaseIndex *index, const void *key, uint64_t hash, int by_mac) {
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t pos = hash & mask, n = 0; n < index->capacity; pos = (pos + 1) & mask, n++) {
+        int32_t value = index->slots[pos];
+        if (value == 0) break;
+        if (value > 0 && lease_key_equal(&ip_leases[value - 1], key, by_mac)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+// Writer side: points 'key' at record 'lease_index', replacing an existing mapping for the key
+int lease_index_put_locked(LeaseIndex **root, const void *key, uint64_t hash, int32_t lease_index, int by_mac) {
+    if (((*root)->used + 1) * 2 > (*root)->capacity && lease_index_rebuild(root, by_mac) < 0) {
+        return -1;
+    }
+    LeaseIndex *index = *root;
+    int pos = lease_index_find_locked(index, key, hash, by_mac);
+    if (pos >= 0) {
+        __atomic_store_n(&index->slots[pos], lease_index + 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    uint32_t mask = index->capacity - 1;
+    uint32_t p = hash & mask;
+    while (index->slots[p] > 0) {
+        p = (p + 1) & mask;
+    }
+    if (index->slots[p] == 0) {
+        index->used++; // reusing a tombstone doesn't grow the probe chains
+    }
+    __atomic_store_n(&index->slots[p], lease_index + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void lease_index_remove_locked(LeaseIndex *index, const void *key, uint64_t hash, int32_t lease_index, int by_mac) {
+    int pos = lease_index_find_locked(index, key, hash, by_mac);
+    if (pos >= 0 && index->slots[pos] == lease_index + 1) {
+        __atomic_store_n(&index->slots[pos], -1, __ATOMIC_RELEASE);
+    }
+}
+
+// Reader side: never blocks. Copies the record into 'out' and returns its index, or -1
+int lease_index_lookup(LeaseIndex **root, const void *key, uint64_t hash, int by_mac, IPLease *out) {
+    int found = -1;
+    reader_enter();
+    LeaseIndex *index = __atomic_load_n(root, __ATOMIC_SEQ_CST);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t pos = hash & mask, n = 0; n < index->capacity; pos = (pos + 1) & mask, n++) {
+        int32_t value = __atomic_load_n(&index->slots[pos], __ATOMIC_ACQUIRE);
+        if (value == 0) break;
+        if (value < 0) continue;
+        lease_read(&ip_leases[value - 1], out);
+        if (lease_key_equal(out, key, by_mac)) {
+            found = value - 1;
+            break;
+        }
+    }
+    reader_exit();
+    return found;
+}
+
+int lease_find_by_ip(uint32_t ip, IPLease *out) {
+    return lease_index_lookup(&ip_index, &ip, hash64(ip), 0, out);
+}
+
+int lease_find_by_mac(const uint8_t *mac, IPLease *out) {
+    return lease_index_lookup(&mac_index, mac, hash_bytes(mac, 6, 0), 1, out);
+}
+
+// Maps the lease table into shared memory, or into private memory if that isn't possible
+int init_lease_table() {
+    lease_table_size = sizeof(LeaseTableHeader) + (size_t)max_leases * sizeof(IPLease);
+    lease_table = MAP_FAILED;
+
+    // A segment left behind by a crashed server has stale records, so start from scratch
+    shm_unlink(lease_shm_name);
+    int fd = shm_open(lease_shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, lease_table_size) == 0) {
+            lease_table = mmap(NULL, lease_table_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (lease_table == MAP_FAILED) {
+        char log_message[NAME_MAX + 128];
+        snprintf(log_message, sizeof(log_message), "Shared lease table %s unavailable (%s), keeping it private", lease_shm_name, strerror(errno));
+        write_log(log_message);
+        shm_unlink(lease_shm_name);
+        lease_table = mmap(NULL, lease_table_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    ip_index = lease_index_create(LEASE_INDEX_MIN);
+    mac_index = lease_index_create(LEASE_INDEX_MIN);
+    lru_prev = malloc(max_leases * sizeof(int32_t));
+    lru_next = malloc(max_leases * sizeof(int32_t));
+    lease_dns_names = calloc(max_leases, sizeof(uint32_t));
+    probe_clean_until = calloc(max_leases, sizeof(uint32_t));
+    if (lease_table == MAP_FAILED || ip_index == NULL || mac_index == NULL || lru_prev == NULL || lru_next == NULL ||
+        lease_dns_names == NULL || probe_clean_until == NULL) {
+        perror("Lease table allocation failed");
+        return -1;
+    }
+
+    memcpy(lease_table->magic, LEASE_SHM_MAGIC, sizeof(lease_table->magic));
+    lease_table->header_size = sizeof(LeaseTableHeader);
+    lease_table->record_size = sizeof(IPLease);
+    lease_table->capacity = max_leases;
+    lease_table->server_pid = getpid();
+    lease_table->started = time(NULL);
+    ip_leases = (IPLease *)((uint8_t *)lease_table + sizeof(LeaseTableHeader));
+    // Readers check the version last, so a half-initialized header is never trusted
+    __atomic_store_n(&lease_table->version, LEASE_SHM_VERSION, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void close_lease_table() {
+    munmap(lease_table, lease_table_size);
+    shm_unlink(lease_shm_name);
+}
+
+// The feed ring is shared like the lease table, or private when only the socket serves it
+int init_lease_feed() {
+    if (lease_feed_shm[0] == '\0' && lease_feed_socket[0] == '\0') {
+        return 0;
+    }
+    if (lease_feed_size < 2 || (lease_feed_size & (lease_feed_size - 1)) != 0) {
+        write_log("lease_feed_size must be a power of two");
+        return -1;
+    }
+    lease_feed_bytes = sizeof(LeaseFeedHeader) + (size_t)lease_feed_size * sizeof(LeaseEvent);
+    void *base = MAP_FAILED;
+    if (lease_feed_shm[0] != '\0') {
+        shm_unlink(lease_feed_shm);
+        int fd = shm_open(lease_feed_shm, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd >= 0) {
+            if (ftruncate(fd, lease_feed_bytes) == 0) {
+                base = mmap(NULL, lease_feed_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+        }
+        if (base == MAP_FAILED) {
+            char log_message[NAME_MAX + 64];
+            snprintf(log_message, sizeof(log_message), "Lease feed %s unavailable (%s)", lease_feed_shm, strerror(errno));
+            write_log(log_message);
+            shm_unlink(lease_feed_shm);
+            lease_feed_shm[0] = '\0';
+        }
+    }
+    if (base == MAP_FAILED && lease_feed_socket[0] != '\0') {
+        base = mmap(NULL, lease_feed_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        return 0; // no feed, but nothing else depends on it
+    }
+
+    lease_feed = base;
+    memcpy(lease_feed->magic, LEASE_FEED_MAGIC, sizeof(lease_feed->magic));
+    lease_feed->header_size = sizeof(LeaseFeedHeader);
+    lease_feed->event_size = sizeof(LeaseEvent);
+    lease_feed->capacity = lease_feed_size;
+    lease_feed->server_pid = getpid();
+    lease_feed->started = time(NULL);
+    lease_events = (LeaseEvent *)((uint8_t *)lease_feed + sizeof(LeaseFeedHeader));
+    __atomic_store_n(&lease_feed->version, LEASE_FEED_VERSION, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void close_lease_feed() {
+    if (lease_feed != NULL) {
+        munmap(lease_feed, lease_feed_bytes);
+    }
+    if (lease_feed_shm[0] != '\0') {
+        shm_unlink(lease_feed_shm);
+    }
+}
+
+// DNS names are interned once in an arena in lowercase wire format (length-prefixed labels),
+// so comparing names is a memcmp and case or a trailing dot never matter. Records point
+// into the arena and into a shared address pool; an open-addressing index maps names to
+// records. Readers take dns_lock shared, adding names takes it exclusively.
+int dns_name_to_wire(const char *text, uint8_t *wire) {
+    int len = 0;
+    const char *label = text;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        int label_len = dot != NULL ? dot - label : (int)strlen(label);
+        if (label_len == 0 || label_len > 63 || len + 1 + label_len + 1 > DNS_MAX_WIRE_NAME) {
+            return -1; // empty or oversized label, or name too long
+        }
+        wire[len++] = label_len;
+        for (int i = 0; i < label_len; i++) {
+            wire[len++] = tolower((unsigned char)label[i]);
+        }
+        if (dot == NULL) break;
+        label = dot + 1;
+    }
+    wire[len++] = 0; // root label
+    return len > 1 ? len : -1;
+}
+
+void *dns_grow(void *array, uint32_t *capacity, uint32_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    uint32_t grown = *capacity ? *capacity : 1024;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    void *resized = realloc(array, (size_t)grown * item_size);
+    if (resized != NULL) {
+        *capacity = grown;
+    }
+    return resized;
+}
+
+// Index slot holding 'wire', or the empty slot where it would go
+uint32_t dns_find_slot(const uint8_t *wire, int len, uint32_t hash) {
+    uint32_t mask = dns.index_capacity - 1;
+    for (uint32_t pos = hash & mask;; pos = (pos + 1) & mask) {
+        DNSSlot *slot = &dns.index[pos];
+        if (slot->record == 0) {
+            return pos;
+        }
+        if (slot->hash == hash) {
+            DNSRecord *record = &dns.records[slot->record - 1];
+            if (record->name_len == len && memcmp(dns.arena + record->name, wire, len) == 0) {
+                return pos;
+            }
+        }
+    }
+}
+
+// Called with dns_lock held exclusively
+int dns_grow_index() {
+    uint32_t capacity = dns.index_capacity ? dns.index_capacity * 2 : DNS_INDEX_MIN;
+    DNSSlot *index = calloc(capacity, sizeof(DNSSlot));
+    if (index == NULL) {
+        return -1;
+    }
+    DNSSlot *old = dns.index;
+    uint32_t old_capacity = dns.index_capacity;
+    dns.index = index;
+    dns.index_capacity = capacity;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].record != 0) {
+            uint32_t pos = old[i].hash & (capacity - 1);
+            while (index[pos].record != 0) {
+                pos = (pos + 1) & (capacity - 1);
+            }
+            index[pos] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Address blocks come in power-of-two sizes; freed ones are kept per size for reuse
+int64_t dns_alloc_addrs_locked(uint32_t capacity) {
+    uint32_t *head = &dns.free_addrs[__builtin_ctz(capacity)];
+    if (*head != 0) {
+        uint32_t block = *head - 1;
+        *head = dns.addrs[block];
+        return block;
+    }
+    uint32_t *addrs = dns_grow(dns.addrs, &dns.addrs_capacity, dns.addrs_used + capacity, sizeof(uint32_t));
+    if (addrs == NULL) {
+        return -1;
+    }
+    dns.addrs = addrs;
+    dns.addrs_used += capacity;
+    return dns.addrs_used - capacity;
+}
+
+void dns_free_addrs_locked(uint32_t block, uint32_t capacity) {
+    uint32_t *head = &dns.free_addrs[__builtin_ctz(capacity)];
+    dns.addrs[block] = *head;
+    *head = block + 1;
+}
+
+// Rewrites the arena without the names of reclaimed records once they fill half of it
+void dns_compact_arena_locked() {
+    if (dns.arena_dead < DNS_COMPACT_MIN || dns.arena_dead < dns.arena_used / 2) {
+        return;
+    }
+    uint8_t *arena = malloc(dns.arena_capacity);
+    if (arena == NULL) {
+        return; // tried again on the next reclaim
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < dns.num_records; i++) {
+        DNSRecord *record = &dns.records[i];
+        if (record->name_len > 0) {
+            memcpy(arena + used, dns.arena + record->name, record->name_len);
+            record->name = used;
+            used += record->name_len;
+        }
+    }
+    free(dns.arena);
+    dns.arena = arena;
+    dns.arena_used = used;
+    dns.arena_dead = 0;
+}
+
+// Drops a name from the index and puts its record and address block up for reuse. The
+// index is linear probing, so later entries of the probe run shift back into the hole
+// rather than leaving a tombstone.
+void dns_reclaim_record_locked(uint32_t index) {
+    DNSRecord *record = &dns.records[index];
+    uint32_t mask = dns.index_capacity - 1;
+    uint32_t hole = dns_find_slot(dns.arena + record->name, record->name_len,
+                                  (uint32_t)hash_bytes(dns.arena + record->name, record->name_len, 0));
+    for (uint32_t pos = (hole + 1) & mask; dns.index[pos].record != 0; pos = (pos + 1) & mask) {
+        uint32_t home = dns.index[pos].hash & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            dns.index[hole] = dns.index[pos]; // its home is at or before the hole
+            hole = pos;
+        }
+    }
+    dns.index[hole].record = 0;
+
+    if (record->addr_capacity > 0) {
+        dns_free_addrs_locked(record->addrs, record->addr_capacity);
+    }
+    dns.arena_dead += record->name_len;
+    dns.num_dynamic -= record->dynamic;
+    memset(record, 0, sizeof(*record));
+    record->addrs = dns.free_record;
+    dns.free_record = index + 1;
+    dns_compact_arena_locked();
+}
+
+// Adds an A record and returns the name's record index, or -1. A name can carry several
+// addresses. Names registered for leases are 'dynamic' and limited to dns_max_names.
+// Called with dns_lock held exclusively.
+int dns_add_locked(const uint8_t *wire, int len, uint32_t addr, int dynamic) {
+    if ((dns.num_records + 1) * 4 > dns.index_capacity * 3 && dns_grow_index() < 0) {
+        return -1;
+    }
+
+    uint32_t hash = (uint32_t)hash_bytes(wire, len, 0);
+    uint32_t pos = dns_find_slot(wire, len, hash);
+    if (dns.index[pos].record == 0) {
+        if (dynamic && dns.num_dynamic >= (uint32_t)dns_max_names) {
+            STAT_INC(dns_names_refused);
+            return -1;
+        }
+        // New name: intern it and start an empty record, a reclaimed one if there is one
+        uint8_t *arena = dns_grow(dns.arena, &dns.arena_capacity, dns.arena_used + len, 1);
+        if (arena == NULL) {
+            return -1;
+        }
+        dns.arena = arena;
+        uint32_t index = dns.free_record;
+        if (index != 0) {
+            dns.free_record = dns.records[index - 1].addrs;
+        } else {
+            DNSRecord *records = dns_grow(dns.records, &dns.records_capacity, dns.num_records + 1, sizeof(DNSRecord));
+            if (records == NULL) {
+                return -1;
+            }
+            dns.records = records;
+            index = ++dns.num_records;
+        }
+        DNSRecord *record = &dns.records[index - 1];
+        memset(record, 0, sizeof(*record));
+        record->name = dns.arena_used;
+        record->name_len = len;
+        record->dynamic = dynamic != 0;
+        memcpy(dns.arena + dns.arena_used, wire, len);
+        dns.arena_used += len;
+        dns.num_dynamic += record->dynamic;
+        dns.index[pos].hash = hash;
+        dns.index[pos].record = index;
+    }
+
+    int index = dns.index[pos].record - 1;
+    DNSRecord *record = &dns.records[index];
+    for (int i = 0; i < record->num_addrs; i++) {
+        if (dns.addrs[record->addrs + i] == addr) {
+            return index; // already there
+        }
+    }
+    if (record->num_addrs == record->addr_capacity) {
+        // Move the addresses to a block twice the size and free the old one
+        int64_t block = record->addr_capacity < DNS_MAX_ADDRS ?
+                        dns_alloc_addrs_locked(record->addr_capacity ? record->addr_capacity * 2 : 1) : -1;
+        if (block < 0) {
+            if (record->num_addrs == 0) {
+                dns_reclaim_record_locked(index); // the name we just made
+            }
+            return -1;
+        }
+        memcpy(dns.addrs + block, dns.addrs + record->addrs, record->num_addrs * sizeof(uint32_t));
+        if (record->addr_capacity > 0) {
+            dns_free_addrs_locked(record->addrs, record->addr_capacity);
+        }
+        record->addrs = block;
+        record->addr_capacity = record->addr_capacity ? record->addr_capacity * 2 : 1;
+    }
+    dns.addrs[record->addrs + record->num_addrs++] = addr;
+    return index;
+}
+
+// A name left without addresses is reclaimed, so it answers NXDOMAIN until it is
+// registered again. Called with dns_lock held exclusively.
+void dns_remove_locked(int index, uint32_t addr) {
+    DNSRecord *record = &dns.records[index];
+    uint32_t *addrs = dns.addrs + record->addrs;
+    for (int i = 0; i < record->num_addrs; i++) {
+        if (addrs[i] == addr) {
+            addrs[i] = addrs[--record->num_addrs];
+            break;
+        }
+    }
+    if (record->num_addrs == 0) {
+        dns_reclaim_record_locked(index);
+    }
+}
+
+int add_dns_record(const uint8_t *wire, int len, uint32_t addr) {
+    pthread_rwlock_wrlock(&dns_lock);
+    int index = dns_add_locked(wire, len, addr, 0);
+    pthread_rwlock_unlock(&dns_lock);
+    return index < 0 ? -1 : 0;
+}
+
+void add_dns_entry(const char* domain, const char* ip) {
+    uint8_t wire[DNS_MAX_WIRE_NAME];
+    uint32_t addr;
+    int len = dns_name_to_wire(domain, wire);
+    if (len < 0 || inet_pton(AF_INET, ip, &addr) != 1 || add_dns_record(wire, len, addr) < 0) {
+        printf("Invalid DNS entry: %s -> %s\n", domain, ip);
+        return;
+    }
+    printf("Added DNS entry: %s -> %s\n", domain, ip);
+}
+
+int zone_section_fits(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset % 8 == 0 && offset <= size && length <= size - offset;
+}
+
+// Maps a dns-zonec image read-only. It is served in place, never copied or parsed, and
+// its pages are shared through the page cache with anything else mapping the same file.
+int load_dns_zone(const char *path) {
+    char log_message[512];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(log_message, sizeof(log_message), "Cannot open DNS zone %s: %s", path, strerror(errno));
+        write_log(log_message);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *base = size >= sizeof(DNSZoneHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    const DNSZoneHeader *h = base;
+    if (base == MAP_FAILED || memcmp(h->magic, DNS_ZONE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != DNS_ZONE_VERSION || h->header_size != sizeof(DNSZoneHeader) || h->file_size != size ||
+        h->index_capacity == 0 || (h->index_capacity & (h->index_capacity - 1)) != 0 || h->index_capacity <= h->num_names ||
+        !zone_section_fits(h->index_offset, (uint64_t)h->index_capacity * sizeof(DNSSlot), size) ||
+        !zone_section_fits(h->records_offset, (uint64_t)h->num_names * sizeof(DNSZoneRecord), size) ||
+        !zone_section_fits(h->addrs_offset, (uint64_t)h->num_addrs * sizeof(uint32_t), size) ||
+        !zone_section_fits(h->names_offset, h->names_size, size)) {
+        snprintf(log_message, sizeof(log_message), "DNS zone %s is not a valid dns-zonec image", path);
+        write_log(log_message);
+        if (base != MAP_FAILED) munmap(base, size);
+        return -1;
+    }
+
+    dns_zone.base = base;
+    dns_zone.size = size;
+    dns_zone.header = h;
+    dns_zone.index = (const DNSSlot *)((const uint8_t *)base + h->index_offset);
+    dns_zone.records = (const DNSZoneRecord *)((const uint8_t *)base + h->records_offset);
+    dns_zone.addrs = (const uint32_t *)((const uint8_t *)base + h->addrs_offset);
+    dns_zone.names = (const uint8_t *)base + h->names_offset;
+    snprintf(log_message, sizeof(log_message), "Mapped DNS zone %s: %u names, %u addresses", path, h->num_names, h->num_addrs);
+    write_log(log_message);
+    return 0;
+}
+
+// Same probe as the live table, with every record checked against the image bounds so
+// a damaged file can only cause misses
+int dns_zone_lookup(const uint8_t *wire, int len, uint32_t hash, uint32_t *addrs, int max) {
+    const DNSZoneHeader *h = dns_zone.header;
+    if (h == NULL) {
+        return 0;
+    }
+    uint32_t mask = h->index_capacity - 1;
+    for (uint32_t pos = hash & mask, n = 0; n <= mask; pos = (pos + 1) & mask, n++) {
+        const DNSSlot *slot = &dns_zone.index[pos];
+        if (slot->record == 0) {
+            return 0;
+        }
+        if (slot->hash != hash || slot->record > h->num_names) {
+            continue;
+        }
+        const DNSZoneRecord *record = &dns_zone.records[slot->record - 1];
+        if (record->name_len != len || (uint64_t)record->name + len > h->names_size ||
+            memcmp(dns_zone.names + record->name, wire, len) != 0) {
+            continue;
+        }
+        if ((uint64_t)record->addrs + record->num_addrs > h->num_addrs) {
+            return 0;
+        }
+        int count = record->num_addrs;
+        memcpy(addrs, dns_zone.addrs + record->addrs, (count < max ? count : max) * sizeof(uint32_t));
+        return count;
+    }
+    return 0;
+}
+
+// Copies up to 'max' addresses of a wire-format name from the live table, else from the
+// mapped zone; returns how many it has
+int lookup_dns_wire(const uint8_t *wire, int len, uint32_t *addrs, int max) {
+    int count = 0;
+    uint32_t hash = (uint32_t)hash_bytes(wire, len, 0);
+    pthread_rwlock_rdlock(&dns_lock);
+    if (dns.num_records > 0) {
+        uint32_t pos = dns_find_slot(wire, len, hash);
+        if (dns.index[pos].record != 0) {
+            DNSRecord *record = &dns.records[dns.index[pos].record - 1];
+            count = record->num_addrs;
+            memcpy(addrs, dns.addrs + record->addrs, (count < max ? count : max) * sizeof(uint32_t));
+        }
+    }
+    pthread_rwlock_unlock(&dns_lock);
+    if (count == 0) {
+        count = dns_zone_lookup(wire, len, hash, addrs, max);
+    }
+    return count;
+}
+
+int lookup_dns(const char* domain, uint32_t *addrs, int max) {
+    uint8_t wire[DNS_MAX_WIRE_NAME];
+    int len = dns_name_to_wire(domain, wire);
+    return len < 0 ? 0 : lookup_dns_wire(wire, len, addrs, max);
+}
+
+// Copies the name registered for lease record 'index' into 'wire'; returns its length, 0 if none
+int dns_lease_name(int index, uint8_t *wire) {
+    int len = 0;
+    pthread_rwlock_rdlock(&dns_lock);
+    uint32_t record = lease_dns_names[index];
+    if (record != 0) {
+        len = dns.records[record - 1].name_len;
+        memcpy(wire, dns.arena + dns.records[record - 1].name, len);
+    }
+    pthread_rwlock_unlock(&dns_lock);
+    return len;
+}
+
+// Lease changes reach the DNS table through a queue: producers append while holding
+// lease_mutex, so updates keep the order of the lease changes, and the first one queued
+// submits dns_update_task. That applies everything queued by the time it runs under one
+// exclusive dns_lock.
+void queue_dns_update_locked(int index, const uint8_t *name, int name_len) {
+    pthread_mutex_lock(&dns_updates_mutex);
+    if (num_dns_updates == dns_updates_capacity) {
+        int capacity = dns_updates_capacity ? dns_updates_capacity * 2 : 256;
+        DNSUpdate *updates = realloc(dns_updates, capacity * sizeof(DNSUpdate));
+        if (updates == NULL) {
+            pthread_mutex_unlock(&dns_updates_mutex);
+            write_log("DNS update queue full, dropping update");
+            return;
+        }
+        dns_updates = updates;
+        dns_updates_capacity = capacity;
+    }
+    DNSUpdate *update = &dns_updates[num_dns_updates++];
+    update->lease = index;
+    update->ip = ip_leases[index].ip;
+    update->name_len = name_len;
+    if (name_len > 0) {
+        memcpy(update->name, name, name_len); // NULL for a removal
+    }
+    int queue = !dns_update_queued;
+    dns_update_queued = 1;
+    pthread_mutex_unlock(&dns_updates_mutex);
+
+    if (queue) {
+        submit_task(&dns_update_task, -1);
+    }
+}
+
+// Called with dns_lock held exclusively
+void apply_dns_update_locked(const DNSUpdate *update) {
+    uint32_t old = lease_dns_names[update->lease];
+    if (old != 0) {
+        const DNSRecord *record = &dns.records[old - 1];
+        if (update->name_len == record->name_len && memcmp(dns.arena + record->name, update->name, update->name_len) == 0) {
+            return; // renewed under the same name
+        }
+        dns_remove_locked(old - 1, update->ip);
+        lease_dns_names[update->lease] = 0;
+    }
+    if (update->name_len > 0) {
+        int index = dns_add_locked(update->name, update->name_len, update->ip, 1);
+        if (index >= 0) {
+            lease_dns_names[update->lease] = index + 1;
+        }
+    }
+}
+
+// Taking dns_lock before the queue keeps passes one at a time, in order
+void apply_dns_updates_task(Task *task) {
+    (void)task; // always dns_update_task
+    pthread_rwlock_wrlock(&dns_lock);
+
+    // Swap buffers so producers never wait for the index
+    pthread_mutex_lock(&dns_updates_mutex);
+    DNSUpdate *updates = dns_updates;
+    int count = num_dns_updates;
+    int capacity = dns_updates_capacity;
+    dns_updates = dns_batch;
+    dns_updates_capacity = dns_batch_capacity;
+    num_dns_updates = 0;
+    dns_update_queued = 0;
+    pthread_mutex_unlock(&dns_updates_mutex);
+    dns_batch = updates;
+    dns_batch_capacity = capacity;
+
+    for (int i = 0; i < count; i++) {
+        apply_dns_update_locked(&dns_batch[i]);
+    }
+    pthread_rwlock_unlock(&dns_lock);
+}
+
+// Appends the record's new contents to the replication journal; called by every lease
+// writer after its seqlocked write, with lease_mutex held. A standby applies what its
+// peer sends and has nothing to journal until it takes over.
+void journal_lease_locked(int index) {
+    if (journal == NULL || !__atomic_load_n(&dhcp_serving, __ATOMIC_RELAXED)) {
+        return;
+    }
+    uint64_t seq = journal_head + 1;
+    JournalEntry *entry = &journal[seq & (REPL_JOURNAL_SIZE - 1)];
+    entry->seq = seq;
+    entry->lease = ip_leases[index];
+    entry->lease.seq = 0;
+    __atomic_store_n(&journal_head, seq, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in replication_serve: either it sees the entry or we see it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&replication_sleeping, 0, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(replication_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+// Lease writers report every write here, after it is made, with the record's state and owner
+// before it. Changes of a binding become feed events; consumers that fall a ring behind lose
+// events instead of holding us up. lease_feed_sleeping is set once worker 0 has sent the
+// socket consumers everything.
+void publish_lease_change_locked(int index, int old_state, int same_client) {
+    const IPLease *lease = &ip_leases[index];
+    if (lease_feed == NULL || !__atomic_load_n(&dhcp_serving, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int type;
+    time_t now = time(NULL);
+    if (lease->state == 2) {
+        type = old_state == 2 && same_client ? LEASE_EVENT_RENEW : LEASE_EVENT_GRANT;
+    } else if (old_state != 2) {
+        return; // offers and quarantines of unbound addresses aren't bindings
+    } else if (lease->state == 3) {
+        type = LEASE_EVENT_DECLINE;
+    } else {
+        type = now >= lease->lease_start + lease->lease_time ? LEASE_EVENT_EXPIRE : LEASE_EVENT_RELEASE;
+    }
+
+    uint64_t seq = lease_feed->head + 1;
+    LeaseEvent *event = &lease_events[seq & (lease_feed_size - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->time = now;
+    event->lease_start = lease->lease_start;
+    event->ip = lease->ip;
+    event->lease_time = lease->lease_time;
+    memcpy(event->mac, lease->mac, 6);
+    event->type = type;
+    __atomic_store_n(&event->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&lease_feed->head, seq, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&lease_feed_sleeping, 0, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(feed_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+// Free lease records of each pool sit on an LRU list, least recently released at the head,
+// so reuse steals the oldest history first. Writer-side state, under lease_mutex.
+PoolAllocator *allocator_for_ip(uint32_t ip) {
+    uint32_t host = ntohl(ip);
+    for (int i = 0; i < num_allocators; i++) {
+        if (host >= allocators[i].start && host <= allocators[i].end) {
+            return &allocators[i];
+        }
+    }
+    return NULL;
+}
+
+void lru_unlink(int index) {
+    PoolAllocator *a = allocator_for_ip(ip_leases[index].ip);
+    if (a == NULL || lru_prev[index] == LRU_UNLINKED) {
+        return;
+    }
+    if (lru_prev[index] >= 0) lru_next[lru_prev[index]] = lru_next[index];
+    else a->head = lru_next[index];
+    if (lru_next[index] >= 0) lru_prev[lru_next[index]] = lru_prev[index];
+    else a->tail = lru_prev[index];
+    lru_prev[index] = LRU_UNLINKED;
+}
+
+void lru_push(int index) {
+    PoolAllocator *a = allocator_for_ip(ip_leases[index].ip);
+    if (a == NULL || lru_prev[index] != LRU_UNLINKED) {
+        return;
+    }
+    lru_prev[index] = a->tail;
+    lru_next[index] = -1;
+    if (a->tail >= 0) lru_next[a->tail] = index;
+    else a->head = index;
+    a->tail = index;
+}
+
+// Keeps the pool's free list and usage count in step with a record's state
+void lease_state_changing(int index, int old_state, int new_state) {
+    PoolAllocator *a = allocator_for_ip(ip_leases[index].ip);
+    if (old_state == 0 && new_state != 0) {
+        lru_unlink(index);
+        if (a != NULL) a->used++;
+    } else if (old_state != 0 && new_state == 0) {
+        lru_push(index);
+        if (a != NULL) a->used--;
+    }
+    if (old_state == 2 && new_state != 2) {
+        queue_dns_update_locked(index, NULL, 0); // released, declined or expired
+    }
+}
+
+// Re-creates the allocators for a new config generation: one per pool, with every free
+// record of the pool on its list in table order
+void rebuild_allocators(const Config *cfg) {
+    for (int i = 0; i < num_leases; i++) {
+        lru_prev[i] = LRU_UNLINKED;
+    }
+    num_allocators = cfg->num_pools;
+    for (int i = 0; i < cfg->num_pools; i++) {
+        allocators[i].start = cfg->pools[i].start;
+        allocators[i].end = cfg->pools[i].end;
+        allocators[i].next_fresh = cfg->pools[i].start;
+        allocators[i].head = allocators[i].tail = -1;
+        allocators[i].used = 0;
+    }
+    for (int i = 0; i < num_leases; i++) {
+        if (ip_leases[i].state == 0) {
+            lru_push(i);
+        } else if (allocator_for_ip(ip_leases[i].ip) != NULL) {
+            allocator_for_ip(ip_leases[i].ip)->used++;
+        }
+    }
+    alloc_generation = cfg->generation;
+}
+
+// Writer side: the record for 'ip', created on first use; -1 when the table is full
+int lease_record_locked(uint32_t ip) {
+    int pos = lease_index_find_locked(ip_index, &ip, hash64(ip), 0);
+    if (pos >= 0) {
+        return ip_index->slots[pos] - 1;
+    }
+    if (num_leases >= max_leases) {
+        write_log("No available lease slots");
+        return -1;
+    }
+
+    int index = num_leases;
+    memset(&ip_leases[index], 0, sizeof(IPLease));
+    ip_leases[index].ip = ip;
+    lru_prev[index] = LRU_UNLINKED;
+    if (lease_index_put_locked(&ip_index, &ip, hash64(ip), index, 0) < 0) {
+        return -1;
+    }
+    __atomic_store_n(&num_leases, num_leases + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&lease_table->count, num_leases, __ATOMIC_RELEASE);
+    return index;
+}
+
+// Writer side: updates a record in place and keeps the MAC index pointing at its current owner
+void lease_update_locked(int index, const uint8_t *mac, int state, time_t lease_start, int lease_time) {
+    IPLease *lease = &ip_leases[index];
+    int old_state = lease->state;
+    int same_client = memcmp(lease->mac, mac, 6) == 0;
+    if (!same_client) {
+        lease_index_remove_locked(mac_index, lease->mac, hash_bytes(lease->mac, 6, 0), index, 1);
+    }
+
+    lease_state_changing(index, lease->state, state);
+
+    lease_write_begin(lease);
+    memcpy(lease->mac, mac, 6);
+    lease->state = state;
+    lease->lease_start = lease_start;
+    lease->lease_time = lease_time;
+    lease_write_end(lease);
+    journal_lease_locked(index);
+    publish_lease_change_locked(index, old_state, same_client);
+
+    lease_index_put_locked(&mac_index, mac, hash_bytes(mac, 6, 0), index, 1);
+}
+
+void lease_set_state_locked(int index, int state) {
+    IPLease *lease = &ip_leases[index];
+    int old_state = lease->state;
+    lease_state_changing(index, old_state, state);
+
+    lease_write_begin(lease);
+    lease->state = state;
+    lease_write_end(lease);
+    journal_lease_locked(index);
+    publish_lease_change_locked(index, old_state, 1);
+}
+
+// Keeps an address out of circulation until cleanup_expired_leases frees it; 0 frees it now
+void lease_quarantine_locked(int index, int seconds) {
+    if (seconds <= 0) {
+        lease_set_state_locked(index, 0);
+        return;
+    }
+    IPLease *lease = &ip_leases[index];
+    int old_state = lease->state;
+    lease_state_changing(index, old_state, 3);
+
+    lease_write_begin(lease);
+    lease->state = 3;
+    lease->lease_start = time(NULL);
+    lease->lease_time = seconds;
+    lease_write_end(lease);
+    journal_lease_locked(index);
+    publish_lease_change_locked(index, old_state, 1);
+}
+
+int pool_is_reserved(const Pool *pool, uint32_t host_ip) {
+    uint32_t offset = host_ip - pool->start;
+    return pool->reserved != NULL && (pool->reserved[offset / 64] >> (offset % 64) & 1);
+}
+
+// Called with lease_mutex held. In order: the client's previous address in the pool (kept
+// until the record goes to someone else), the address its MAC hashes to, a never-used
+// address, then the least recently released one. Reserved addresses are skipped.
+uint32_t get_next_available_ip(const Config *cfg, const Pool *pool, const uint8_t *mac) {
+    if (num_allocators == 0 || cfg->generation > alloc_generation) {
+        rebuild_allocators(cfg);
+    }
+
+    int pos = lease_index_find_locked(mac_index, mac, hash_bytes(mac, 6, 0), 1);
+    if (pos >= 0) {
+        IPLease *lease = &ip_leases[mac_index->slots[pos] - 1];
+        uint32_t host = ntohl(lease->ip);
+        if (lease->state != 3 && host >= pool->start && host <= pool->end && !pool_is_reserved(pool, host)) {
+            return lease->ip;
+        }
+    }
+
+    // Only if never used: a free record there is still another client's previous address
+    uint32_t host = pool->start + hash_bytes(mac, 6, ALLOC_HASH_SEED) % (pool->end - pool->start + 1);
+    uint32_t candidate = htonl(host);
+    if (!pool_is_reserved(pool, host) && lease_index_find_locked(ip_index, &candidate, hash64(candidate), 0) < 0) {
+        return candidate;
+    }
+
+    PoolAllocator *a = allocator_for_ip(htonl(pool->start));
+    if (a == NULL || a->start != pool->start || a->end != pool->end) {
+        write_log("Pool allocator not ready yet");
+        return 0; // a worker still on a config older than the allocators
+    }
+
+    // The cursor only moves forward: once an address has a record it keeps it
+    while (a->next_fresh <= pool->end) {
+        candidate = htonl(a->next_fresh);
+        if (!pool_is_reserved(pool, a->next_fresh) && lease_index_find_locked(ip_index, &candidate, hash64(candidate), 0) < 0) {
+            return candidate;
+        }
+        a->next_fresh++;
+    }
+
+    while (a->head >= 0) {
+        int index = a->head;
+        if (!pool_is_reserved(pool, ntohl(ip_leases[index].ip))) {
+            return ip_leases[index].ip;
+        }
+        lru_unlink(index); // reserved since it was freed; a reload relinks it if that changes
+    }
+
+    write_log("Error: IP address pool exhausted");
+    return 0; // No available IPs
+}
+
+// Called with lease_mutex held. Leases are shortened by up to the pool's jitter, hashed from
+// MAC and xid so the OFFER and ACK of one exchange agree while successive renewals drift
+// apart; T1/T2 are spread around 50% and 87.5% of the lease the same way
+void pool_lease_times(const Pool *pool, DHCPPacket *packet, uint32_t *lease, uint32_t *t1, uint32_t *t2) {
+    uint32_t base = pool->lease_time;
+    PoolAllocator *a = allocator_for_ip(htonl(pool->start));
+    uint64_t size = pool->end - pool->start + 1;
+    if (pool->busy_lease_time > 0 && (uint32_t)pool->busy_lease_time < base && a != NULL &&
+        (uint64_t)a->used * 100 >= size * pool->busy_threshold_percent) {
+        base = pool->busy_lease_time;
+    }
+
+    uint64_t h = hash_bytes(packet->chaddr, 6, packet->xid);
+    uint32_t jitter = (uint64_t)base * pool->jitter_percent / 100;
+    *lease = base - (uint32_t)(h % (jitter + 1));
+
+    uint32_t spread = (uint64_t)*lease * pool->jitter_percent / 200;
+    if (spread > *lease / 20) {
+        spread = *lease / 20; // keeps T1 < T2 < lease
+    }
+    *t1 = *lease / 2 - spread + (uint32_t)((h >> 21) % (2 * spread + 1));
+    *t2 = (uint64_t)*lease * 7 / 8 - spread + (uint32_t)((h >> 42) % (2 * spread + 1));
+}
+
+// Every options field starts with the RFC 2131 magic cookie
+void init_dhcp_options(uint8_t *options, int *offset) {
+    uint32_t cookie = htonl(DHCP_MAGIC_COOKIE);
+    memcpy(options, &cookie, 4);
+    *offset = 4;
+}
+
+// Walks the option TLVs after the magic cookie; returns the value or NULL if absent
+uint8_t *find_dhcp_option(DHCPPacket *packet, uint8_t code, uint8_t *length) {
+    size_t i = 4;
+    while (i < sizeof(packet->options)) {
+        uint8_t opt = packet->options[i];
+        if (opt == 255) break; // End
+        if (opt == 0) { // Pad
+            i++;
+            continue;
+        }
+        if (i + 2 > sizeof(packet->options) || i + 2 + packet->options[i + 1] > sizeof(packet->options)) {
+            break;
+        }
+        if (opt == code) {
+            *length = packet->options[i + 1];
+            return &packet->options[i + 2];
+        }
+        i += 2 + packet->options[i + 1];
+    }
+    return NULL;
+}
+
+void add_dhcp_option(uint8_t *options, int *offset, uint8_t option_code, uint8_t option_length, uint8_t *option_value) {
+    options[(*offset)++] = option_code;
+    options[(*offset)++] = option_length;
+    memcpy(&options[*offset], option_value, option_length);
+    *offset += option_length;
+}
+
+// Settings that size sockets, threads and shared memory are only read at startup
+void note_restart_only(const char *key) {
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Config reload: %s only takes effect after a restart", key);
+    write_log(log_message);
+}
+
+void set_startup_int(int *setting, int value, const char *key, int startup) {
+    if (startup) {
+        *setting = value;
+    } else if (*setting != value) {
+        note_restart_only(key);
+    }
+}
+
+void set_startup_string(char *setting, size_t size, const char *value, const char *key, int startup) {
+    if (startup) {
+        snprintf(setting, size, "%s", value);
+    } else if (strncmp(setting, value, size) != 0) {
+        note_restart_only(key);
+    }
+}
+
+// Pool whose range holds 'ip' (network byte order), or NULL
+const Pool *find_pool(const Config *cfg, uint32_t ip) {
+    uint32_t host = ntohl(ip);
+    for (int i = 0; i < cfg->num_pools; i++) {
+        if (host >= cfg->pools[i].start && host <= cfg->pools[i].end) {
+            return &cfg->pools[i];
+        }
+    }
+    return NULL;
+}
+
+// Relayed clients get the pool on the relay's subnet, directly attached ones the first pool
+const Pool *select_pool(const Config *cfg, DHCPPacket *packet) {
+    if (packet->giaddr == 0) {
+        return &cfg->pools[0];
+    }
+    for (int i = 0; i < cfg->num_pools; i++) {
+        uint32_t mask = ntohl(cfg->pools[i].subnet_mask);
+        if ((ntohl(packet->giaddr) & mask) == (cfg->pools[i].start & mask)) {
+            return &cfg->pools[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t config_pool_size(const Config *cfg) {
+    uint32_t size = 0;
+    for (int i = 0; i < cfg->num_pools; i++) {
+        size += cfg->pools[i].end - cfg->pools[i].start + 1;
+    }
+    return size;
+}
+
+// Reservations are compiled into a minimal perfect hash (hash and displace): a MAC's
+// bucket holds either a seed for a second hash or, for single-key buckets, the slot itself,
+// so a lookup reads one bucket word and probes exactly one slot
+uint32_t reservation_slot(const ReservationTable *table, const uint8_t *mac) {
+    uint64_t h = hash_bytes(mac, 6, table->seed);
+    int32_t displacement = table->displacements[h % table->num_buckets];
+    if (displacement < 0) {
+        return -displacement - 1;
+    }
+    return hash_bytes(mac, 6, h ^ (uint64_t)displacement) % table->size;
+}
+
+// Reserved address for 'mac' (network byte order), or 0
+uint32_t reservation_lookup(const Config *cfg, const uint8_t *mac) {
+    const ReservationTable *table = &cfg->reservations;
+    if (table->size == 0) {
+        return 0;
+    }
+    const Reservation *r = &table->slots[reservation_slot(table, mac)];
+    return memcmp(r->mac, mac, 6) == 0 ? r->ip : 0;
+}
+
+int compare_bucket_size(const void *a, const void *b, void *sizes) {
+    return ((uint32_t *)sizes)[*(const uint32_t *)b] - ((uint32_t *)sizes)[*(const uint32_t *)a];
+}
+
+// Places 'count' entries into table->slots; returns -1 if this seed needs too many retries
+int build_reservation_hash(ReservationTable *table, const Reservation *entries, uint32_t count) {
+    uint32_t *bucket_of = malloc(count * sizeof(uint32_t));
+    uint32_t *sizes = calloc(table->num_buckets + 1, sizeof(uint32_t));
+    uint32_t *order = malloc(table->num_buckets * sizeof(uint32_t));
+    uint32_t *members = malloc(count * sizeof(uint32_t));
+    uint8_t *taken = calloc(table->size, 1);
+    uint32_t candidate[RESERVATION_MAX_BUCKET];
+    int result = -1;
+    if (bucket_of == NULL || sizes == NULL || order == NULL || members == NULL || taken == NULL) {
+        goto out;
+    }
+
+    // Counting sort of the entries by bucket
+    for (uint32_t i = 0; i < count; i++) {
+        bucket_of[i] = hash_bytes(entries[i].mac, 6, table->seed) % table->num_buckets;
+        sizes[bucket_of[i] + 1]++;
+    }
+    for (uint32_t b = 0; b < table->num_buckets; b++) {
+        sizes[b + 1] += sizes[b]; // now bucket b's entries start at sizes[b]
+        order[b] = b;
+    }
+    uint32_t *fill = calloc(table->num_buckets, sizeof(uint32_t));
+    if (fill == NULL) {
+        goto out;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        members[sizes[bucket_of[i]] + fill[bucket_of[i]]++] = i;
+    }
+    free(fill);
+    for (uint32_t b = 0; b < table->num_buckets; b++) {
+        sizes[b] = sizes[b + 1] - sizes[b]; // back to plain sizes, start is members[...]
+    }
+    uint32_t *starts = bucket_of; // reused: entry buckets are no longer needed
+    for (uint32_t b = 0, start = 0; b < table->num_buckets; b++) {
+        starts[b] = start;
+        start += sizes[b];
+    }
+
+    // Largest buckets first, while the table is still empty
+    qsort_r(order, table->num_buckets, sizeof(uint32_t), compare_bucket_size, sizes);
+    uint32_t next_free = 0;
+    for (uint32_t n = 0; n < table->num_buckets; n++) {
+        uint32_t b = order[n];
+        uint32_t size = sizes[b];
+        const uint32_t *bucket = &members[starts[b]];
+        if (size == 0) {
+            break;
+        }
+        if (size > RESERVATION_MAX_BUCKET) {
+            goto out;
+        }
+        if (size == 1) {
+            while (taken[next_free]) next_free++;
+            table->displacements[b] = -(int32_t)next_free - 1;
+            taken[next_free] = 1;
+            table->slots[next_free] = entries[bucket[0]];
+            continue;
+        }
+
+        int32_t displacement;
+        for (displacement = 1; displacement < RESERVATION_MAX_TRIES; displacement++) {
+            uint32_t i;
+            for (i = 0; i < size; i++) {
+                uint64_t h = hash_bytes(entries[bucket[i]].mac, 6, table->seed);
+                candidate[i] = hash_bytes(entries[bucket[i]].mac, 6, h ^ (uint64_t)displacement) % table->size;
+                if (taken[candidate[i]]) break;
+                uint32_t j;
+                for (j = 0; j < i && candidate[j] != candidate[i]; j++) {
+                }
+                if (j < i) break;
+            }
+            if (i == size) break;
+        }
+        if (displacement == RESERVATION_MAX_TRIES) {
+            goto out;
+        }
+        table->displacements[b] = displacement;
+        for (uint32_t i = 0; i < size; i++) {
+            taken[candidate[i]] = 1;
+            table->slots[candidate[i]] = entries[bucket[i]];
+        }
+    }
+    result = 0;
+
+out:
+    free(bucket_of);
+    free(sizes);
+    free(order);
+    free(members);
+    free(taken);
+    return result;
+}
+
+// Reads "<mac> <ip>" lines ('#' starts a comment) and builds the table and pool bitmaps
+int load_reservations(Config *cfg, const char *path, char *error, size_t error_len) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        snprintf(error, error_len, "cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    uint32_t count = 0, capacity = 1024;
+    Reservation *entries = malloc(capacity * sizeof(Reservation));
+    char line[256];
+    int line_number = 0;
+    while (entries != NULL && fgets(line, sizeof(line), file)) {
+        char mac_text[64], ip_text[64];
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        int fields = sscanf(line, "%63s %63s", mac_text, ip_text);
+        if (fields <= 0) {
+            continue;
+        }
+        if (count == capacity) {
+            Reservation *grown = realloc(entries, 2 * capacity * sizeof(Reservation));
+            if (grown == NULL) {
+                snprintf(error, error_len, "out of memory reading %s", path);
+                free(entries);
+                fclose(file);
+                return -1;
+            }
+            entries = grown;
+            capacity *= 2;
+        }
+        Reservation *r = &entries[count];
+        memset(r, 0, sizeof(*r));
+        if (fields != 2 || parse_mac(mac_text, r->mac) < 0 || inet_pton(AF_INET, ip_text, &r->ip) != 1) {
+            snprintf(error, error_len, "%s:%d: expected \"<mac> <ip>\"", path, line_number);
+            free(entries);
+            fclose(file);
+            return -1;
+        }
+        count++;
+    }
+    fclose(file);
+    if (entries == NULL) {
+        snprintf(error, error_len, "out of memory reading %s", path);
+        return -1;
+    }
+
+    ReservationTable *table = &cfg->reservations;
+    table->size = count;
+    table->num_buckets = count / RESERVATION_BUCKET_LOAD + 1;
+    table->slots = calloc(count + 1, sizeof(Reservation));
+    table->displacements = calloc(table->num_buckets, sizeof(int32_t));
+    if (table->slots == NULL || table->displacements == NULL) {
+        snprintf(error, error_len, "out of memory");
+        free(entries);
+        return -1;
+    }
+    int built = -1;
+    for (uint64_t seed = 1; count > 0 && seed <= 8 && built < 0; seed++) {
+        table->seed = hash64(seed);
+        built = build_reservation_hash(table, entries, count);
+    }
+    free(entries);
+    if (count > 0 && built < 0) {
+        // Only a MAC listed twice makes every seed fail
+        snprintf(error, error_len, "cannot build the reservation table from %s (duplicate MAC?)", path);
+        return -1;
+    }
+
+    // Reserved addresses are never handed out dynamically
+    for (int i = 0; i < cfg->num_pools; i++) {
+        Pool *pool = &cfg->pools[i];
+        pool->reserved = calloc((pool->end - pool->start) / 64 + 1, sizeof(uint64_t));
+        if (pool->reserved == NULL) {
+            snprintf(error, error_len, "out of memory");
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t ip = ntohl(table->slots[i].ip);
+        const Pool *pool = find_pool(cfg, table->slots[i].ip);
+        if (pool != NULL) {
+            if (pool_is_reserved(pool, ip)) {
+                snprintf(error, error_len, "%s: %s is reserved twice", path, inet_ntoa(*(struct in_addr *)&table->slots[i].ip));
+                return -1;
+            }
+            pool->reserved[(ip - pool->start) / 64] |= 1ULL << ((ip - pool->start) % 64);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Loaded %u reservations from %s in %.1f ms", count, path,
+             (finished.tv_sec - started.tv_sec) * 1000.0 + (finished.tv_nsec - started.tv_nsec) / 1e6);
+    write_log(log_message);
+    return 0;
+}
+
+void free_config(Config *cfg) {
+    for (int i = 0; i < cfg->num_pools; i++) {
+        free(cfg->pools[i].reserved);
+    }
+    free(cfg->reservations.slots);
+    free(cfg->reservations.displacements);
+    free(cfg);
+}
+
+// dns_upstream=<ip>[:<port>][,<ip>[:<port>]...]
+int parse_dns_upstreams(Config *cfg, char *value) {
+    cfg->num_upstreams = 0;
+    for (char *tok = strtok(value, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int port = 53;
+        char *colon = strchr(tok, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+        struct sockaddr_in *upstream = &cfg->upstreams[cfg->num_upstreams];
+        memset(upstream, 0, sizeof(*upstream));
+        upstream->sin_family = AF_INET;
+        upstream->sin_port = htons(port);
+        if (cfg->num_upstreams == DNS_MAX_UPSTREAMS || port <= 0 || port > 65535 ||
+            inet_pton(AF_INET, tok, &upstream->sin_addr) != 1) {
+            return -1;
+        }
+        cfg->num_upstreams++;
+    }
+    return 0;
+}
+
+// Relay agents and other hosts allowed to send (bulk) leasequeries, comma separated
+int parse_leasequery_requestors(Config *cfg, char *value) {
+    cfg->num_leasequery_requestors = 0;
+    for (char *tok = strtok(value, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (cfg->num_leasequery_requestors == MAX_LEASEQUERY_REQUESTORS ||
+            inet_pton(AF_INET, tok, &cfg->leasequery_requestors[cfg->num_leasequery_requestors]) != 1) {
+            return -1;
+        }
+        cfg->num_leasequery_requestors++;
+    }
+    return 0;
+}
+
+// pool=<first>-<last>[,<netmask>[,<router>[,<lease seconds>[,<jitter percent>]]]]
+int parse_pool(Config *cfg, char *value) {
+    if (cfg->num_pools == MAX_POOLS) {
+        return -1;
+    }
+    Pool *pool = &cfg->pools[cfg->num_pools];
+    memset(pool, 0, sizeof(*pool));
+
+    char *fields[5] = { NULL };
+    int n = 0;
+    char *saveptr;
+    for (char *tok = strtok_r(value, ",", &saveptr); tok != NULL && n < 5; tok = strtok_r(NULL, ",", &saveptr)) {
+        fields[n++] = tok;
+    }
+    char *dash = n > 0 ? strchr(fields[0], '-') : NULL;
+    if (dash == NULL) {
+        return -1;
+    }
+    *dash = '\0';
+
+    struct in_addr start, end;
+    if (inet_pton(AF_INET, fields[0], &start) != 1 || inet_pton(AF_INET, dash + 1, &end) != 1) {
+        return -1;
+    }
+    pool->start = ntohl(start.s_addr);
+    pool->end = ntohl(end.s_addr);
+    pool->subnet_mask = htonl(0xFFFFFF00); // 255.255.255.0
+    if (n > 1 && inet_pton(AF_INET, fields[1], &pool->subnet_mask) != 1) {
+        return -1;
+    }
+    if (n > 2 && inet_pton(AF_INET, fields[2], &pool->router) != 1) {
+        return -1;
+    }
+    if (n > 3 && (pool->lease_time = atoi(fields[3])) <= 0) {
+        return -1;
+    }
+    pool->jitter_percent = -1; // inherit lease_jitter_percent
+    if (n > 4 && ((pool->jitter_percent = atoi(fields[4])) < 0 || pool->jitter_percent > 50)) {
+        return -1;
+    }
+    cfg->num_pools++;
+    return 0;
+}
+
+// Checks the parsed values and fills in what is derived from them: per-pool defaults,
+// the reply option templates and the htype lookup table
+int finish_config(Config *cfg, const char *pool_start, const char *pool_end, const char *reservations_file) {
+    char error[256] = "";
+
+    if (cfg->num_pools == 0) {
+        // Legacy single pool from ip_pool_start/ip_pool_end
+        struct in_addr start, end;
+        if (inet_pton(AF_INET, pool_start, &start) != 1 || inet_pton(AF_INET, pool_end, &end) != 1) {
+            snprintf(error, sizeof(error), "invalid ip_pool_start/ip_pool_end");
+        } else {
+            cfg->pools[0].start = ntohl(start.s_addr);
+            cfg->pools[0].end = ntohl(end.s_addr);
+            cfg->pools[0].subnet_mask = htonl(0xFFFFFF00); // 255.255.255.0
+            cfg->pools[0].jitter_percent = -1;
+            cfg->num_pools = 1;
+        }
+    }
+    if (cfg->default_lease_time <= 0) {
+        snprintf(error, sizeof(error), "default_lease_time must be positive");
+    }
+    if (cfg->lease_jitter_percent < 0 || cfg->lease_jitter_percent > 50) {
+        snprintf(error, sizeof(error), "lease_jitter_percent must be between 0 and 50");
+    }
+    if (cfg->busy_lease_time < 0 || cfg->busy_threshold_percent < 1 || cfg->busy_threshold_percent > 100) {
+        snprintf(error, sizeof(error), "invalid busy_lease_time or busy_threshold_percent");
+    }
+    if (cfg->num_allowed_htypes == 0) {
+        snprintf(error, sizeof(error), "allowed_htypes is empty");
+    }
+    if (cfg->rate_limit_burst < 1 || cfg->rate_limit_burst > RATE_LIMIT_MAX_BURST) {
+        snprintf(error, sizeof(error), "rate_limit_burst must be between 1 and %d", RATE_LIMIT_MAX_BURST);
+    }
+
+    for (int i = 0; i < cfg->num_pools && error[0] == '\0'; i++) {
+        Pool *pool = &cfg->pools[i];
+        if (pool->start > pool->end) {
+            snprintf(error, sizeof(error), "pool %d ends before it starts", i);
+        }
+        for (int j = 0; j < i; j++) {
+            if (pool->start <= cfg->pools[j].end && cfg->pools[j].start <= pool->end) {
+                snprintf(error, sizeof(error), "pools %d and %d overlap", j, i);
+            }
+        }
+        if (pool->router == 0) {
+            pool->router = cfg->server_ip; // Using server IP as gateway
+        }
+        if (pool->lease_time == 0) {
+            pool->lease_time = cfg->default_lease_time;
+        }
+        if (pool->jitter_percent < 0) {
+            pool->jitter_percent = cfg->lease_jitter_percent;
+        }
+        pool->busy_lease_time = cfg->busy_lease_time;
+        pool->busy_threshold_percent = cfg->busy_threshold_percent;
+
+        // Options every reply from this pool carries, after 53 and 51
+        pool->options_len = 0;
+        add_dhcp_option(pool->options, &pool->options_len, 54, 4, (uint8_t*)&cfg->server_ip);
+        add_dhcp_option(pool->options, &pool->options_len, 1, 4, (uint8_t*)&pool->subnet_mask);
+        add_dhcp_option(pool->options, &pool->options_len, 3, 4, (uint8_t*)&pool->router);
+        add_dhcp_option(pool->options, &pool->options_len, 6, 4, (uint8_t*)&cfg->server_ip); // DNS server
+    }
+    if (error[0] == '\0' && reservations_file[0] != '\0') {
+        load_reservations(cfg, reservations_file, error, sizeof(error));
+    }
+
+    if (error[0] != '\0') {
+        char log_message[320];
+        snprintf(log_message, sizeof(log_message), "Invalid configuration: %s", error);
+        write_log(log_message);
+        return -1;
+    }
+
+    for (int i = 0; i < cfg->num_allowed_htypes; i++) {
+        cfg->htype_allowed[cfg->allowed_htypes[i]] = 1;
+    }
+    return 0;
+}
+
+// Parses CONFIG_FILE into a new immutable snapshot, or returns NULL if it is invalid.
+// At startup it also sets the settings that can't change while running.
+Config *load_config(int startup) {
+    Config *cfg = calloc(1, sizeof(Config));
+    if (cfg == NULL) {
+        perror("Config allocation failed");
+        return NULL;
+    }
+
+    // Defaults first, so keys missing from the file keep a sane value
+    char pool_start[128] = IP_POOL_START; // as long as a value, so inet_pton sees it whole
+    char pool_end[128] = IP_POOL_END;
+    char reservations_file[128] = "";
+    cfg->server_ip = inet_addr(SERVER_IP);
+    cfg->default_lease_time = 86400; // 24 hours
+    cfg->lease_jitter_percent = 10;
+    cfg->busy_lease_time = 0;
+    cfg->busy_threshold_percent = LEASE_THRESHOLD * 100;
+    cfg->allowed_htypes[0] = 1; // Ethernet
+    cfg->num_allowed_htypes = 1;
+    cfg->rate_limit_mac = 5;
+    cfg->rate_limit_relay = 500;
+    cfg->rate_limit_circuit = 20;
+    cfg->rate_limit_burst = 10;
+    cfg->queue_deadline_ms = 2000;
+    cfg->discover_retry_secs = 8;
+    cfg->dns_ttl = 300;
+    cfg->dns_register = 1;
+    cfg->conflict_probe_attempts = 1;
+    cfg->conflict_quarantine_secs = 3600;
+    cfg->dns_domain_len = dns_name_to_wire(DNS_DOMAIN, cfg->dns_domain);
+    if (startup) {
+        dhcp_server_port = DHCP_SERVER_PORT;
+        dhcp_client_port = DHCP_CLIENT_PORT;
+        dns_server_port = DNS_SERVER_PORT;
+        num_workers = 1;
+        task_threads = TASK_THREADS;
+        max_leases = MAX_CLIENTS;
+        strcpy(lease_shm_name, LEASE_SHM_NAME);
+        strcpy(control_socket_path, CONTROL_SOCKET);
+        strcpy(lease_snapshot_file, LEASE_SNAPSHOT_FILE);
+        dns_zone_file[0] = '\0';
+        replication_peer_text[0] = '\0';
+        strcpy(replication_role, "primary");
+        replication_port = 0;
+        replication_heartbeat_ms = REPL_HEARTBEAT_MS;
+        replication_failover_ms = REPL_FAILOVER_MS;
+        bulk_leasequery_port = 0;
+        strcpy(lease_feed_shm, LEASE_FEED_SHM_NAME);
+        lease_feed_socket[0] = '\0';
+        lease_feed_size = LEASE_FEED_SIZE;
+        lb_servers_text[0] = '\0';
+        lb_index = 0;
+        lb_failover_secs = LB_FAILOVER_SECS;
+        dns_max_names = DNS_MAX_NAMES;
+        io_backend = IO_BACKEND_SOCKET;
+        strcpy(packet_interface, "eth0");
+    }
+
+    FILE *config_file = fopen(CONFIG_FILE, "r");
+    if (config_file == NULL) {
+        if (!startup) {
+            write_log("Config reload: cannot open config file");
+            free(cfg);
+            return NULL;
+        }
+        fprintf(stderr, "Error opening config file. Using default values.\n");
+    }
+
+    int invalid = 0;
+    char line[256];
+    while (config_file != NULL && fgets(line, sizeof(line), config_file)) {
+        char key[64], value[128];
+        if (sscanf(line, "%63[^=]=%127s", key, value) == 2) {
+            if (strcmp(key, "ip_pool_start") == 0) snprintf(pool_start, sizeof(pool_start), "%s", value);
+            else if (strcmp(key, "ip_pool_end") == 0) snprintf(pool_end, sizeof(pool_end), "%s", value);
+            else if (strcmp(key, "pool") == 0) invalid |= parse_pool(cfg, value) < 0;
+            else if (strcmp(key, "reservations_file") == 0) snprintf(reservations_file, sizeof(reservations_file), "%s", value);
+            else if (strcmp(key, "server_ip") == 0) invalid |= inet_pton(AF_INET, value, &cfg->server_ip) != 1;
+            else if (strcmp(key, "dhcp_server_port") == 0) set_startup_int(&dhcp_server_port, atoi(value), key, startup);
+            else if (strcmp(key, "dhcp_client_port") == 0) set_startup_int(&dhcp_client_port, atoi(value), key, startup);
+            else if (strcmp(key, "default_lease_time") == 0) cfg->default_lease_time = atoi(value);
+            else if (strcmp(key, "lease_jitter_percent") == 0) cfg->lease_jitter_percent = atoi(value);
+            else if (strcmp(key, "busy_lease_time") == 0) cfg->busy_lease_time = atoi(value);
+            else if (strcmp(key, "busy_threshold_percent") == 0) cfg->busy_threshold_percent = atoi(value);
+            else if (strcmp(key, "dns_server_port") == 0) set_startup_int(&dns_server_port, atoi(value), key, startup);
+            else if (strcmp(key, "workers") == 0) set_startup_int(&num_workers, atoi(value), key, startup);
+            else if (strcmp(key, "task_threads") == 0) set_startup_int(&task_threads, atoi(value), key, startup);
+            else if (strcmp(key, "max_leases") == 0) set_startup_int(&max_leases, atoi(value), key, startup);
+            else if (strcmp(key, "lease_shm_name") == 0) set_startup_string(lease_shm_name, sizeof(lease_shm_name), value, key, startup);
+            else if (strcmp(key, "control_socket") == 0) set_startup_string(control_socket_path, sizeof(control_socket_path), value, key, startup);
+            else if (strcmp(key, "lease_snapshot_file") == 0) set_startup_string(lease_snapshot_file, sizeof(lease_snapshot_file), value, key, startup);
+            else if (strcmp(key, "dns_zone_file") == 0) set_startup_string(dns_zone_file, sizeof(dns_zone_file), value, key, startup);
+            else if (strcmp(key, "replication_peer") == 0) set_startup_string(replication_peer_text, sizeof(replication_peer_text), value, key, startup);
+            else if (strcmp(key, "replication_role") == 0) set_startup_string(replication_role, sizeof(replication_role), value, key, startup);
+            else if (strcmp(key, "replication_port") == 0) set_startup_int(&replication_port, atoi(value), key, startup);
+            else if (strcmp(key, "replication_heartbeat_ms") == 0) set_startup_int(&replication_heartbeat_ms, atoi(value), key, startup);
+            else if (strcmp(key, "replication_failover_ms") == 0) set_startup_int(&replication_failover_ms, atoi(value), key, startup);
+            else if (strcmp(key, "replication_wait_ms") == 0) cfg->replication_wait_ms = atoi(value);
+            else if (strcmp(key, "lease_feed_shm") == 0) set_startup_string(lease_feed_shm, sizeof(lease_feed_shm), value, key, startup);
+            else if (strcmp(key, "lease_feed_socket") == 0) set_startup_string(lease_feed_socket, sizeof(lease_feed_socket), value, key, startup);
+            else if (strcmp(key, "lease_feed_size") == 0) set_startup_int(&lease_feed_size, atoi(value), key, startup);
+            else if (strcmp(key, "bulk_leasequery_port") == 0) set_startup_int(&bulk_leasequery_port, atoi(value), key, startup);
+            else if (strcmp(key, "lb_servers") == 0) set_startup_string(lb_servers_text, sizeof(lb_servers_text), value, key, startup);
+            else if (strcmp(key, "lb_index") == 0) set_startup_int(&lb_index, atoi(value), key, startup);
+            else if (strcmp(key, "lb_failover_secs") == 0) set_startup_int(&lb_failover_secs, atoi(value), key, startup);
+            else if (strcmp(key, "dns_max_names") == 0) set_startup_int(&dns_max_names, atoi(value), key, startup);
+            else if (strcmp(key, "lb_max_secs") == 0) cfg->lb_max_secs = atoi(value);
+            else if (strcmp(key, "io_backend") == 0) {
+                int backend = IO_BACKEND_SOCKET;
+                if (strcmp(value, "io_uring") == 0) backend = IO_BACKEND_URING;
+                else if (strcmp(value, "packet") == 0) backend = IO_BACKEND_PACKET;
+                set_startup_int(&io_backend, backend, key, startup);
+            }
+            else if (strcmp(key, "interface") == 0) set_startup_string(packet_interface, sizeof(packet_interface), value, key, startup);
+            else if (strcmp(key, "rate_limit_mac") == 0) cfg->rate_limit_mac = atoi(value);
+            else if (strcmp(key, "rate_limit_relay") == 0) cfg->rate_limit_relay = atoi(value);
+            else if (strcmp(key, "rate_limit_circuit") == 0) cfg->rate_limit_circuit = atoi(value);
+            else if (strcmp(key, "rate_limit_burst") == 0) cfg->rate_limit_burst = atoi(value);
+            else if (strcmp(key, "queue_deadline_ms") == 0) cfg->queue_deadline_ms = atoi(value);
+            else if (strcmp(key, "discover_retry_secs") == 0) cfg->discover_retry_secs = atoi(value);
+            else if (strcmp(key, "dns_ttl") == 0) cfg->dns_ttl = atoi(value);
+            else if (strcmp(key, "dns_register") == 0) cfg->dns_register = atoi(value);
+            else if (strcmp(key, "dns_upstream") == 0) invalid |= parse_dns_upstreams(cfg, value) < 0;
+            else if (strcmp(key, "leasequery_requestors") == 0) invalid |= parse_leasequery_requestors(cfg, value) < 0;
+            else if (strcmp(key, "conflict_probe_ms") == 0) cfg->conflict_probe_ms = atoi(value);
+            else if (strcmp(key, "conflict_probe_attempts") == 0) cfg->conflict_probe_attempts = atoi(value);
+            else if (strcmp(key, "conflict_quarantine_secs") == 0) cfg->conflict_quarantine_secs = atoi(value);
+            else if (strcmp(key, "dns_domain") == 0) invalid |= (cfg->dns_domain_len = dns_name_to_wire(value, cfg->dns_domain)) < 0;
+            else if (strcmp(key, "allowed_htypes") == 0) {
+                // Comma separated ARP hardware types, e.g. 1,6
+                cfg->num_allowed_htypes = 0;
+                for (char *tok = strtok(value, ","); tok != NULL && cfg->num_allowed_htypes < MAX_ALLOWED_HTYPES; tok = strtok(NULL, ",")) {
+                    int htype = atoi(tok);
+                    invalid |= htype < 0 || htype > 255;
+                    cfg->allowed_htypes[cfg->num_allowed_htypes++] = htype & 0xff;
+                }
+            }
+            if (invalid) {
+                char log_message[320];
+                snprintf(log_message, sizeof(log_message), "Invalid configuration: bad value for %s", key);
+                write_log(log_message);
+                break;
+            }
+        }
+    }
+    if (config_file != NULL) {
+        fclose(config_file);
+    }
+
+    if (startup) {
+        if (num_workers < 1) num_workers = 1;
+        if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+        if (task_threads < 1) task_threads = 1;
+        if (task_threads > MAX_TASK_THREADS) task_threads = MAX_TASK_THREADS;
+        if (max_leases < 1) max_leases = MAX_CLIENTS;
+        snprintf(lease_snapshot_tmp, sizeof(lease_snapshot_tmp), "%s.tmp", lease_snapshot_file);
+    }
+
+    if (invalid || finish_config(cfg, pool_start, pool_end, reservations_file) < 0) {
+        free_config(cfg);
+        return NULL;
+    }
+    return cfg;
+}
+
+int uring_setup(IoUring *r) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->ring_fd = -1;
+    r->event_fd = -1;
+
+    r->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (r->ring_fd < 0) {
+        return -1;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring_ptr = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring_ptr == MAP_FAILED) {
+        r->sq_ring_ptr = NULL;
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring_ptr = r->sq_ring_ptr;
+    } else {
+        r->cq_ring_ptr = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring_ptr == MAP_FAILED) {
+            r->cq_ring_ptr = NULL;
+            return -1;
+        }
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ring_ptr;
+    uint8_t *cq = r->cq_ring_ptr;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i; // SQE slots are used in ring order
+    }
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Completions are signalled through an eventfd so the ring sits in the same epoll set
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->event_fd < 0 ||
+        syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) < 0) {
+        return -1;
+    }
+
+    // Provided buffer rings (kernel 5.19+); multishot receive picks buffers from these
+    for (int g = 0; g < URING_GROUPS; g++) {
+        size_t ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+        r->buf_ring[g] = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (r->buf_ring[g] == MAP_FAILED) {
+            r->buf_ring[g] = NULL;
+            return -1;
+        }
+        r->buffers[g] = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+        if (r->buffers[g] == NULL) {
+            return -1;
+        }
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring[g];
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = g;
+        if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return -1;
+        }
+
+        for (int bid = 0; bid < URING_BUFFERS; bid++) {
+            struct io_uring_buf *buf = &r->buf_ring[g]->bufs[bid];
+            buf->addr = (uint64_t)(uintptr_t)(r->buffers[g] + (size_t)bid * URING_BUFFER_SIZE);
+            buf->len = URING_BUFFER_SIZE;
+            buf->bid = bid;
+        }
+        __atomic_store_n(&r->buf_ring[g]->tail, URING_BUFFERS, __ATOMIC_RELEASE);
+
+        // Multishot recvmsg only looks at the name/control lengths of this template
+        memset(&r->recv_msg[g], 0, sizeof(r->recv_msg[g]));
+        r->recv_msg[g].msg_namelen = sizeof(struct sockaddr_in);
+        r->recv_msg[g].msg_controllen = g == 0 ? CMSG_SPACE(sizeof(struct timespec)) : 0; // SO_TIMESTAMPNS
+    }
+
+    r->send_slots = calloc(URING_SEND_SLOTS, sizeof(UringSendSlot));
+    if (r->send_slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        r->send_slots[i].next_free = i + 1 < URING_SEND_SLOTS ? i + 1 : -1;
+    }
+    r->free_send_slot = 0;
+    return 0;
+}
+
+void uring_close(IoUring *r) {
+    if (r->send_slots != NULL) free(r->send_slots);
+    for (int g = 0; g < URING_GROUPS; g++) {
+        if (r->buf_ring[g] != NULL) munmap(r->buf_ring[g], URING_BUFFERS * sizeof(struct io_uring_buf));
+        if (r->buffers[g] != NULL) free(r->buffers[g]);
+    }
+    if (r->sqes != NULL) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_ptr != NULL && r->cq_ring_ptr != r->sq_ring_ptr) munmap(r->cq_ring_ptr, r->cq_ring_size);
+    if (r->sq_ring_ptr != NULL) munmap(r->sq_ring_ptr, r->sq_ring_size);
+    if (r->event_fd >= 0) close(r->event_fd);
+    if (r->ring_fd >= 0) close(r->ring_fd);
+    memset(r, 0, sizeof(*r));
+    r->ring_fd = -1;
+    r->event_fd = -1;
+}
+
+// Hands everything queued since the last call to the kernel in one io_uring_enter
+void uring_submit(IoUring *r) {
+    if (r->sq_pending == 0) {
+        return;
+    }
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->ring_fd, r->sq_pending, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        perror("io_uring_enter failed");
+        return;
+    }
+    r->sq_pending -= ret;
+}
+
+struct io_uring_sqe *uring_get_sqe(IoUring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        uring_submit(r);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+    r->sq_pending++;
+    return sqe;
+}
+
+int uring_arm_recv(IoUring *r, int sock, int group) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&r->recv_msg[group];
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = URING_TAG(URING_OP_RECV, group);
+    return 0;
+}
+
+void uring_recycle_buffer(IoUring *r, int group, int bid) {
+    struct io_uring_buf_ring *ring = r->buf_ring[group];
+    unsigned short tail = ring->tail;
+    struct io_uring_buf *buf = &ring->bufs[tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(r->buffers[group] + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Copies the datagram into a send slot and queues a sendmsg; the slot is freed on completion
+int uring_queue_send(IoUring *r, int sock, const void *data, size_t len, struct sockaddr_in *addr) {
+    if (r->free_send_slot < 0 || len > sizeof(r->send_slots[0].data)) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL) {
+        return -1;
+    }
+    int index = r->free_send_slot;
+    UringSendSlot *slot = &r->send_slots[index];
+    r->free_send_slot = slot->next_free;
+
+    memcpy(slot->data, data, len);
+    slot->addr = *addr;
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = len;
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    slot->msg.msg_name = &slot->addr;
+    slot->msg.msg_namelen = sizeof(slot->addr);
+    slot->msg.msg_iov = &slot->iov;
+    slot->msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG(URING_OP_SEND, index);
+    return 0;
+}
+
+// Backend-neutral datagram send used by both the DHCP and the DNS side
+int send_datagram(Worker *w, int sock, const void *data, size_t len, struct sockaddr_in *addr) {
+    if (w->io_backend == IO_BACKEND_URING && uring_queue_send(&w->ring, sock, data, len, addr) == 0) {
+        return 0;
+    }
+    // Plain path, also used when the ring has no free send slot
+    return sendto(sock, data, len, 0, (struct sockaddr *)addr, sizeof(*addr)) < 0 ? -1 : 0;
+}
+
+// Ones-complement sum over 32-bit words into a 64-bit accumulator: no per-word
+// carry handling, so the loop stays branch-free and the compiler can vectorize it
+uint64_t checksum_partial(const void *data, size_t len, uint64_t sum) {
+    const uint8_t *p = data;
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        sum += word;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t half;
+        memcpy(&half, p, 2);
+        sum += half;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t last = 0;
+        memcpy(&last, p, 1);
+        sum += last;
+    }
+    return sum;
+}
+
+uint16_t checksum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Appends the BOOTREQUEST sanity checks. 'mode' is BPF_ABS for UDP sockets, whose filter
+// sees the UDP header first, or BPF_IND for AF_PACKET once X holds the IP header length.
+// Failed checks jump to FILTER_DROP, patched to the final "ret #0" by finish_filter().
+int append_dhcp_checks(const Config *cfg, struct sock_filter *code, int n, uint32_t base, int mode) {
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+    if (mode == BPF_IND) {
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0);
+    }
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, base + DHCP_MIN_LENGTH, 0, FILTER_DROP);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | mode, base);         // op
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, FILTER_DROP);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | mode, base + 236);   // magic cookie
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DHCP_MAGIC_COOKIE, 0, FILTER_DROP);
+    // htype 0 with hlen 0 is left for userspace, which lets it through for leasequeries only
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | mode, base + 1);     // htype, hlen
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, cfg->num_allowed_htypes + 1, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | mode, base + 1);     // htype
+    for (int i = 0; i < cfg->num_allowed_htypes; i++) {
+        int last = i == cfg->num_allowed_htypes - 1;
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cfg->allowed_htypes[i],
+                                                 cfg->num_allowed_htypes - 1 - i, last ? FILTER_DROP : 0);
+    }
+    return n;
+}
+
+int finish_filter(int fd, struct sock_filter *code, int n) {
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0x40000);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    for (int i = 0; i < n; i++) {
+        if (BPF_CLASS(code[i].code) == BPF_JMP && code[i].jt == FILTER_DROP) {
+            code[i].jt = n - 1 - (i + 1);
+        }
+        if (BPF_CLASS(code[i].code) == BPF_JMP && code[i].jf == FILTER_DROP) {
+            code[i].jf = n - 1 - (i + 1);
+        }
+    }
+
+    struct sock_fprog prog = { n, code };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_FILTER) failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Junk never leaves the kernel: too short, not a BOOTREQUEST, no magic cookie, or odd htype
+int attach_dhcp_filter(int sock, const Config *cfg) {
+    struct sock_filter code[FILTER_MAX_INSNS];
+    int n = append_dhcp_checks(cfg, code, 0, sizeof(struct udphdr), BPF_ABS);
+    return finish_filter(sock, code, n);
+}
+
+// Same checks behind IPv4/UDP to the server port, unfragmented, for the AF_PACKET ring
+int attach_packet_filter(int fd, int port, const Config *cfg) {
+    struct sock_filter code[FILTER_MAX_INSNS] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                              // ethertype
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, FILTER_DROP),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),                              // IP protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, FILTER_DROP),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                              // fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, FILTER_DROP, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),                             // X = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),                              // UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)port, 0, FILTER_DROP),
+    };
+    int n = append_dhcp_checks(cfg, code, 9, sizeof(struct ether_header) + sizeof(struct udphdr), BPF_IND);
+    return finish_filter(fd, code, n);
+}
+
+// The UDP socket stays bound (relay replies, no ICMP unreachables) but must not queue copies
+int attach_drop_all_filter(int fd) {
+    struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+    struct sock_fprog prog = { 1, code };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int packet_ring_setup(PacketRing *p, int worker_id, const Config *cfg) {
+    memset(p, 0, sizeof(*p));
+    p->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (p->fd < 0) {
+        perror("AF_PACKET socket failed");
+        return -1;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", packet_interface);
+    if (ioctl(p->fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror("SIOCGIFINDEX failed");
+        return -1;
+    }
+    p->ifindex = ifr.ifr_ifindex;
+    if (ioctl(p->fd, SIOCGIFHWADDR, &ifr) < 0) {
+        perror("SIOCGIFHWADDR failed");
+        return -1;
+    }
+    memcpy(p->mac, ifr.ifr_hwaddr.sa_data, 6);
+    // Replies are sourced from the interface address, or server_ip if it has none yet
+    p->ip = cfg->server_ip;
+    if (ioctl(p->fd, SIOCGIFADDR, &ifr) == 0) {
+        p->ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+    }
+
+    // Filter before binding so no unfiltered frame is ever queued
+    if (attach_packet_filter(p->fd, dhcp_server_port, cfg) < 0) {
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt(PACKET_VERSION) failed");
+        return -1;
+    }
+
+    p->rx_req.tp_block_size = PACKET_BLOCK_SIZE;
+    p->rx_req.tp_block_nr = PACKET_RX_BLOCKS;
+    p->rx_req.tp_frame_size = PACKET_FRAME_SIZE;
+    p->rx_req.tp_frame_nr = PACKET_RX_BLOCKS * (PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE);
+    p->rx_req.tp_retire_blk_tov = 10; // ms: hand over a partly filled block under light load
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_RX_RING, &p->rx_req, sizeof(p->rx_req)) < 0) {
+        perror("setsockopt(PACKET_RX_RING) failed");
+        return -1;
+    }
+
+    p->tx_req.tp_block_size = PACKET_BLOCK_SIZE;
+    p->tx_req.tp_block_nr = PACKET_TX_FRAMES / (PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE);
+    p->tx_req.tp_frame_size = PACKET_FRAME_SIZE;
+    p->tx_req.tp_frame_nr = PACKET_TX_FRAMES;
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_TX_RING, &p->tx_req, sizeof(p->tx_req)) < 0) {
+        perror("setsockopt(PACKET_TX_RING) failed");
+        return -1;
+    }
+
+    p->rx_size = (size_t)PACKET_BLOCK_SIZE * PACKET_RX_BLOCKS;
+    p->map_size = p->rx_size + (size_t)PACKET_BLOCK_SIZE * p->tx_req.tp_block_nr;
+    p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, p->fd, 0);
+    if (p->map == MAP_FAILED) {
+        p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+    }
+    if (p->map == MAP_FAILED) {
+        p->map = NULL;
+        perror("mmap packet ring failed");
+        return -1;
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    ll.sll_ifindex = p->ifindex;
+    if (bind(p->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+        perror("AF_PACKET bind failed");
+        return -1;
+    }
+
+    // Several workers share the interface: the kernel hashes flows across their rings
+    if (num_workers > 1) {
+        int fanout = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(p->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+            perror("setsockopt(PACKET_FANOUT) failed");
+            return -1;
+        }
+    }
+
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Worker %d receiving on %s through a TPACKET_V3 ring", worker_id, packet_interface);
+    write_log(log_message);
+    return 0;
+}
+
+void packet_ring_close(PacketRing *p) {
+    if (p->map != NULL) munmap(p->map, p->map_size);
+    if (p->fd > 0) close(p->fd);
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+}
+
+// Builds Ethernet/IPv4/UDP around the reply directly in the next free TX frame
+int packet_queue_reply(PacketRing *p, const DHCPPacket *response) {
+    uint8_t *frame = p->map + p->rx_size + (size_t)p->tx_frame * PACKET_FRAME_SIZE;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+        return -1; // ring full, the kernel is still transmitting this frame
+    }
+
+    int broadcast = (ntohs(response->flags) & 0x8000) != 0;
+    uint8_t *data = frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+    struct ether_header *eth = (struct ether_header *)data;
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    uint16_t udp_len = sizeof(struct udphdr) + sizeof(DHCPPacket);
+
+    memset(eth->ether_dhost, 0xff, ETH_ALEN);
+    if (!broadcast) {
+        memcpy(eth->ether_dhost, response->chaddr, ETH_ALEN);
+    }
+    memcpy(eth->ether_shost, p->mac, ETH_ALEN);
+    eth->ether_type = htons(ETH_P_IP);
+
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(struct iphdr) + udp_len);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = p->ip;
+    ip->daddr = broadcast ? INADDR_BROADCAST : response->yiaddr;
+    ip->check = checksum_fold(checksum_partial(ip, sizeof(*ip), 0));
+
+    udp->source = htons(dhcp_server_port);
+    udp->dest = htons(dhcp_client_port);
+    udp->len = htons(udp_len);
+    udp->check = 0;
+    memcpy(udp + 1, response, sizeof(DHCPPacket));
+
+    // Pseudo-header, then the UDP header and payload in one pass
+    uint64_t sum = (uint64_t)ip->saddr + ip->daddr + htons(IPPROTO_UDP) + htons(udp_len);
+    uint16_t check = checksum_fold(checksum_partial(udp, udp_len, sum));
+    udp->check = check == 0 ? 0xffff : check;
+
+    hdr->tp_len = sizeof(struct ether_header) + sizeof(struct iphdr) + udp_len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    p->tx_frame = (p->tx_frame + 1) % PACKET_TX_FRAMES;
+    p->tx_pending++;
+    return 0;
+}
+
+// One send() kicks the kernel to transmit every frame queued since the last flush
+void packet_flush(PacketRing *p) {
+    if (p->tx_pending == 0) {
+        return;
+    }
+    if (send(p->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        perror("AF_PACKET send failed");
+    }
+    p->tx_pending = 0;
+}
+
+// Replies go out through the worker's own (non-blocking) server socket
+void send_dhcp_response(Worker *w, DHCPPacket *response, struct sockaddr_in *client_addr, const char *sent_message) {
+    client_addr->sin_port = htons(dhcp_client_port);
+
+    // Clients without an address can only be reached at L2; relayed and renewing ones go through IP
+    if (w->io_backend == IO_BACKEND_PACKET && response->giaddr == 0 && response->ciaddr == 0) {
+        if (packet_queue_reply(&w->packet, response) == 0) {
+            STAT_INC(replies_sent);
+            write_log(sent_message);
+        } else {
+            write_log("Packet TX ring full, dropped reply");
+        }
+        return;
+    }
+
+    if (send_datagram(w, w->dhcp_sock, response, sizeof(DHCPPacket), client_addr) < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "Sendto failed: %s", strerror(errno));
+        write_log(error_msg);
+    } else {
+        STAT_INC(replies_sent);
+        write_log(sent_message);
+    }
+}
+
+uint32_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Offers the address the exchange holds, with its pool's lease times and options
+void send_dhcp_offer(Worker *w, Exchange *x, const Pool *pool) {
+    DHCPPacket response;
+    memset(&response, 0, sizeof(DHCPPacket));
+
+    response.op = 2; // Boot Reply
+    response.htype = x->packet.htype;
+    response.hlen = x->packet.hlen;
+    response.xid = x->packet.xid;
+    response.flags = x->packet.flags;
+    response.giaddr = x->packet.giaddr;
+    response.siaddr = w->config->server_ip;
+    response.yiaddr = x->ip;
+    memcpy(response.chaddr, x->packet.chaddr, 16);
+
+    int option_offset = 0;
+    init_dhcp_options(response.options, &option_offset);
+    uint8_t dhcp_msg_type = 2; // DHCP Offer
+    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+
+    // Lease time, renewal (T1) and rebinding (T2) times
+    uint32_t lease_time = htonl(x->lease_time);
+    uint32_t t1 = htonl(x->t1);
+    uint32_t t2 = htonl(x->t2);
+    add_dhcp_option(response.options, &option_offset, 51, 4, (uint8_t*)&lease_time);
+    add_dhcp_option(response.options, &option_offset, 58, 4, (uint8_t*)&t1);
+    add_dhcp_option(response.options, &option_offset, 59, 4, (uint8_t*)&t2);
+
+    // Server id, subnet mask, router and DNS server
+    memcpy(&response.options[option_offset], pool->options, pool->options_len);
+    option_offset += pool->options_len;
+
+    response.options[option_offset++] = 255; // End option
+
+    send_dhcp_response(w, &response, &x->client_addr, "Sent DHCP Offer to client");
+}
+
+// Exchanges: frames come from a per-worker pool with a free list, so one in flight costs a
+// frame and nothing else. The echo sequence number carries the frame index and generation.
+Exchange *exchange_alloc(Worker *w) {
+    if (w->free_exchange < 0) {
+        return NULL;
+    }
+    Exchange *x = &w->exchanges[w->free_exchange];
+    w->free_exchange = x->next_free;
+    x->in_use = 1;
+    x->pooled = 1;
+    x->resume = 0;
+    x->wait = EXCHANGE_WAIT_NONE;
+    x->result = 0;
+    w->exchanges_in_use++;
+    return x;
+}
+
+void exchange_free(Worker *w, Exchange *x) {
+    x->in_use = 0;
+    x->generation++;
+    x->next_free = w->free_exchange;
+    w->free_exchange = x - w->exchanges;
+    w->exchanges_in_use--;
+}
+
+// Runs the handler to its next await, or to the end, which returns the frame to the pool
+void resume_exchange(Worker *w, Exchange *x) {
+    x->wait = EXCHANGE_WAIT_NONE;
+    if (x->handler(w, x)) {
+        exchange_free(w, x);
+    }
+}
+
+// Pulls the exchange timer in if 'deadline_ms' comes before what it is set to
+void arm_exchange_timer(Worker *w, uint32_t deadline_ms) {
+    if (w->exchange_timer_armed && (int32_t)(deadline_ms - w->exchange_timer_ms) >= 0) {
+        return;
+    }
+    int32_t wait_ms = (int32_t)(deadline_ms - monotonic_ms());
+    if (wait_ms < 1) wait_ms = 1;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = wait_ms / 1000;
+    spec.it_value.tv_nsec = (wait_ms % 1000) * 1000000L;
+    timerfd_settime(w->exchange_timer_fd, 0, &spec, NULL);
+    w->exchange_timer_armed = 1;
+    w->exchange_timer_ms = deadline_ms;
+}
+
+// Awaitable: resumes the exchange after 'ms'
+void exchange_sleep(Worker *w, Exchange *x, int ms) {
+    x->wait = EXCHANGE_WAIT_TIMER;
+    x->deadline_ms = monotonic_ms() + ms;
+    arm_exchange_timer(w, x->deadline_ms);
+}
+
+// Awaitable: pings 'ip' and resumes the exchange with result 1 on an echo reply, or 0 once
+// 'ms' passed without one. Sends one ICMP echo request; the reply, if any, carries 'seq' back
+void exchange_ping(Worker *w, Exchange *x, uint32_t ip, int ms) {
+    uint16_t seq = (uint16_t)((x->generation << EXCHANGE_INDEX_BITS) | (x - w->exchanges));
+    uint8_t message[16] = { 8, 0, 0, 0, w->probe_ident >> 8, w->probe_ident & 0xff, seq >> 8, seq & 0xff,
+                            'd', 'h', 'c', 'p', 'p', 'r', 'o', 'b' };
+    uint16_t sum = checksum_fold(checksum_partial(message, sizeof(message), 0));
+    memcpy(message + 2, &sum, 2);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    STAT_INC(conflict_probes);
+    if (sendto(w->probe_sock, message, sizeof(message), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EAGAIN) {
+        perror("ICMP probe sendto failed"); // the wait times out and the address counts as free
+    }
+    exchange_sleep(w, x, ms);
+    x->wait = EXCHANGE_WAIT_ECHO;
+    x->seq = seq;
+    x->wait_ip = ip;
+}
+
+// Whether this worker already pings 'ip' for an exchange, e.g. for a retransmitted DISCOVER
+int exchange_pinging(Worker *w, uint32_t ip) {
+    for (int i = 0, seen = 0; i < MAX_EXCHANGES && seen < w->exchanges_in_use; i++) {
+        if (w->exchanges[i].in_use) {
+            seen++;
+            if (w->exchanges[i].wait == EXCHANGE_WAIT_ECHO && w->exchanges[i].wait_ip == ip) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Reserved clients always get their own address, with the options of its pool if any
+const Pool *discover_pool(const Config *cfg, DHCPPacket *packet, uint32_t *reserved_ip) {
+    *reserved_ip = reservation_lookup(cfg, packet->chaddr);
+    const Pool *pool = *reserved_ip != 0 ? find_pool(cfg, *reserved_ip) : NULL;
+    return pool != NULL ? pool : select_pool(cfg, packet);
+}
+
+// Holds an address for the client until it requests it or the offer times out. Returns 1 if
+// it was free or only offered until now, 0 if the client already holds a lease on it and -1
+// if there is nothing to offer
+int hold_offer_address(const Config *cfg, const Pool *pool, uint32_t reserved_ip, Exchange *x) {
+    int fresh = 0;
+    pthread_mutex_lock(&lease_mutex);
+    pool_lease_times(pool, &x->packet, &x->lease_time, &x->t1, &x->t2);
+    x->ip = reserved_ip != 0 ? reserved_ip : get_next_available_ip(cfg, pool, x->packet.chaddr);
+    if (x->ip != 0) {
+        x->lease = lease_record_locked(x->ip);
+        if (x->lease < 0 || ip_leases[x->lease].state == 3 ||
+            (ip_leases[x->lease].state != 0 && memcmp(ip_leases[x->lease].mac, x->packet.chaddr, 6) != 0)) {
+            x->ip = 0; // a reserved address still leased to someone else, or in conflict
+        } else if (ip_leases[x->lease].state != 2) {
+            lease_update_locked(x->lease, x->packet.chaddr, 1, time(NULL), OFFER_TIMEOUT);
+            fresh = 1;
+        }
+    }
+    pthread_mutex_unlock(&lease_mutex);
+    return x->ip != 0 ? fresh : -1;
+}
+
+// An address answered a ping: nobody gets it until the quarantine ends
+void quarantine_conflict(const Config *cfg, Exchange *x) {
+    int quarantined = 0;
+    pthread_mutex_lock(&lease_mutex);
+    IPLease *lease = &ip_leases[x->lease];
+    if (lease->state == 1 && memcmp(lease->mac, x->packet.chaddr, 6) == 0) {
+        lease_quarantine_locked(x->lease, cfg->conflict_quarantine_secs);
+        quarantined = 1;
+    }
+    pthread_mutex_unlock(&lease_mutex);
+    if (quarantined) {
+        char ip[16];
+        char log_message[256];
+        format_ip(x->ip, ip);
+        snprintf(log_message, sizeof(log_message), "Address conflict: %s answered a ping, quarantined for %d seconds",
+                 ip, cfg->conflict_quarantine_secs);
+        write_log(log_message);
+        STAT_INC(conflicts_found);
+    }
+}
+
+// The DISCOVER handler. Before offering an address nobody has used lately, it pings it
+// conflict_probe_attempts times, waiting conflict_probe_ms for each, and moves on to the
+// next address if one answers. Without a pool frame (probing off, or too many in flight)
+// it runs straight through from a frame on the caller's stack.
+int discover_exchange(Worker *w, Exchange *x) {
+    const Config *cfg = w->config; // may be a newer snapshot after an await
+    const Pool *pool;
+    uint32_t reserved_ip;
+    int fresh;
+
+    CO_BEGIN(x);
+    for (;;) {
+        pool = discover_pool(cfg, &x->packet, &reserved_ip);
+        if (pool == NULL) {
+            write_log("No pool configured for the relay's subnet");
+            CO_RETURN(x);
+        }
+        fresh = hold_offer_address(cfg, pool, reserved_ip, x);
+        if (fresh < 0) {
+            CO_RETURN(x); // Nothing to offer
+        }
+        if (!fresh || !x->pooled || w->probe_sock < 0 || cfg->conflict_probe_ms <= 0 ||
+            (int32_t)(__atomic_load_n(&probe_clean_until[x->lease], __ATOMIC_RELAXED) - monotonic_ms() / 1000) > 0) {
+            break; // no need to ask, or no way to
+        }
+        if (exchange_pinging(w, x->ip)) {
+            CO_RETURN(x); // a retransmission: the exchange already pinging answers it
+        }
+
+        for (x->attempt = 0; x->attempt < cfg->conflict_probe_attempts; x->attempt++) {
+            exchange_ping(w, x, x->ip, cfg->conflict_probe_ms);
+            CO_AWAIT(x);
+            if (x->result) {
+                break;
+            }
+        }
+        if (!x->result) {
+            __atomic_store_n(&probe_clean_until[x->lease], monotonic_ms() / 1000 + CONFLICT_PROBE_CACHE, __ATOMIC_RELAXED);
+            pool = discover_pool(cfg, &x->packet, &reserved_ip); // the one from before the wait is gone
+            if (pool == NULL) {
+                CO_RETURN(x);
+            }
+            break;
+        }
+        quarantine_conflict(cfg, x);
+    }
+    send_dhcp_offer(w, x, pool);
+    CO_END(x);
+}
+
+void handle_dhcp_discover(Worker *w, DHCPPacket *packet, struct sockaddr_in *client_addr) {
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Handling DHCP Discover from %s", inet_ntoa(client_addr->sin_addr));
+    write_log(log_message);
+
+    // Only an exchange that may have to wait needs a frame from the pool
+    Exchange local;
+    Exchange *x = w->config->conflict_probe_ms > 0 && w->probe_sock >= 0 ? exchange_alloc(w) : NULL;
+    if (x == NULL) {
+        x = &local;
+        x->pooled = 0;
+        x->resume = 0;
+    }
+    x->handler = discover_exchange;
+    x->packet = *packet;
+    x->client_addr = *client_addr;
+    if (x->pooled) {
+        resume_exchange(w, x);
+    } else {
+        discover_exchange(w, x);
+    }
+}
+
+// The name a client asked for, as <first label of option 81, else option 12>.<dns_domain>
+// in wire format. Clients only get names under dns_domain. Returns the length, 0 for none.
+int client_dns_name(const Config *cfg, DHCPPacket *packet, uint8_t *wire) {
+    const uint8_t *label = NULL;
+    int label_len = 0;
+    uint8_t length;
+    uint8_t *fqdn = find_dhcp_option(packet, 81, &length);
+    if (fqdn != NULL && length > 3) {
+        // flags, two obsolete rcodes, then the name: wire format if E (0x04) is set
+        if (fqdn[0] & 0x04) {
+            label = fqdn + 4;
+            label_len = fqdn[3] < length - 4 ? fqdn[3] : length - 4;
+        } else {
+            label = fqdn + 3;
+            label_len = length - 3;
+        }
+    } else {
+        label = find_dhcp_option(packet, 12, &length);
+        label_len = length;
+    }
+    if (label == NULL) {
+        return 0;
+    }
+    const uint8_t *dot = memchr(label, '.', label_len);
+    if (dot != NULL) {
+        label_len = dot - label;
+    }
+    while (label_len > 0 && label[label_len - 1] == '\0') {
+        label_len--; // some clients count a trailing NUL
+    }
+    if (label_len == 0 || label_len > 63 || 1 + label_len + cfg->dns_domain_len > DNS_MAX_WIRE_NAME ||
+        label[0] == '-' || label[label_len - 1] == '-') {
+        return 0;
+    }
+
+    wire[0] = label_len;
+    for (int i = 0; i < label_len; i++) {
+        if (!isalnum(label[i]) && label[i] != '-') {
+            return 0; // not a valid hostname
+        }
+        wire[1 + i] = tolower(label[i]);
+    }
+    memcpy(wire + 1 + label_len, cfg->dns_domain, cfg->dns_domain_len);
+    return 1 + label_len + cfg->dns_domain_len;
+}
+
+// With replication_wait_ms set, an ACK goes out once the standby has the lease, or when
+// the wait is up, whichever comes first
+int replicated_reply_exchange(Worker *w, Exchange *x) {
+    CO_BEGIN(x);
+    exchange_sleep(w, x, w->config->replication_wait_ms);
+    x->wait = EXCHANGE_WAIT_REPLICATED;
+    w->replication_waiters++;
+    CO_AWAIT(x);
+    w->replication_waiters--;
+    send_dhcp_response(w, &x->packet, &x->client_addr, "Sent DHCP ACK to client");
+    CO_END(x);
+}
+
+// Returns 1 if the reply was handed to an exchange that sends it when the standby caught up
+int hold_for_replication(Worker *w, DHCPPacket *response, struct sockaddr_in *client_addr) {
+    if (w->config->replication_wait_ms <= 0 || !__atomic_load_n(&replication_connected, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    uint64_t seq = __atomic_load_n(&journal_head, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&replication_acked, __ATOMIC_ACQUIRE) >= seq) {
+        return 0;
+    }
+    Exchange *x = exchange_alloc(w);
+    if (x == NULL) {
+        return 0;
+    }
+    x->handler = replicated_reply_exchange;
+    x->packet = *response;
+    x->client_addr = *client_addr;
+    x->journal_seq = seq;
+    resume_exchange(w, x);
+    return 1;
+}
+
+// Called when the wake eventfd fires: the standby acknowledged more, or went away
+void resume_replicated_exchanges(Worker *w) {
+    uint64_t acked = __atomic_load_n(&replication_acked, __ATOMIC_ACQUIRE);
+    int connected = __atomic_load_n(&replication_connected, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < MAX_EXCHANGES && w->replication_waiters > 0; i++) {
+        Exchange *x = &w->exchanges[i];
+        if (x->in_use && x->wait == EXCHANGE_WAIT_REPLICATED && (acked >= x->journal_seq || !connected)) {
+            resume_exchange(w, x);
+        }
+    }
+}
+
+void handle_dhcp_request(Worker *w, DHCPPacket *packet, struct sockaddr_in *client_addr) {
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Handling DHCP Request from %s", inet_ntoa(client_addr->sin_addr));
+    write_log(log_message);
+
+    // The address being requested: option 50 while selecting, ciaddr while renewing
+    uint32_t requested_ip = packet->ciaddr;
+    uint8_t length;
+    uint8_t *requested = find_dhcp_option(packet, 50, &length);
+    if (requested != NULL && length == 4) {
+        memcpy(&requested_ip, requested, 4);
+    }
+    if (requested_ip == 0) {
+        requested_ip = packet->yiaddr;
+    }
+
+    DHCPPacket response;
+    memset(&response, 0, sizeof(DHCPPacket));
 
     response.op = 2; // Boot Reply
     response.htype = packet->htype;
     response.hlen = packet->hlen;
     response.xid = packet->xid;
-    response.yiaddr = packet->yiaddr;
-    response.siaddr = inet_addr(server_ip);
+    response.flags = packet->flags;
+    response.giaddr = packet->giaddr;
+    response.siaddr = w->config->server_ip;
     memcpy(response.chaddr, packet->chaddr, 16);
 
-    int option_offset = 0;
-    uint8_t dhcp_msg_type = 5; // DHCP ACK
-    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+    // Another client's lease (or an address outside the pool) gets a NAK
+    // A reserved client may only have its reservation, and nobody else may have it
+    int acked = 0;
+    uint32_t reserved_ip = reservation_lookup(w->config, packet->chaddr);
+    const Pool *pool = find_pool(w->config, requested_ip);
+    if (pool == NULL && reserved_ip != 0 && requested_ip == reserved_ip) {
+        pool = select_pool(w->config, packet);
+    }
+    int allowed = pool != NULL && requested_ip != 0 &&
+                  (reserved_ip != 0 ? requested_ip == reserved_ip : !pool_is_reserved(pool, ntohl(requested_ip)));
+    uint32_t lease_time, t1, t2;
+    uint8_t dns_name[DNS_MAX_WIRE_NAME];
+    int dns_name_len = allowed && w->config->dns_register ? client_dns_name(w->config, packet, dns_name) : 0;
+    pthread_mutex_lock(&lease_mutex);
+    if (allowed) {
+        int index = lease_record_locked(requested_ip);
+        if (index >= 0 && ip_leases[index].state != 3 &&
+            (ip_leases[index].state == 0 || memcmp(ip_leases[index].mac, packet->chaddr, 6) == 0)) {
+            pool_lease_times(pool, packet, &lease_time, &t1, &t2);
+            lease_update_locked(index, packet->chaddr, 2, time(NULL), lease_time);
+            if (dns_name_len > 0) {
+                queue_dns_update_locked(index, dns_name, dns_name_len);
+            }
+            acked = 1;
+        }
+    }
+    pthread_mutex_unlock(&lease_mutex);
+
+    int option_offset = 0;
+    init_dhcp_options(response.options, &option_offset);
+    uint32_t server_id = w->config->server_ip;
+
+    if (!acked) {
+        uint8_t dhcp_msg_type = 6; // DHCP NAK
+        add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+        add_dhcp_option(response.options, &option_offset, 54, 4, (uint8_t*)&server_id);
+        response.options[option_offset++] = 255; // End option
+        send_dhcp_response(w, &response, client_addr, "Sent DHCP NAK to client");
+        return;
+    }
+
+    response.yiaddr = requested_ip;
+    uint8_t dhcp_msg_type = 5; // DHCP ACK
+    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+
+    // Lease time, renewal (T1) and rebinding (T2) times
+    lease_time = htonl(lease_time);
+    t1 = htonl(t1);
+    t2 = htonl(t2);
+    add_dhcp_option(response.options, &option_offset, 51, 4, (uint8_t*)&lease_time);
+    add_dhcp_option(response.options, &option_offset, 58, 4, (uint8_t*)&t1);
+    add_dhcp_option(response.options, &option_offset, 59, 4, (uint8_t*)&t2);
+
+    // Server id, subnet mask, router and DNS server
+    memcpy(&response.options[option_offset], pool->options, pool->options_len);
+    option_offset += pool->options_len;
+
+    response.options[option_offset++] = 255; // End option
+
+    char ip[16], mac[18];
+    format_ip(requested_ip, ip);
+    format_mac(packet->chaddr, mac);
+    snprintf(log_message, sizeof(log_message), "Assigned IP: %s to MAC: %s", ip, mac);
+    write_log(log_message);
+
+    if (hold_for_replication(w, &response, client_addr)) {
+        return;
+    }
+    send_dhcp_response(w, &response, client_addr, "Sent DHCP ACK to client");
+}
+
+// Frees the client's own lease on 'ip', or quarantines it for 'quarantine_secs' if
+// non-zero; the caller logs with 'action'
+void free_client_lease(DHCPPacket *packet, uint32_t ip, int quarantine_secs, const char *action) {
+    pthread_mutex_lock(&lease_mutex);
+    int pos = lease_index_find_locked(ip_index, &ip, hash64(ip), 0);
+    if (pos >= 0) {
+        int index = ip_index->slots[pos] - 1;
+        if (ip_leases[index].state != 0 && ip_leases[index].state != 3 && memcmp(ip_leases[index].mac, packet->chaddr, 6) == 0) {
+            lease_quarantine_locked(index, quarantine_secs);
+            char client_ip[16];
+            char log_message[256];
+            format_ip(ip, client_ip);
+            snprintf(log_message, sizeof(log_message), "%s IP: %s", action, client_ip);
+            write_log(log_message);
+        }
+    }
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+void handle_dhcp_release(DHCPPacket *packet) {
+    free_client_lease(packet, packet->ciaddr, 0, "Released");
+}
+
+// The client found the address in use, so nobody gets it for a while (RFC 2131 4.3.3)
+void handle_dhcp_decline(Worker *w, DHCPPacket *packet) {
+    // A DECLINE carries the address in option 50, not ciaddr
+    uint32_t declined_ip = packet->ciaddr;
+    uint8_t length;
+    uint8_t *requested = find_dhcp_option(packet, 50, &length);
+    if (requested != NULL && length == 4) {
+        memcpy(&declined_ip, requested, 4);
+    }
+    free_client_lease(packet, declined_ip, w->config->conflict_quarantine_secs, "Declined");
+}
+
+void handle_dhcp_inform(Worker *w, DHCPPacket *packet, struct sockaddr_in *client_addr) {
+    const Pool *pool = find_pool(w->config, packet->ciaddr);
+    if (pool == NULL) {
+        pool = select_pool(w->config, packet);
+    }
+    if (pool == NULL) {
+        return;
+    }
+
+    DHCPPacket response;
+    memset(&response, 0, sizeof(DHCPPacket));
+
+    response.op = 2; // Boot Reply
+    response.htype = packet->htype;
+    response.hlen = packet->hlen;
+    response.xid = packet->xid;
+    response.flags = packet->flags;
+    response.giaddr = packet->giaddr;
+    response.ciaddr = packet->ciaddr;
+    response.siaddr = w->config->server_ip;
+    memcpy(response.chaddr, packet->chaddr, 16);
+
+    int option_offset = 0;
+    init_dhcp_options(response.options, &option_offset);
+    uint8_t dhcp_msg_type = 5; // DHCP ACK
+    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+
+    // Server id, subnet mask, router and DNS server; no lease time for INFORM
+    memcpy(&response.options[option_offset], pool->options, pool->options_len);
+    option_offset += pool->options_len;
+
+    response.options[option_offset++] = 255; // End option
+
+    send_dhcp_response(w, &response, client_addr, "Sent DHCP ACK (Inform) to client");
+}
+
+// RFC 4388 leasequery: what we know about the address in ciaddr, or about the client named by
+// its client identifier (option 61) or chaddr. Leases are kept by chaddr, so a client identifier
+// is only understood in its usual form, hardware type 1 and the MAC. Returns the reply type, or
+// 0 when the query names nothing; 'out' holds the lease for DHCPLEASEACTIVE.
+int leasequery_lookup(const Config *cfg, DHCPPacket *query, time_t now, IPLease *out) {
+    static const uint8_t no_mac[6];
+    if (query->ciaddr != 0) {
+        if (lease_find_by_ip(query->ciaddr, out) >= 0 && out->state == 2 && out->lease_start + out->lease_time > now) {
+            return 13; // DHCPLEASEACTIVE
+        }
+        return find_pool(cfg, query->ciaddr) != NULL ? 11 : 12; // DHCPLEASEUNASSIGNED, DHCPLEASEUNKNOWN
+    }
+
+    const uint8_t *mac;
+    uint8_t length = 0;
+    uint8_t *client_id = find_dhcp_option(query, 61, &length);
+    if (client_id != NULL) {
+        if (length != 7 || client_id[0] != 1) {
+            return 12;
+        }
+        mac = client_id + 1;
+    } else if (query->hlen == 6 && memcmp(query->chaddr, no_mac, 6) != 0) {
+        mac = query->chaddr;
+    } else {
+        return 0;
+    }
+    if (lease_find_by_mac(mac, out) >= 0 && out->state == 2 && out->lease_start + out->lease_time > now) {
+        return 13;
+    }
+    return 12;
+}
+
+// Leasequeries give away who has which address, so only listed requestors get answers
+int leasequery_requestor_allowed(const Config *cfg, uint32_t ip) {
+    for (int i = 0; i < cfg->num_leasequery_requestors; i++) {
+        if (cfg->leasequery_requestors[i] == ip) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Answer of 'type' to a leasequery; bulk answers (RFC 6926) also carry base-time and state.
+// Returns the length up to the end option.
+int build_leasequery_reply(const Config *cfg, DHCPPacket *query, int type, const IPLease *lease, time_t now,
+                           int bulk, DHCPPacket *reply) {
+    memset(reply, 0, sizeof(DHCPPacket));
+    reply->op = 2; // Boot Reply
+    reply->htype = query->htype;
+    reply->hlen = query->hlen;
+    reply->xid = query->xid;
+    reply->giaddr = query->giaddr;
+    reply->ciaddr = query->ciaddr;
+    memcpy(reply->chaddr, query->chaddr, 16);
+
+    int option_offset = 0;
+    init_dhcp_options(reply->options, &option_offset);
+    uint8_t dhcp_msg_type = type;
+    add_dhcp_option(reply->options, &option_offset, 53, 1, &dhcp_msg_type);
+    add_dhcp_option(reply->options, &option_offset, 54, 4, (uint8_t *)&cfg->server_ip);
+
+    if (type == 13) {
+        reply->ciaddr = lease->ip;
+        reply->htype = 1;
+        reply->hlen = 6;
+        memset(reply->chaddr, 0, sizeof(reply->chaddr));
+        memcpy(reply->chaddr, lease->mac, 6);
+        uint32_t remaining = htonl((uint32_t)(lease->lease_start + lease->lease_time - now));
+        uint32_t since = htonl((uint32_t)(now - lease->lease_start)); // granted or last renewed
+        add_dhcp_option(reply->options, &option_offset, 51, 4, (uint8_t *)&remaining);
+        add_dhcp_option(reply->options, &option_offset, 91, 4, (uint8_t *)&since); // client-last-transaction-time
+        if (bulk) {
+            uint32_t base_time = htonl((uint32_t)now);
+            uint8_t state = 2; // ACTIVE
+            add_dhcp_option(reply->options, &option_offset, 152, 4, (uint8_t *)&base_time);
+            add_dhcp_option(reply->options, &option_offset, 156, 1, &state);
+        }
+    }
+    reply->options[option_offset++] = 255; // End option
+    return offsetof(DHCPPacket, options) + option_offset;
+}
+
+// Answers go to the requestor's giaddr on the server port; a query without one is dropped
+// The reply goes to giaddr, so the query must come from there too: otherwise a forged
+// giaddr would turn us into a reflector aimed at someone else
+void handle_dhcp_leasequery(Worker *w, DHCPPacket *packet, struct sockaddr_in *client_addr) {
+    if (packet->giaddr == 0) {
+        write_log("Dropped DHCPLEASEQUERY without giaddr");
+        return;
+    }
+    if (client_addr->sin_addr.s_addr != packet->giaddr || !leasequery_requestor_allowed(w->config, packet->giaddr)) {
+        STAT_INC(leasequeries_refused);
+        char log_message[64];
+        snprintf(log_message, sizeof(log_message), "Refused DHCPLEASEQUERY from %s", inet_ntoa(client_addr->sin_addr));
+        write_log(log_message);
+        return;
+    }
+    STAT_INC(leasequeries);
+    time_t now = time(NULL);
+    IPLease lease;
+    int type = leasequery_lookup(w->config, packet, now, &lease);
+    if (type == 0) {
+        write_log("Dropped DHCPLEASEQUERY naming no address or client");
+        return;
+    }
+
+    DHCPPacket reply;
+    build_leasequery_reply(w->config, packet, type, &lease, now, 0, &reply);
+    struct sockaddr_in requestor;
+    memset(&requestor, 0, sizeof(requestor));
+    requestor.sin_family = AF_INET;
+    requestor.sin_addr.s_addr = packet->giaddr;
+    requestor.sin_port = htons(dhcp_server_port);
+    if (send_datagram(w, w->dhcp_sock, &reply, sizeof(DHCPPacket), &requestor) < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "Sendto failed: %s", strerror(errno));
+        write_log(error_msg);
+        return;
+    }
+    STAT_INC(replies_sent);
+    write_log(type == 13 ? "Sent DHCPLEASEACTIVE" : type == 11 ? "Sent DHCPLEASEUNASSIGNED" : "Sent DHCPLEASEUNKNOWN");
+}
+
+// Frees expired leases, and any lease whose pool or reservation was removed by a config reload
+void cleanup_expired_leases(const Config *cfg) {
+    time_t current_time = time(NULL);
+    pthread_mutex_lock(&lease_mutex);
+    for (int i = 0; i < num_leases; i++) {
+        if (ip_leases[i].state != 0 && find_pool(cfg, ip_leases[i].ip) == NULL &&
+            reservation_lookup(cfg, ip_leases[i].mac) != ip_leases[i].ip) {
+            lease_set_state_locked(i, 0);
+        } else if (ip_leases[i].state != 0 && (current_time - ip_leases[i].lease_start) > ip_leases[i].lease_time) {
+            int old_state = ip_leases[i].state;
+            lease_set_state_locked(i, 0); // Free
+            if (old_state >= 2) {
+                char ip[16];
+                char log_message[256];
+                format_ip(ip_leases[i].ip, ip);
+                snprintf(log_message, sizeof(log_message), old_state == 2 ? "Expired lease for IP: %s" : "Quarantine ended for IP: %s", ip);
+                write_log(log_message);
+            }
+        }
+    }
+    reclaim_retired();
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+void handle_remote_request(DHCPPacket *packet, struct sockaddr_in *client_addr) {
+    if (packet->giaddr != 0) {
+        // This is a relayed request
+        write_log("Handling relayed DHCP request");
+        // Set the gateway IP address in the response
+        packet->giaddr = packet->giaddr;
+    } else {
+        write_log("Handling direct DHCP request");
+    }
+}
+
+// The kernel counts filter rejects (and receive-buffer overflows) in the socket's sk_drops
+uint64_t kernel_filter_drops() {
+    uint64_t drops = 0;
+    for (int i = 0; i < num_workers; i++) {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (workers[i].io_backend == IO_BACKEND_PACKET) {
+            continue; // its UDP socket drops everything on purpose
+        }
+        if (getsockopt(workers[i].dhcp_sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+            drops += meminfo[SK_MEMINFO_DROPS];
+        }
+    }
+    return drops;
+}
+
+void print_dhcp_stats(FILE *out, const Config *cfg) {
+    int total_leases = 0;
+    int active_leases = 0;
+    int count = __atomic_load_n(&num_leases, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        IPLease lease;
+        lease_read(&ip_leases[i], &lease);
+        if (lease.state != 0) {
+            total_leases++;
+            if (lease.state == 2) {
+                active_leases++;
+            }
+        }
+    }
+    uint32_t pool_size = config_pool_size(cfg);
+
+    fprintf(out, "DHCP Server Statistics:\n");
+    fprintf(out, "Total leases: %d\n", total_leases);
+    fprintf(out, "Active leases: %d\n", active_leases);
+    fprintf(out, "Available leases: %d\n", (int)pool_size - total_leases);
+    fprintf(out, "Packets received: %llu\n", (unsigned long long)__atomic_load_n(&stats.packets_received, __ATOMIC_RELAXED));
+    fprintf(out, "Packets rejected in kernel: %llu\n", (unsigned long long)kernel_filter_drops());
+    fprintf(out, "Packets rejected in userspace: %llu\n", (unsigned long long)__atomic_load_n(&stats.packets_malformed, __ATOMIC_RELAXED));
+    fprintf(out, "Replies sent: %llu\n", (unsigned long long)__atomic_load_n(&stats.replies_sent, __ATOMIC_RELAXED));
+    fprintf(out, "Rate limited (client/relay/circuit): %llu/%llu/%llu, bucket evictions: %llu\n",
+           (unsigned long long)__atomic_load_n(&stats.rate_limited_mac, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.rate_limited_relay, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.rate_limited_circuit, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.rate_limit_evictions, __ATOMIC_RELAXED));
+
+    int depth[NUM_QUEUES] = { 0 };
+    for (int i = 0; i < num_workers; i++) {
+        for (int c = 0; c < NUM_QUEUES; c++) {
+            depth[c] += __atomic_load_n(&workers[i].queues[c].count, __ATOMIC_RELAXED);
+        }
+    }
+    fprintf(out, "Queue depth (renew/request/retrying discover/discover): %d/%d/%d/%d\n", depth[0], depth[1], depth[2], depth[3]);
+    fprintf(out, "Shed (deadline/overflow): %llu/%llu\n",
+           (unsigned long long)__atomic_load_n(&stats.shed_deadline, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.shed_overflow, __ATOMIC_RELAXED));
+    fprintf(out, "DNS queries (answered/nxdomain/rejected): %llu/%llu/%llu\n",
+           (unsigned long long)__atomic_load_n(&stats.dns_answered, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.dns_nxdomain, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.dns_rejected, __ATOMIC_RELAXED));
+    fprintf(out, "DNS forwarding (forwarded/cache hits/failed): %llu/%llu/%llu\n",
+           (unsigned long long)__atomic_load_n(&stats.dns_forwarded, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.dns_cache_hits, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.dns_upstream_failures, __ATOMIC_RELAXED));
+    pthread_rwlock_rdlock(&dns_lock);
+    uint32_t dns_names = dns.num_dynamic;
+    pthread_rwlock_unlock(&dns_lock);
+    fprintf(out, "DNS client names (registered/refused): %u/%llu\n", dns_names,
+           (unsigned long long)__atomic_load_n(&stats.dns_names_refused, __ATOMIC_RELAXED));
+    fprintf(out, "Conflict probes (sent/conflicts): %llu/%llu\n",
+           (unsigned long long)__atomic_load_n(&stats.conflict_probes, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.conflicts_found, __ATOMIC_RELAXED));
+    if (journal != NULL) {
+        fprintf(out, "Replication: %s, peer %s, journal %llu, acknowledged %llu, records sent %llu\n",
+               __atomic_load_n(&dhcp_serving, __ATOMIC_RELAXED) ? "active" : "standby",
+               __atomic_load_n(&replication_connected, __ATOMIC_RELAXED) ? "connected" : "not connected",
+               (unsigned long long)__atomic_load_n(&journal_head, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&replication_acked, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&stats.replication_records, __ATOMIC_RELAXED));
+    }
+    if (num_lb_servers > 1) {
+        fprintf(out, "Load balancing: server %d of %d, %d up, left to others %llu\n", lb_index, num_lb_servers,
+               __builtin_popcount(__atomic_load_n(&lb_alive, __ATOMIC_RELAXED)),
+               (unsigned long long)__atomic_load_n(&stats.lb_not_ours, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "Leasequeries (udp/bulk/refused): %llu/%llu/%llu\n",
+           (unsigned long long)__atomic_load_n(&stats.leasequeries, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.bulk_leasequeries, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.leasequeries_refused, __ATOMIC_RELAXED));
+    if (lease_feed != NULL) {
+        fprintf(out, "Lease feed: %llu events, socket consumers fell behind %llu times\n",
+               (unsigned long long)__atomic_load_n(&lease_feed->head, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&stats.feed_gaps, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "Tasks (run/stolen): %llu/%llu, log lines dropped: %llu\n",
+           (unsigned long long)__atomic_load_n(&stats.tasks_run, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.tasks_stolen, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.log_lines_dropped, __ATOMIC_RELAXED));
+
+    double lease_usage = (double)total_leases / pool_size;
+    if (lease_usage > LEASE_THRESHOLD) {
+        fprintf(out, "Warning: Lease usage is high (%.2f%%)\n", lease_usage * 100);
+    }
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK) failed");
+        return -1;
+    }
+    return 0;
+}
+
+int add_to_epoll(int epoll_fd, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Ticks once a second; lease expiry and stats run every N ticks
+int create_tick_timer() {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create failed");
+        return -1;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = 1;
+    spec.it_interval.tv_sec = 1;
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// SIGINT/SIGTERM/SIGHUP are blocked in every thread and read from here instead
+int create_signal_fd(sigset_t *mask) {
+    int fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd failed");
+    }
+    return fd;
+}
+
+void wake_all_workers() {
+    uint64_t one = 1;
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].wake_fd >= 0 && write(workers[i].wake_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+void stop_all_workers() {
+    server_running = 0;
+    wake_all_workers();
+}
+
+// Config snapshots are never modified once published. Each worker picks up the current one
+// at the top of every loop pass and records its generation; a replaced snapshot is freed
+// once every worker has recorded a later generation.
+void reclaim_configs() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < num_workers; i++) {
+        uint64_t generation = __atomic_load_n(&workers[i].config_generation, __ATOMIC_ACQUIRE);
+        if (generation < oldest) {
+            oldest = generation;
+        }
+    }
+
+    pthread_mutex_lock(&config_mutex);
+    Config **link = &retired_configs;
+    while (*link != NULL) {
+        Config *cfg = *link;
+        if (cfg->generation < oldest) {
+            *link = cfg->next;
+            free_config(cfg);
+        } else {
+            link = &cfg->next;
+        }
+    }
+    pthread_mutex_unlock(&config_mutex);
+}
+
+// Runs on the task pool so parsing never delays a worker
+void reload_config_task(Task *task) {
+    (void)task; // always reload_task
+    Config *cfg = load_config(0);
+    if (cfg == NULL) {
+        write_log("Config reload failed, keeping the running configuration");
+    } else {
+        pthread_mutex_lock(&config_mutex);
+        Config *old = current_config;
+        cfg->generation = old->generation + 1;
+        __atomic_store_n(&current_config, cfg, __ATOMIC_RELEASE);
+        old->next = retired_configs;
+        retired_configs = old;
+        pthread_mutex_unlock(&config_mutex);
+
+        wake_all_workers(); // so idle workers let go of the old snapshot
+        cleanup_expired_leases(cfg); // drops leases in pools that no longer exist
+
+        char log_message[256];
+        snprintf(log_message, sizeof(log_message), "Configuration reloaded (generation %llu, %d pools)",
+                 (unsigned long long)cfg->generation, cfg->num_pools);
+        write_log(log_message);
+    }
+    __atomic_store_n(&reload_running, 0, __ATOMIC_RELEASE);
+}
+
+// Returns -1 if a reload is already in progress or can't be started
+int request_config_reload() {
+    if (__atomic_exchange_n(&reload_running, 1, __ATOMIC_ACQ_REL)) {
+        return -1;
+    }
+    reload_task.run = reload_config_task;
+    submit_task(&reload_task, -1);
+    return 0;
+}
+
+int same_htypes(const Config *a, const Config *b) {
+    return a->num_allowed_htypes == b->num_allowed_htypes &&
+           memcmp(a->allowed_htypes, b->allowed_htypes, a->num_allowed_htypes * sizeof(int)) == 0;
+}
+
+// Called at the top of every loop pass, so nothing from an older snapshot is held past it
+void refresh_worker_config(Worker *w) {
+    Config *cfg = __atomic_load_n(&current_config, __ATOMIC_ACQUIRE);
+    if (cfg == w->config) {
+        return;
+    }
+    if (!same_htypes(cfg, w->config)) {
+        // The kernel filter encodes the htypes; replacing it is atomic for the socket
+        int fd = w->io_backend == IO_BACKEND_PACKET ? w->packet.fd : w->dhcp_sock;
+        if ((w->io_backend == IO_BACKEND_PACKET ? attach_packet_filter(fd, dhcp_server_port, cfg) : attach_dhcp_filter(fd, cfg)) < 0) {
+            write_log("Could not update the DHCP socket filter");
+        }
+    }
+    w->config = cfg;
+    __atomic_store_n(&w->config_generation, cfg->generation, __ATOMIC_RELEASE);
+}
+
+// Token buckets live in a fixed table of 4-way sets, so memory stays bounded no matter
+// how many MACs a spoofing tool invents: a new key simply evicts the stalest way of its set
+// Returns 1 if the key may send one more packet; rate is per second, 0 disables the limit
+int rate_limit_allow(uint64_t key, uint32_t rate, uint32_t burst, uint32_t now_ms) {
+    if (rate == 0) {
+        return 1;
+    }
+    key |= 1; // 0 marks an empty way
+    RateLimitSet *set = &rate_limiter[key & (RATE_LIMIT_SETS - 1)];
+    uint32_t capacity = burst * 1000;
+
+    while (__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE)) {
+        // Held for a handful of instructions only
+        while (__atomic_load_n(&set->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+
+    RateLimitEntry *entry = NULL;
+    RateLimitEntry *victim = &set->entries[0];
+    for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+        RateLimitEntry *e = &set->entries[i];
+        if (e->key == key) {
+            entry = e;
+            break;
+        }
+        if (e->key == 0 || (victim->key != 0 && (int32_t)(e->last_ms - victim->last_ms) < 0)) {
+            victim = e;
+        }
+    }
+
+    int allowed;
+    if (entry == NULL) {
+        if (victim->key != 0) {
+            STAT_INC(rate_limit_evictions);
+        }
+        victim->key = key;
+        victim->last_ms = now_ms;
+        victim->tokens = capacity - 1000;
+        allowed = 1;
+    } else {
+        // Tokens are kept in thousandths, so 'rate' per second is 'rate' per millisecond here
+        uint64_t tokens = entry->tokens + (uint64_t)(uint32_t)(now_ms - entry->last_ms) * rate;
+        entry->tokens = tokens > capacity ? capacity : (uint32_t)tokens;
+        entry->last_ms = now_ms;
+        allowed = entry->tokens >= 1000;
+        if (allowed) {
+            entry->tokens -= 1000;
+        }
+    }
+
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+    return allowed;
+}
+
+// Reports a key's current tokens (in thousandths) without spending any; 0 if untracked
+int rate_limit_peek(uint64_t key, uint32_t rate, uint32_t burst, uint32_t now_ms, uint32_t *tokens) {
+    key |= 1;
+    RateLimitSet *set = &rate_limiter[key & (RATE_LIMIT_SETS - 1)];
+    int found = 0;
+
+    while (__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&set->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+    for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+        RateLimitEntry *e = &set->entries[i];
+        if (e->key == key) {
+            uint64_t t = e->tokens + (uint64_t)(uint32_t)(now_ms - e->last_ms) * rate;
+            *tokens = t > burst * 1000 ? burst * 1000 : (uint32_t)t;
+            found = 1;
+            break;
+        }
+    }
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+    return found;
+}
+
+// DISCOVER/REQUEST must clear the client, relay (giaddr) and circuit-id (option 82.1) buckets
+int admit_client_request(const Config *cfg, DHCPPacket *packet) {
+    uint32_t now_ms = monotonic_ms();
+    uint8_t hlen = packet->hlen < sizeof(packet->chaddr) ? packet->hlen : sizeof(packet->chaddr);
+
+    if (!rate_limit_allow(hash_bytes(packet->chaddr, hlen, RATE_KEY_MAC), cfg->rate_limit_mac, cfg->rate_limit_burst, now_ms)) {
+        STAT_INC(rate_limited_mac);
+        return 0;
+    }
+    if (packet->giaddr != 0 &&
+        !rate_limit_allow(hash64(packet->giaddr ^ RATE_KEY_RELAY), cfg->rate_limit_relay, cfg->rate_limit_burst * 10, now_ms)) {
+        STAT_INC(rate_limited_relay);
+        return 0;
+    }
+
+    uint8_t agent_length = 0;
+    uint8_t *agent = find_dhcp_option(packet, 82, &agent_length);
+    for (int i = 0; agent != NULL && i + 2 <= agent_length && i + 2 + agent[i + 1] <= agent_length; i += 2 + agent[i + 1]) {
+        if (agent[i] == 1) { // Circuit ID sub-option
+            if (!rate_limit_allow(hash_bytes(&agent[i + 2], agent[i + 1], RATE_KEY_CIRCUIT), cfg->rate_limit_circuit, cfg->rate_limit_burst, now_ms)) {
+                STAT_INC(rate_limited_circuit);
+                return 0;
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// RENEW/REBIND, RELEASE and DECLINE keep working leases alive and are cheap, so they go
+// first; DISCOVERs go last, except those whose 'secs' shows the client has been retrying
+int classify_dhcp_packet(const Config *cfg, DHCPPacket *packet, uint8_t msg_type) {
+    uint8_t length;
+    switch (msg_type) {
+        case 3: // DHCP Request: renewing/rebinding clients fill ciaddr and send no server id
+            if (packet->ciaddr != 0 && find_dhcp_option(packet, 54, &length) == NULL) {
+                return QUEUE_RENEW;
+            }
+            return QUEUE_REQUEST;
+        case 4:
+        case 7:
+            return QUEUE_RENEW;
+        case 1:
+            return ntohs(packet->secs) >= cfg->discover_retry_secs ? QUEUE_DISCOVER_RETRY : QUEUE_DISCOVER;
+        default:
+            return QUEUE_REQUEST;
+    }
+}
+
+// RFC 3074 load balancing: a client's hash bucket decides which of the lb_servers answers it,
+// so servers with disjoint ranges share a segment without talking about each packet
+const uint8_t lb_hash_table[256] = {
+    251, 175, 119, 215,  81,  14,  79, 191, 103,  49, 181, 143, 186, 157,   0, 232,
+     31,  32,  55,  60, 152,  58,  17, 237, 174,  70, 160, 144, 220,  90,  57, 223,
+     59,   3,  18, 140, 111, 166, 203, 196, 134, 243, 124,  95, 222, 179, 197,  65,
+    180,  48,  36,  15, 107,  46, 233, 130, 165,  30, 123, 161, 209,  23,  97,  16,
+     40,  91, 219,  61, 100,  10, 210, 109, 250, 127,  22, 138,  29, 108, 244,  67,
+    207,   9, 178, 204,  74,  98, 126, 249, 167, 116,  34,  77, 193, 200, 121,   5,
+     20, 113,  71,  35, 128,  13, 182,  94,  25, 226, 227, 199,  75,  27,  41, 245,
+    230, 224,  43, 225, 177,  26, 155, 150, 212, 142, 218, 115, 241,  73,  88, 105,
+     39, 114,  62, 255, 192, 201, 145, 214, 168, 158, 221, 148, 154, 122,  12,  84,
+     82, 163,  44, 139, 228, 236, 205, 242, 217,  11, 187, 146, 159,  64,  86, 239,
+    195,  42, 106, 198, 118, 112, 184, 172,  87,   2, 173, 117, 176, 229, 247, 253,
+    137, 185,  99, 164, 102, 147,  45,  66, 231,  52, 141, 211, 194, 206, 246, 238,
+     56, 110,  78, 248,  63, 240, 189,  93,  92,  51,  53, 183,  19, 171,  72,  50,
+     33, 104, 101,  69,   8, 252,  83, 120,  76, 135,  85,  54, 202, 125, 188, 213,
+     96, 235, 136, 208, 162, 129, 190, 132, 156,  38,  47,   1,   7, 254,  24,   4,
+    216, 131,  89,  21,  28, 133,  37, 153, 149,  80, 170,  68,   6, 169, 234, 151
+};
+
+uint8_t lb_client_bucket(DHCPPacket *packet) {
+    uint8_t length = 0;
+    uint8_t *key = find_dhcp_option(packet, 61, &length); // Client Identifier, else chaddr
+    if (key == NULL || length == 0) {
+        key = packet->chaddr;
+        length = packet->hlen < sizeof(packet->chaddr) ? packet->hlen : sizeof(packet->chaddr);
+    }
+    uint8_t hash = length;
+    for (int i = length; i > 0;) {
+        hash = lb_hash_table[hash ^ key[--i]];
+    }
+    return hash;
+}
+
+// Each server owns an even run of buckets; the run of a server that has gone quiet passes to
+// the next live one, so only its clients move
+int lb_bucket_owner(uint8_t bucket) {
+    uint32_t alive = __atomic_load_n(&lb_alive, __ATOMIC_RELAXED);
+    int owner = bucket * num_lb_servers / 256;
+    for (int i = 0; i < num_lb_servers; i++) {
+        int server = (owner + i) % num_lb_servers;
+        if (alive & (1u << server)) {
+            return server;
+        }
+    }
+    return lb_index;
+}
+
+int lb_owns_packet(const Config *cfg, DHCPPacket *packet) {
+    if (num_lb_servers <= 1) {
+        return 1;
+    }
+    // Renewing or rebinding an address from our range: the lease is ours whatever the hash says
+    if (packet->ciaddr != 0 && find_pool(cfg, packet->ciaddr) != NULL) {
+        return 1;
+    }
+    uint8_t length = 0;
+    uint8_t *server_id = find_dhcp_option(packet, 54, &length);
+    if (server_id != NULL && length == 4) {
+        return memcmp(server_id, &cfg->server_ip, 4) == 0; // the client has picked a server
+    }
+    if (lb_bucket_owner(lb_client_bucket(packet)) == lb_index) {
+        return 1;
+    }
+    return cfg->lb_max_secs > 0 && ntohs(packet->secs) >= cfg->lb_max_secs;
+}
+
+// Validation, rate limiting and classification happen on receive; handlers run later from
+// the priority queues. rx_ns is the kernel receive time, so time spent in the socket buffer counts.
+void admit_dhcp_packet(Worker *w, DHCPPacket *packet, size_t length, struct sockaddr_in *client_addr, uint64_t rx_ns) {
+    STAT_INC(packets_received);
+    if (!__atomic_load_n(&dhcp_serving, __ATOMIC_RELAXED)) {
+        return; // a standby only listens to its peer
+    }
+
+    // Same checks as the kernel filter, for backends or kernels where it isn't attached
+    if (length < DHCP_MIN_LENGTH || packet->op != 1 || ntohl(*(uint32_t *)packet->options) != DHCP_MAGIC_COOKIE) {
+        STAT_INC(packets_malformed);
+        return;
+    }
+    if (length < sizeof(DHCPPacket)) {
+        memset((uint8_t *)packet + length, 0, sizeof(DHCPPacket) - length);
+    }
+
+    uint8_t msg_type = 0;
+    uint8_t option_length = 0;
+    uint8_t *option = find_dhcp_option(packet, 53, &option_length); // DHCP Message Type option
+    if (option != NULL && option_length == 1) {
+        msg_type = option[0];
+    }
+    // Leasequeries by address or client identifier carry no hardware address (RFC 4388 6.1)
+    if (!w->config->htype_allowed[packet->htype] && !(msg_type == 10 && packet->htype == 0 && packet->hlen == 0)) {
+        STAT_INC(packets_malformed);
+        return;
+    }
+
+    // Leasequeries are answered by every server, each for its own range
+    if (msg_type != 10 && !lb_owns_packet(w->config, packet)) {
+        STAT_INC(lb_not_ours);
+        return;
+    }
+    if ((msg_type == 1 || msg_type == 3) && !admit_client_request(w->config, packet)) {
+        return; // throttled: no reply, and nothing logged per packet
+    }
+
+    // A full queue overwrites its oldest entry: the newest packets are the ones still worth answering
+    PacketQueue *q = &w->queues[classify_dhcp_packet(w->config, packet, msg_type)];
+    if (q->count == PACKET_QUEUE_DEPTH) {
+        q->head = (q->head + 1) % PACKET_QUEUE_DEPTH;
+        q->count--;
+        STAT_INC(shed_overflow);
+    }
+    QueuedPacket *slot = &q->items[(q->head + q->count) % PACKET_QUEUE_DEPTH];
+    slot->packet = *packet;
+    slot->addr = *client_addr;
+    slot->msg_type = msg_type;
+    slot->rx_ns = rx_ns != 0 ? rx_ns : realtime_ns();
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+}
+
+void dispatch_dhcp_packet(Worker *w, QueuedPacket *queued) {
+    DHCPPacket *packet = &queued->packet;
+    struct sockaddr_in *client_addr = &queued->addr;
+    uint8_t msg_type = queued->msg_type;
+
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Received DHCP packet from %s", inet_ntoa(client_addr->sin_addr));
+    write_log(log_message);
+
+    snprintf(log_message, sizeof(log_message), "DHCP message type: %d", msg_type);
+    write_log(log_message);
+
+    switch (msg_type) {
+        case 1: // DHCP Discover
+            handle_dhcp_discover(w, packet, client_addr);
+            break;
+        case 3: // DHCP Request
+            handle_dhcp_request(w, packet, client_addr);
+            break;
+        case 7: // DHCP Release
+            handle_dhcp_release(packet);
+            break;
+        case 4: // DHCP Decline
+            handle_dhcp_decline(w, packet);
+            break;
+        case 8: // DHCP Inform
+            handle_dhcp_inform(w, packet, client_addr);
+            break;
+        case 10: // DHCPLEASEQUERY
+            handle_dhcp_leasequery(w, packet, client_addr);
+            break;
+        default:
+            snprintf(log_message, sizeof(log_message), "Unsupported DHCP message type: %d", msg_type);
+            write_log(log_message);
+    }
+}
+
+// Serves at most 'budget' packets, highest priority first, shedding any that waited past the deadline
+void process_dhcp_queues(Worker *w, int budget) {
+    uint64_t now = realtime_ns();
+    uint64_t deadline_ns = (uint64_t)w->config->queue_deadline_ms * 1000000ULL;
+
+    for (int c = 0; c < NUM_QUEUES && budget > 0; c++) {
+        PacketQueue *q = &w->queues[c];
+        while (q->count > 0 && budget > 0) {
+            QueuedPacket *queued = &q->items[q->head];
+            q->head = (q->head + 1) % PACKET_QUEUE_DEPTH;
+            __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+
+            if (now > queued->rx_ns && now - queued->rx_ns > deadline_ns) {
+                STAT_INC(shed_deadline); // the client has given up on this one already
+                continue;
+            }
+            dispatch_dhcp_packet(w, queued);
+            budget--;
+        }
+    }
+}
+
+int dhcp_queues_pending(Worker *w) {
+    for (int c = 0; c < NUM_QUEUES; c++) {
+        if (w->queues[c].count > 0) return 1;
+    }
+    return 0;
+}
+
+uint64_t cmsg_rx_timestamp(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+// Reads everything the socket holds (bounded) into the queues; processing is done separately
+void on_dhcp_readable(Worker *w) {
+    DHCPPacket packets[RECV_BATCH];
+    struct sockaddr_in addrs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    uint8_t controls[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+
+    for (int round = 0; round < RECV_ROUNDS; round++) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < RECV_BATCH; i++) {
+            iovs[i].iov_base = &packets[i];
+            iovs[i].iov_len = sizeof(DHCPPacket);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+
+        int received = recvmmsg(w->dhcp_sock, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                write_log("Recvmmsg failed");
+            }
+            return;
+        }
+
+        for (int i = 0; i < received; i++) {
+            admit_dhcp_packet(w, &packets[i], msgs[i].msg_len, &addrs[i], cmsg_rx_timestamp(&msgs[i].msg_hdr));
+        }
+        if (received < RECV_BATCH) {
+            return;
+        }
+    }
+}
+
+// Copies the question name at 'pos' into 'wire' in lowercase; returns the offset just
+// past it, or -1. Questions never need compression pointers, so they are refused.
+int dns_read_question_name(const uint8_t *msg, size_t len, size_t pos, uint8_t *wire, int *wire_len) {
+    int out = 0;
+    while (pos < len) {
+        uint8_t label_len = msg[pos++];
+        if (label_len > 63 || pos + label_len > len || out + 1 + label_len + 1 > DNS_MAX_WIRE_NAME) {
+            return -1;
+        }
+        wire[out++] = label_len;
+        if (label_len == 0) {
+            *wire_len = out;
+            return pos;
+        }
+        for (int i = 0; i < label_len; i++) {
+            wire[out++] = tolower(msg[pos++]);
+        }
+    }
+    return -1;
+}
+
+// Parses d.c.b.a.in-addr.arpa into an address in network byte order
+int dns_reverse_name(const uint8_t *wire, int len, uint32_t *ip) {
+    static const uint8_t suffix[] = "\x07in-addr\x04" "arpa";
+    uint8_t octets[4];
+    int pos = 0;
+    for (int i = 3; i >= 0; i--) {
+        int label_len = wire[pos++];
+        int value = 0;
+        if (label_len < 1 || label_len > 3) {
+            return 0;
+        }
+        for (int j = 0; j < label_len; j++) {
+            if (!isdigit(wire[pos])) {
+                return 0;
+            }
+            value = value * 10 + wire[pos++] - '0';
+        }
+        if (value > 255) {
+            return 0;
+        }
+        octets[i] = value;
+    }
+    if (len - pos != (int)sizeof(suffix) || memcmp(wire + pos, suffix, sizeof(suffix)) != 0) {
+        return 0;
+    }
+    memcpy(ip, octets, 4);
+    return 1;
+}
+
+// Appends an answer whose owner is the question name (a pointer to offset 12)
+size_t dns_put_answer(uint8_t *reply, size_t pos, uint16_t type, uint32_t ttl, const void *rdata, uint16_t rdlength) {
+    uint8_t *p = reply + pos;
+    p[0] = 0xc0;
+    p[1] = DNS_HEADER_SIZE;
+    p[2] = type >> 8;
+    p[3] = type & 0xff;
+    p[4] = 0;
+    p[5] = DNS_CLASS_IN;
+    p[6] = ttl >> 24;
+    p[7] = ttl >> 16;
+    p[8] = ttl >> 8;
+    p[9] = ttl;
+    p[10] = rdlength >> 8;
+    p[11] = rdlength & 0xff;
+    memcpy(p + 12, rdata, rdlength);
+    return pos + 12 + rdlength;
+}
+
+// Skips a possibly compressed name in a response; returns the offset after it, or -1
+int dns_skip_name(const uint8_t *msg, size_t len, size_t pos) {
+    while (pos < len) {
+        uint8_t label_len = msg[pos];
+        if ((label_len & 0xc0) == 0xc0) {
+            return pos + 2 <= len ? (int)pos + 2 : -1;
+        }
+        if (label_len > 63) {
+            return -1;
+        }
+        pos += 1 + label_len;
+        if (label_len == 0) {
+            return pos <= len ? (int)pos : -1;
+        }
+    }
+    return -1;
+}
+
+// Is 'name' equal to or below 'domain' (both wire format)?
+int dns_name_in_domain(const uint8_t *name, int len, const uint8_t *domain, int domain_len) {
+    for (int pos = 0; pos < len; pos += 1 + name[pos]) {
+        if (len - pos == domain_len && memcmp(name + pos, domain, domain_len) == 0) {
+            return 1;
+        }
+        if (name[pos] == 0) break;
+    }
+    return 0;
+}
+
+uint64_t dns_cache_key(const uint8_t *name, int name_len, uint16_t qtype) {
+    return hash_bytes(name, name_len, qtype) | 1; // 0 marks an empty way
+}
+
+// Copies a live cached answer into 'reply' with the client's ID and question and with every
+// TTL aged by the time it has spent in the cache; returns its length, 0 on a miss
+size_t dns_cache_lookup(const uint8_t *name, int name_len, uint16_t qtype, const uint8_t *query, size_t question_end, uint8_t *reply) {
+    uint64_t key = dns_cache_key(name, name_len, qtype);
+    DNSCacheSet *set = &dns_cache[key & (DNS_CACHE_SETS - 1)];
+    uint32_t now = monotonic_ms() / 1000;
+    size_t len = 0;
+
+    while (__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE)) {
+        // Held for one copy of at most DNS_MAX_UDP bytes
+        while (__atomic_load_n(&set->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+    for (int i = 0; i < DNS_CACHE_WAYS; i++) {
+        DNSCacheEntry *e = &set->entries[i];
+        if (e->key == key && e->qtype == qtype && e->name_len == name_len &&
+            memcmp(e->name, name, name_len) == 0 && (int32_t)(e->expires - now) > 0) {
+            len = e->len;
+            memcpy(reply, e->response, len);
+            uint32_t age = now - e->stored;
+            for (int t = 0; t < e->num_ttls; t++) {
+                uint8_t *p = reply + e->ttl_offsets[t];
+                uint32_t ttl = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+                ttl = ttl > age ? ttl - age : 0;
+                p[0] = ttl >> 24;
+                p[1] = ttl >> 16;
+                p[2] = ttl >> 8;
+                p[3] = ttl;
+            }
+            break;
+        }
+    }
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+
+    if (len > 0) {
+        memcpy(reply, query, 2);
+        memcpy(reply + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, question_end - DNS_HEADER_SIZE);
+    }
+    return len;
+}
+
+// Caches an upstream response for the lowest TTL in its answer section, or, for NXDOMAIN
+// and empty answers, for the SOA's negative TTL (RFC 2308). Failures, truncated responses
+// and negative answers without an SOA aren't cached.
+void dns_cache_store(const uint8_t *msg, size_t len) {
+    int rcode = msg[3] & 0x0f;
+    if ((msg[2] & 0x02) || (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN)) {
+        return;
+    }
+    uint8_t name[DNS_MAX_WIRE_NAME];
+    int name_len;
+    int pos = dns_read_question_name(msg, len, DNS_HEADER_SIZE, name, &name_len);
+    if (pos < 0 || (size_t)pos + 4 > len) {
+        return;
+    }
+    uint16_t qtype = (msg[pos] << 8) | msg[pos + 1];
+    pos += 4;
+
+    int ancount = (msg[6] << 8) | msg[7];
+    int nscount = (msg[8] << 8) | msg[9];
+    int arcount = (msg[10] << 8) | msg[11];
+    int negative = rcode == DNS_RCODE_NXDOMAIN || ancount == 0;
+    uint32_t ttl = negative ? 0 : DNS_CACHE_MAX_TTL;
+    uint16_t offsets[DNS_CACHE_MAX_TTLS];
+    int num_ttls = 0;
+    for (int i = 0; i < ancount + nscount + arcount; i++) {
+        pos = dns_skip_name(msg, len, pos);
+        if (pos < 0 || (size_t)pos + 10 > len || num_ttls == DNS_CACHE_MAX_TTLS) {
+            return;
+        }
+        uint16_t type = (msg[pos] << 8) | msg[pos + 1];
+        uint32_t rr_ttl = ((uint32_t)msg[pos + 4] << 24) | (msg[pos + 5] << 16) | (msg[pos + 6] << 8) | msg[pos + 7];
+        uint16_t rdlength = (msg[pos + 8] << 8) | msg[pos + 9];
+        offsets[num_ttls++] = pos + 4;
+        pos += 10 + rdlength;
+        if ((size_t)pos > len) {
+            return;
+        }
+        if (!negative && i < ancount && rr_ttl < ttl) {
+            ttl = rr_ttl;
+        } else if (negative && i >= ancount && i < ancount + nscount && type == DNS_TYPE_SOA && rdlength >= 20) {
+            // The SOA's MINIMUM is the last field of its rdata
+            const uint8_t *m = msg + pos - 4;
+            uint32_t minimum = ((uint32_t)m[0] << 24) | (m[1] << 16) | (m[2] << 8) | m[3];
+            ttl = minimum < rr_ttl ? minimum : rr_ttl;
+            if (ttl > DNS_NEGATIVE_MAX_TTL) ttl = DNS_NEGATIVE_MAX_TTL;
+        }
+    }
+    if (ttl == 0) {
+        return;
+    }
+
+    uint64_t key = dns_cache_key(name, name_len, qtype);
+    DNSCacheSet *set = &dns_cache[key & (DNS_CACHE_SETS - 1)];
+    uint32_t now = monotonic_ms() / 1000;
+    while (__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&set->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+    // Replace the same question, else an empty or expired way, else the one expiring first
+    DNSCacheEntry *victim = &set->entries[0];
+    for (int i = 0; i < DNS_CACHE_WAYS; i++) {
+        DNSCacheEntry *e = &set->entries[i];
+        if (e->key == key && e->qtype == qtype && e->name_len == name_len && memcmp(e->name, name, name_len) == 0) {
+            victim = e;
+            break;
+        }
+        if (e->key == 0 || (int32_t)(e->expires - now) <= 0) {
+            victim = e;
+        } else if (victim->key != 0 && (int32_t)(victim->expires - now) > 0 && (int32_t)(e->expires - victim->expires) < 0) {
+            victim = e;
+        }
+    }
+    victim->key = key;
+    victim->qtype = qtype;
+    victim->name_len = name_len;
+    memcpy(victim->name, name, name_len);
+    victim->stored = now;
+    victim->expires = now + ttl;
+    victim->len = len;
+    memcpy(victim->response, msg, len);
+    victim->num_ttls = num_ttls;
+    memcpy(victim->ttl_offsets, offsets, num_ttls * sizeof(uint16_t));
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+}
+
+// Called with dns_pending_mutex held
+uint16_t dns_random_id() {
+    for (;;) {
+        uint16_t id = (uint16_t)hash64(dns_id_seed + ++dns_id_counter);
+        if (dns_pending_by_id[id] == 0) {
+            return id;
+        }
+    }
+}
+
+// Sends a query for a name that is neither ours nor cached to an upstream resolver. A
+// client asking for something already in flight just waits for that answer, so a
+// popular name costs one upstream query however many clients want it.
+void dns_forward_query(Worker *w, const uint8_t *query, size_t len, struct sockaddr_in *client_addr) {
+    const Config *cfg = w->config;
+    uint8_t name[DNS_MAX_WIRE_NAME];
+    int name_len;
+    int end = dns_read_question_name(query, len, DNS_HEADER_SIZE, name, &name_len);
+    if (end < 0 || (size_t)end + 4 > len) {
+        return;
+    }
+    uint16_t qtype = (query[end] << 8) | query[end + 1];
+    uint64_t key = dns_cache_key(name, name_len, qtype);
+    DNSWaiter waiter;
+    waiter.id = (query[0] << 8) | query[1];
+    waiter.addr = *client_addr;
+
+    pthread_mutex_lock(&dns_pending_mutex);
+    // The table is small and only consulted on cache misses, so a scan of the keys will do
+    DNSPending *pending = NULL;
+    DNSPending *free_slot = NULL;
+    for (int i = 0; i < DNS_MAX_PENDING; i++) {
+        DNSPending *p = &dns_pending[i];
+        if (!p->in_use) {
+            if (free_slot == NULL) free_slot = p;
+        } else if (p->key == key && p->qtype == qtype && p->name_len == name_len && memcmp(p->query + DNS_HEADER_SIZE, name, name_len) == 0) {
+            pending = p;
+            break;
+        }
+    }
+    if (pending != NULL) {
+        if (pending->num_waiters < DNS_MAX_WAITERS) {
+            pending->waiters[pending->num_waiters++] = waiter;
+        }
+        pthread_mutex_unlock(&dns_pending_mutex);
+        return; // the client retries if it didn't fit
+    }
+    if (free_slot == NULL || cfg->num_upstreams == 0) {
+        pthread_mutex_unlock(&dns_pending_mutex);
+        write_log("DNS forwarding table full, dropping query");
+        return;
+    }
+
+    // Our own query: fresh random ID, recursion desired, the question in lowercase
+    pending = free_slot;
+    pending->in_use = 1;
+    pending->key = key;
+    pending->qtype = qtype;
+    pending->name_len = name_len;
+    pending->upstream_id = dns_random_id();
+    pending->upstream_index = dns_next_upstream++ % cfg->num_upstreams;
+    pending->upstream = cfg->upstreams[pending->upstream_index];
+    pending->tries = 1;
+    pending->sent_ms = monotonic_ms();
+    pending->num_waiters = 1;
+    pending->waiters[0] = waiter;
+    memset(pending->query, 0, DNS_HEADER_SIZE);
+    pending->query[0] = pending->upstream_id >> 8;
+    pending->query[1] = pending->upstream_id & 0xff;
+    pending->query[2] = 0x01; // RD
+    pending->query[5] = 1;
+    memcpy(pending->query + DNS_HEADER_SIZE, name, name_len);
+    memcpy(pending->query + DNS_HEADER_SIZE + name_len, query + end, 4);
+    pending->query_len = DNS_HEADER_SIZE + name_len + 4;
+    dns_pending_by_id[pending->upstream_id] = pending - dns_pending + 1;
+
+    uint8_t upstream_query[DNS_MAX_UDP];
+    size_t upstream_len = pending->query_len;
+    struct sockaddr_in upstream = pending->upstream;
+    memcpy(upstream_query, pending->query, upstream_len);
+    pthread_mutex_unlock(&dns_pending_mutex);
+
+    STAT_INC(dns_forwarded);
+    if (sendto(w->upstream_sock, upstream_query, upstream_len, 0, (struct sockaddr *)&upstream, sizeof(upstream)) < 0) {
+        perror("DNS upstream sendto failed"); // retried from the timer
+    }
+}
+
+// Frees a pending query and hands back its waiters; called with dns_pending_mutex held
+int dns_release_pending_locked(DNSPending *pending, DNSWaiter *waiters) {
+    int count = pending->num_waiters;
+    memcpy(waiters, pending->waiters, count * sizeof(DNSWaiter));
+    dns_pending_by_id[pending->upstream_id] = 0;
+    pending->in_use = 0;
+    return count;
+}
+
+void dns_answer_waiters(Worker *w, uint8_t *reply, size_t len, const DNSWaiter *waiters, int count) {
+    for (int i = 0; i < count; i++) {
+        reply[0] = waiters[i].id >> 8;
+        reply[1] = waiters[i].id & 0xff;
+        struct sockaddr_in addr = waiters[i].addr;
+        if (send_datagram(w, w->dns_sock, reply, len, &addr) < 0) {
+            perror("DNS sendto failed");
+        }
+    }
+}
+
+void on_upstream_readable(Worker *w) {
+    for (int n = 0; n < RECV_BATCH; n++) {
+        uint8_t reply[DNS_MAX_UDP];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t received = recvfrom(w->upstream_sock, reply, sizeof(reply), MSG_TRUNC, (struct sockaddr *)&from, &from_len);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                write_log("DNS upstream recvfrom failed");
+            }
+            return;
+        }
+        if (received < DNS_HEADER_SIZE || received > DNS_MAX_UDP || !(reply[2] & 0x80)) {
+            continue;
+        }
+
+        // Only the resolver we asked, answering our ID and our question, is believed
+        uint8_t name[DNS_MAX_WIRE_NAME];
+        int name_len;
+        int end = dns_read_question_name(reply, received, DNS_HEADER_SIZE, name, &name_len);
+        DNSWaiter waiters[DNS_MAX_WAITERS];
+        int count = -1;
+        pthread_mutex_lock(&dns_pending_mutex);
+        uint16_t slot = dns_pending_by_id[(reply[0] << 8) | reply[1]];
+        if (slot != 0 && end >= 0 && end + 4 <= received) {
+            DNSPending *pending = &dns_pending[slot - 1];
+            if (pending->upstream.sin_addr.s_addr == from.sin_addr.s_addr && pending->upstream.sin_port == from.sin_port &&
+                pending->name_len == name_len && memcmp(pending->query + DNS_HEADER_SIZE, name, name_len) == 0 &&
+                memcmp(pending->query + DNS_HEADER_SIZE + name_len, reply + end, 4) == 0) {
+                count = dns_release_pending_locked(pending, waiters);
+            }
+        }
+        pthread_mutex_unlock(&dns_pending_mutex);
+        if (count < 0) {
+            continue;
+        }
+
+        dns_cache_store(reply, received);
+        dns_answer_waiters(w, reply, received, waiters, count);
+    }
+}
+
+// Worker 0's timer: retries a silent upstream on the next resolver, and answers SERVFAIL
+// once every try is used up
+void dns_expire_pending(Worker *w) {
+    const Config *cfg = w->config;
+    uint32_t now = monotonic_ms();
+    for (int i = 0; i < DNS_MAX_PENDING; i++) {
+        uint8_t message[DNS_MAX_UDP];
+        size_t len = 0;
+        struct sockaddr_in upstream;
+        DNSWaiter waiters[DNS_MAX_WAITERS];
+        int count = -1;
+
+        pthread_mutex_lock(&dns_pending_mutex);
+        DNSPending *pending = &dns_pending[i];
+        if (pending->in_use && now - pending->sent_ms >= DNS_UPSTREAM_TIMEOUT_MS) {
+            len = pending->query_len;
+            memcpy(message, pending->query, len);
+            if (pending->tries < DNS_UPSTREAM_TRIES && cfg->num_upstreams > 0) {
+                pending->tries++;
+                pending->sent_ms = now;
+                pending->upstream_index = (pending->upstream_index + 1) % cfg->num_upstreams;
+                pending->upstream = cfg->upstreams[pending->upstream_index];
+                upstream = pending->upstream;
+            } else {
+                count = dns_release_pending_locked(pending, waiters);
+            }
+        }
+        pthread_mutex_unlock(&dns_pending_mutex);
+
+        if (len == 0) {
+            continue;
+        }
+        if (count < 0) {
+            if (sendto(w->upstream_sock, message, len, 0, (struct sockaddr *)&upstream, sizeof(upstream)) < 0) {
+                perror("DNS upstream sendto failed");
+            }
+            continue;
+        }
+        STAT_INC(dns_upstream_failures);
+        message[2] = 0x81; // QR, RD
+        message[3] = 0x80 | DNS_RCODE_SERVFAIL; // RA
+        dns_answer_waiters(w, message, len, waiters, count);
+    }
+}
+
+// Answers A queries from the name table and PTR queries for in-addr.arpa from the lease
+// table. Builds the reply in 'reply' (DNS_MAX_UDP bytes); returns its length, 0 to drop.
+// Names outside dns_domain and our pools come from the cache, or set '*forward' when
+// they have to be asked upstream.
+size_t dns_answer_query(const Config *cfg, const uint8_t *query, size_t len, uint8_t *reply, int *forward) {
+    if (len < DNS_HEADER_SIZE || (query[2] & 0x80)) {
+        return 0; // runt or a response
+    }
+    int opcode = (query[2] >> 3) & 0x0f;
+    int qdcount = (query[4] << 8) | query[5];
+
+    memset(reply, 0, DNS_HEADER_SIZE);
+    reply[0] = query[0];
+    reply[1] = query[1];
+    reply[2] = 0x80 | (query[2] & 0x79); // QR, opcode and RD copied
+    if (opcode != 0) {
+        reply[3] = DNS_RCODE_NOTIMP;
+        STAT_INC(dns_rejected);
+        return DNS_HEADER_SIZE;
+    }
+
+    uint8_t name[DNS_MAX_WIRE_NAME];
+    int name_len = 0;
+    int end = qdcount == 1 ? dns_read_question_name(query, len, DNS_HEADER_SIZE, name, &name_len) : -1;
+    if (end < 0 || (size_t)end + 4 > len) {
+        reply[3] = DNS_RCODE_FORMERR;
+        STAT_INC(dns_rejected);
+        return DNS_HEADER_SIZE;
+    }
+    uint16_t qtype = (query[end] << 8) | query[end + 1];
+    uint16_t qclass = (query[end + 2] << 8) | query[end + 3];
+
+    // Echo the question as it was asked, case included
+    size_t pos = end + 4;
+    memcpy(reply + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, pos - DNS_HEADER_SIZE);
+    reply[5] = 1;
+    if (qclass != DNS_CLASS_IN && qclass != DNS_CLASS_ANY) {
+        reply[3] = DNS_RCODE_REFUSED;
+        STAT_INC(dns_rejected);
+        return pos;
+    }
+    reply[2] |= 0x04; // AA
+
+    int answers = 0;
+    int exists = 0;
+    int authoritative;
+    uint32_t ip;
+    if (dns_reverse_name(name, name_len, &ip)) {
+        authoritative = find_pool(cfg, ip) != NULL;
+        IPLease lease;
+        int index = lease_find_by_ip(ip, &lease);
+        exists = index >= 0 && lease.state == 2;
+        if (exists && (qtype == DNS_TYPE_PTR || qtype == DNS_TYPE_ANY)) {
+            // The client's registered name, else dhcp-a-b-c-d.<dns_domain>
+            uint8_t target[DNS_MAX_WIRE_NAME];
+            int target_len = dns_lease_name(index, target);
+            if (target_len == 0) {
+                const uint8_t *octets = (const uint8_t *)&ip;
+                int label_len = snprintf((char *)target + 1, sizeof(target) - 1, "dhcp-%u-%u-%u-%u", octets[0], octets[1], octets[2], octets[3]);
+                target[0] = label_len;
+                target_len = 1 + label_len;
+                if (target_len + cfg->dns_domain_len <= DNS_MAX_WIRE_NAME) {
+                    memcpy(target + target_len, cfg->dns_domain, cfg->dns_domain_len);
+                    target_len += cfg->dns_domain_len;
+                } else {
+                    target_len = 0;
+                }
+            }
+            if (target_len > 0) {
+                pos = dns_put_answer(reply, pos, DNS_TYPE_PTR, cfg->dns_ttl, target, target_len);
+                answers++;
+            }
+        }
+    } else {
+        uint32_t addrs[DNS_MAX_ANSWERS];
+        int count = lookup_dns_wire(name, name_len, addrs, DNS_MAX_ANSWERS);
+        exists = count > 0;
+        authoritative = dns_name_in_domain(name, name_len, cfg->dns_domain, cfg->dns_domain_len);
+        if (qtype == DNS_TYPE_A || qtype == DNS_TYPE_ANY) {
+            for (int i = 0; i < count; i++) {
+                if (i == DNS_MAX_ANSWERS || pos + DNS_A_ANSWER_SIZE > DNS_MAX_UDP) {
+                    reply[2] |= 0x02; // TC: the client can retry over TCP for the rest
+                    break;
+                }
+                pos = dns_put_answer(reply, pos, DNS_TYPE_A, cfg->dns_ttl, &addrs[i], 4);
+                answers++;
+            }
+        }
+    }
+
+    if (!exists && !authoritative && cfg->num_upstreams > 0) {
+        size_t cached = dns_cache_lookup(name, name_len, qtype, query, end + 4, reply);
+        if (cached > 0) {
+            STAT_INC(dns_cache_hits);
+            return cached;
+        }
+        *forward = 1;
+        return 0;
+    }
+
+    reply[6] = answers >> 8;
+    reply[7] = answers & 0xff;
+    if (!exists) {
+        reply[3] = DNS_RCODE_NXDOMAIN;
+        STAT_INC(dns_nxdomain);
+    } else {
+        STAT_INC(dns_answered);
+    }
+    return pos;
+}
+
+// client/test.c sends a raw DNSQuery: a NUL-terminated name padded with zeros. A wire
+// query of the same size can't pass for one, as QDCOUNT puts 0x00 0x01 at offsets 4-5.
+int is_raw_dns_query(const uint8_t *data, size_t len) {
+    if (len != sizeof(DNSQuery)) {
+        return 0;
+    }
+    const uint8_t *nul = memchr(data, 0, MAX_DOMAIN_NAME_LENGTH);
+    if (nul == NULL || nul == data) {
+        return 0;
+    }
+    for (const uint8_t *p = nul; p < data + MAX_DOMAIN_NAME_LENGTH; p++) {
+        if (*p != 0) return 0;
+    }
+    return 1;
+}
+
+// Builds the reply to one datagram on the DNS port; returns its length, 0 for none yet
+size_t handle_dns_datagram(Worker *w, const void *data, size_t len, uint8_t *reply, struct sockaddr_in *client_addr) {
+    if (!is_raw_dns_query(data, len)) {
+        int forward = 0;
+        size_t length = dns_answer_query(w->config, data, len, reply, &forward);
+        if (forward) {
+            dns_forward_query(w, data, len, client_addr);
+        }
+        return length;
+    }
+
+    DNSQuery query;
+    memcpy(&query, data, sizeof(query));
+    uint32_t addr;
+    memset(query.ip, 0, sizeof(query.ip));
+    if (lookup_dns(query.domain, &addr, 1) > 0) {
+        format_ip(addr, query.ip); // this format only has room for one address
+    }
+    memcpy(reply, &query, sizeof(query));
+    return sizeof(query);
+}
+
+void on_dns_readable(Worker *w) {
+    uint8_t queries[RECV_BATCH][DNS_MAX_UDP];
+    uint8_t replies[RECV_BATCH][DNS_MAX_UDP];
+    struct sockaddr_in addrs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct iovec reply_iovs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct mmsghdr reply_msgs[RECV_BATCH];
+
+    for (int round = 0; round < RECV_ROUNDS; round++) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < RECV_BATCH; i++) {
+            iovs[i].iov_base = queries[i];
+            iovs[i].iov_len = DNS_MAX_UDP;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        int received = recvmmsg(w->dns_sock, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                write_log("DNS recvmmsg failed");
+            }
+            return;
+        }
+
+        // Answer the whole batch, then send the replies with one sendmmsg
+        int count = 0;
+        memset(reply_msgs, 0, sizeof(reply_msgs));
+        for (int i = 0; i < received; i++) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue; // larger than any query we answer
+            }
+            size_t length = handle_dns_datagram(w, queries[i], msgs[i].msg_len, replies[count], &addrs[i]);
+            if (length == 0) {
+                continue;
+            }
+            reply_iovs[count].iov_base = replies[count];
+            reply_iovs[count].iov_len = length;
+            reply_msgs[count].msg_hdr.msg_iov = &reply_iovs[count];
+            reply_msgs[count].msg_hdr.msg_iovlen = 1;
+            reply_msgs[count].msg_hdr.msg_name = &addrs[i];
+            reply_msgs[count].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            count++;
+        }
+        for (int sent = 0; sent < count;) {
+            int n = sendmmsg(w->dns_sock, reply_msgs + sent, count - sent, MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno != EINTR) {
+                    perror("DNS sendmmsg failed");
+                    break;
+                }
+                continue;
+            }
+            sent += n;
+        }
+        if (received < RECV_BATCH) {
+            return;
+        }
+    }
+}
+
+// Switches a worker back to readiness-based recvmmsg/sendto when the ring can't be used
+int fall_back_to_sockets(Worker *w) {
+    if (w->io_backend == IO_BACKEND_URING) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->ring.event_fd, NULL);
+        uring_close(&w->ring);
+    }
+    w->io_backend = IO_BACKEND_SOCKET;
+    if (add_to_epoll(w->epoll_fd, w->dhcp_sock) < 0 || add_to_epoll(w->epoll_fd, w->dns_sock) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void on_uring_completion(Worker *w) {
+    uint64_t value;
+    if (read(w->ring.event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
+    }
+
+    IoUring *r = &w->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int rearm[URING_GROUPS] = { 0, 0 };
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        uint64_t op = cqe->user_data >> 32;
+        int index = (int)(cqe->user_data & 0xffffffffu);
+
+        if (op == URING_OP_SEND) {
+            if (cqe->res < 0) {
+                char error_msg[256];
+                snprintf(error_msg, sizeof(error_msg), "io_uring sendmsg failed: %s", strerror(-cqe->res));
+                write_log(error_msg);
+            }
+            r->send_slots[index].next_free = r->free_send_slot;
+            r->free_send_slot = index;
+        } else if (op == URING_OP_RECV) {
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // Kernel has buffer rings but no multishot recvmsg (< 6.0)
+                __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+                write_log("io_uring multishot receive unsupported, falling back to sockets");
+                fall_back_to_sockets(w);
+                return;
+            }
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                uint8_t *buffer = r->buffers[index] + (size_t)bid * URING_BUFFER_SIZE;
+                struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+                uint8_t *payload = buffer + sizeof(*out) + r->recv_msg[index].msg_namelen + r->recv_msg[index].msg_controllen;
+                struct sockaddr_in client_addr;
+                memcpy(&client_addr, buffer + sizeof(*out), sizeof(client_addr));
+
+                if (!(out->flags & MSG_TRUNC)) {
+                    if (index == 0) {
+                        DHCPPacket packet;
+                        size_t length = out->payloadlen < sizeof(packet) ? out->payloadlen : sizeof(packet);
+                        memcpy(&packet, payload, length);
+
+                        struct msghdr control;
+                        memset(&control, 0, sizeof(control));
+                        control.msg_control = buffer + sizeof(*out) + r->recv_msg[index].msg_namelen;
+                        control.msg_controllen = out->controllen;
+                        admit_dhcp_packet(w, &packet, length, &client_addr, cmsg_rx_timestamp(&control));
+                    } else {
+                        uint8_t reply[DNS_MAX_UDP];
+                        size_t length = handle_dns_datagram(w, payload, out->payloadlen, reply, &client_addr);
+                        if (length > 0 && send_datagram(w, w->dns_sock, reply, length, &client_addr) < 0) {
+                            perror("DNS sendto failed");
+                        }
+                    }
+                }
+                uring_recycle_buffer(r, index, bid);
+            }
+            // -ENOBUFS or a finished multishot: arm it again once the buffers are back
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                rearm[index] = 1;
+            }
+        }
+
+        head++;
+        tail = head == tail ? __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) : tail;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    if (rearm[0]) uring_arm_recv(r, w->dhcp_sock, 0);
+    if (rearm[1]) uring_arm_recv(r, w->dns_sock, 1);
+    uring_submit(r);
+}
+
+void on_probe_readable(Worker *w) {
+    for (int n = 0; n < RECV_BATCH; n++) {
+        uint8_t buffer[256];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t received = recvfrom(w->probe_sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                write_log("ICMP probe recvfrom failed");
+            }
+            return;
+        }
+
+        // Raw sockets see the IP header, and every worker's sees every reply, so the
+        // identifier picks ours; ping sockets rewrite it to their own and only get theirs
+        const uint8_t *icmp = buffer;
+        if (w->probe_raw) {
+            size_t header_len = (buffer[0] & 0x0f) * 4;
+            if (received < (ssize_t)header_len + 8) continue;
+            icmp += header_len;
+            received -= header_len;
+        }
+        if (received < 8 || icmp[0] != 0 || (w->probe_raw && ((icmp[4] << 8) | icmp[5]) != w->probe_ident)) {
+            continue; // not an echo reply to us
+        }
+        uint16_t seq = (icmp[6] << 8) | icmp[7];
+        Exchange *x = &w->exchanges[seq & (MAX_EXCHANGES - 1)];
+        if (x->in_use && x->wait == EXCHANGE_WAIT_ECHO && x->seq == seq && x->wait_ip == from.sin_addr.s_addr) {
+            x->result = 1;
+            resume_exchange(w, x);
+        }
+    }
+}
+
+// Resumes every exchange whose wait is over, then sets the timer for the next one
+void on_exchange_timer(Worker *w) {
+    uint64_t expirations;
+    if (read(w->exchange_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("exchange timer read failed");
+    }
+    w->exchange_timer_armed = 0;
+    uint32_t now = monotonic_ms();
+    for (int i = 0; i < MAX_EXCHANGES && w->exchanges_in_use > 0; i++) {
+        Exchange *x = &w->exchanges[i];
+        if (x->in_use && x->wait != EXCHANGE_WAIT_NONE && (int32_t)(now - x->deadline_ms) >= 0) {
+            x->result = 0;
+            resume_exchange(w, x);
+        }
+        if (x->in_use && x->wait != EXCHANGE_WAIT_NONE) {
+            arm_exchange_timer(w, x->deadline_ms);
+        }
+    }
+}
+
+// Each worker pings from its own ICMP socket; without CAP_NET_RAW a ping socket
+// (net.ipv4.ping_group_range) does the job, and without either probing stays off
+int open_conflict_probing(Worker *w) {
+    w->probe_raw = 1;
+    w->probe_sock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (w->probe_sock >= 0) {
+        struct icmp_filter filter;
+        filter.data = ~(1U << ICMP_ECHOREPLY);
+        if (setsockopt(w->probe_sock, SOL_RAW, ICMP_FILTER, &filter, sizeof(filter)) < 0) {
+            perror("setsockopt(ICMP_FILTER) failed"); // replies are filtered in userspace too
+        }
+    } else {
+        w->probe_raw = 0;
+        w->probe_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    }
+    if (w->probe_sock < 0) {
+        if (w->id == 0) {
+            write_log("No ICMP socket available, address conflict probing disabled");
+        }
+        return -1;
+    }
+    w->probe_ident = (uint16_t)(hash64(getpid() ^ (uint64_t)time(NULL)) + w->id);
+    return 0;
+}
+
+// Lease replication. The active server journals every lease write and its replication
+// thread streams the journal to a standby over TCP in batches of sequence-numbered records.
+// The standby applies them, acknowledges, and takes over once the active one has been
+// silent for replication_failover_ms. A standby that reconnects continues from its last
+// acknowledged record if the journal still has it, otherwise it gets the whole table first.
+// Records are raw IPLease structs, so peers must share the architecture, as with the
+// snapshot file.
+int repl_wait(int fd, short events, int timeout_ms) {
+    struct pollfd p = { fd, events, 0 };
+    int n = poll(&p, 1, timeout_ms);
+    return n > 0 && (p.revents & (events | POLLHUP | POLLERR)) ? 0 : -1;
+}
+
+int repl_read(int fd, void *data, size_t len, int timeout_ms) {
+    uint8_t *p = data;
+    while (len > 0) {
+        if (repl_wait(fd, POLLIN, timeout_ms) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int repl_send(int fd, int type, uint64_t seq, uint64_t stream, const IPLease *records, uint32_t count) {
+    ReplHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.count = count;
+    header.seq = seq;
+    header.stream = stream;
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)records, count * sizeof(IPLease) } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count > 0 ? 2 : 1;
+    size_t left = sizeof(header) + count * sizeof(IPLease);
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1; // includes SO_SNDTIMEO running out on a stuck peer
+        }
+        left -= n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (uint8_t *)msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Lets workers holding ACKs look at replication_acked again
+void wake_replication_waiters() {
+    for (int i = 0; i < num_workers; i++) {
+        if (__atomic_load_n(&workers[i].replication_waiters, __ATOMIC_RELAXED) > 0) {
+            uint64_t one = 1;
+            if (write(workers[i].wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("eventfd write failed");
+            }
+        }
+    }
+}
+
+// Sends every record, read without lease_mutex, and returns the journal position the
+// standby continues from. Writes during the walk are in the journal after that position.
+uint64_t replication_send_snapshot(int fd) {
+    uint64_t start = __atomic_load_n(&journal_head, __ATOMIC_ACQUIRE);
+    if (repl_send(fd, REPL_SNAPSHOT, 0, journal_stream, NULL, 0) < 0) {
+        return 0;
+    }
+    IPLease batch[REPL_BATCH];
+    int count = __atomic_load_n(&num_leases, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ) {
+        int n = 0;
+        for (; n < REPL_BATCH && i < count; i++) {
+            lease_read(&ip_leases[i], &batch[n]);
+            batch[n].seq = 0;
+            if (batch[n].state != 0) n++;
+        }
+        if (n > 0 && repl_send(fd, REPL_RECORDS, 0, journal_stream, batch, n) < 0) {
+            return 0;
+        }
+    }
+    if (repl_send(fd, REPL_SNAPSHOT_END, start, journal_stream, NULL, 0) < 0) {
+        return 0;
+    }
+    return start + 1;
+}
+
+// Streams to one connected standby until it goes away or stops acknowledging
+void replication_serve(int fd) {
+    ReplHeader hello;
+    if (repl_read(fd, &hello, sizeof(hello), replication_failover_ms) < 0 || hello.type != REPL_HELLO) {
+        return;
+    }
+    uint64_t next = hello.seq + 1;
+    uint64_t acked = hello.seq;
+    uint64_t head = __atomic_load_n(&journal_head, __ATOMIC_ACQUIRE);
+    if (hello.stream != journal_stream || hello.seq > head || head - hello.seq >= REPL_JOURNAL_SIZE) {
+        next = replication_send_snapshot(fd);
+        if (next == 0) {
+            return;
+        }
+        acked = 0; // until it acknowledges the end of the snapshot
+    }
+    __atomic_store_n(&replication_acked, acked, __ATOMIC_RELEASE);
+    __atomic_store_n(&replication_connected, 1, __ATOMIC_RELEASE);
+    write_log("Standby connected, replicating leases");
+
+    uint32_t last_sent = monotonic_ms();
+    uint32_t last_heard = last_sent;
+    IPLease batch[REPL_BATCH];
+    while (__atomic_load_n(&server_running, __ATOMIC_RELAXED)) {
+        head = __atomic_load_n(&journal_head, __ATOMIC_ACQUIRE);
+        int failed = 0;
+        while (next <= head && !failed) {
+            uint64_t first = next;
+            int n = 0;
+            int overrun = 0;
+            pthread_mutex_lock(&lease_mutex);
+            for (; n < REPL_BATCH && next <= head; n++, next++) {
+                const JournalEntry *entry = &journal[next & (REPL_JOURNAL_SIZE - 1)];
+                if (entry->seq != next) {
+                    overrun = 1; // the standby fell a whole journal behind
+                    break;
+                }
+                batch[n] = entry->lease;
+            }
+            pthread_mutex_unlock(&lease_mutex);
+            if (overrun) {
+                next = replication_send_snapshot(fd);
+                failed = next == 0;
+            } else {
+                failed = repl_send(fd, REPL_RECORDS, first, journal_stream, batch, n) < 0;
+                __atomic_add_fetch(&stats.replication_records, n, __ATOMIC_RELAXED);
+            }
+            last_sent = monotonic_ms();
+        }
+        if (failed) {
+            break;
+        }
+        if ((int32_t)(monotonic_ms() - last_sent) >= replication_heartbeat_ms) {
+            if (repl_send(fd, REPL_HEARTBEAT, next - 1, journal_stream, NULL, 0) < 0) {
+                break;
+            }
+            last_sent = monotonic_ms();
+        }
+
+        // Sleep until the standby says something, the journal grows or a heartbeat is due
+        __atomic_store_n(&replication_sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&journal_head, __ATOMIC_ACQUIRE) >= next) {
+            __atomic_store_n(&replication_sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { replication_event_fd, POLLIN, 0 } };
+        int ready = poll(fds, 2, replication_heartbeat_ms);
+        __atomic_store_n(&replication_sleeping, 0, __ATOMIC_RELAXED);
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            uint64_t value;
+            if (read(replication_event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                perror("eventfd read failed");
+            }
+        }
+        if (ready > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ReplHeader ack;
+            if (repl_read(fd, &ack, sizeof(ack), replication_failover_ms) < 0 || ack.type != REPL_ACK) {
+                break;
+            }
+            last_heard = monotonic_ms();
+            if (ack.seq > __atomic_load_n(&replication_acked, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&replication_acked, ack.seq, __ATOMIC_RELEASE);
+                wake_replication_waiters();
+            }
+        } else if ((int32_t)(monotonic_ms() - last_heard) >= replication_failover_ms) {
+            break; // the standby stopped acknowledging even heartbeats
+        }
+    }
+    __atomic_store_n(&replication_connected, 0, __ATOMIC_RELEASE);
+    wake_replication_waiters(); // held ACKs go out now
+    write_log("Standby disconnected, serving without replication");
+}
+
+int replication_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((connect(fd, (struct sockaddr *)&replication_peer, sizeof(replication_peer)) < 0 && errno != EINPROGRESS) ||
+        repl_wait(fd, POLLOUT, replication_heartbeat_ms) < 0) {
+        close(fd);
+        return -1;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        close(fd);
+        return -1;
+    }
+    int blocking = 0, nodelay = 1;
+    ioctl(fd, FIONBIO, &blocking); // reads and writes below wait with poll and SO_SNDTIMEO
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
 
-    uint32_t lease_time = htonl(default_lease_time);
-    add_dhcp_option(response.options, &option_offset, 51, 4, (uint8_t*)&lease_time);
+// Applies one batch from the active peer; snapshot records aren't in its journal order,
+// but every record is the whole lease, so applying one twice is harmless
+void replication_apply(const IPLease *records, uint32_t count) {
+    pthread_mutex_lock(&lease_mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        int index = lease_record_locked(records[i].ip);
+        if (index >= 0) {
+            lease_update_locked(index, records[i].mac, records[i].state, records[i].lease_start, records[i].lease_time);
+        }
+    }
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+// Follows the active peer until it has been silent for replication_failover_ms. At startup
+// the primary only gives it one try, so a lone primary starts serving right away and one
+// coming back after a failover becomes the standby of the server that took over.
+void replication_follow(int one_try) {
+    uint64_t stream = 0;
+    uint64_t applied = 0;
+    uint32_t last_heard = monotonic_ms();
+    IPLease *records = malloc(REPL_MAX_RECORDS * sizeof(IPLease));
+    if (records == NULL) {
+        return;
+    }
+    while (__atomic_load_n(&server_running, __ATOMIC_RELAXED)) {
+        int32_t left = replication_failover_ms - (int32_t)(monotonic_ms() - last_heard);
+        if (left <= 0) {
+            break;
+        }
+        int fd = replication_connect();
+        if (fd < 0) {
+            if (one_try) {
+                break;
+            }
+            struct timespec pause = { 0, (long)replication_heartbeat_ms * 1000000L };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        one_try = 0;
+        __atomic_store_n(&replication_connected, 1, __ATOMIC_RELEASE);
+        int timeout = replication_failover_ms;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){ timeout / 1000, (timeout % 1000) * 1000 }, sizeof(struct timeval));
+        int failed = repl_send(fd, REPL_HELLO, applied, stream, NULL, 0) < 0;
+
+        ReplHeader header;
+        while (!failed && __atomic_load_n(&server_running, __ATOMIC_RELAXED)) {
+            left = replication_failover_ms - (int32_t)(monotonic_ms() - last_heard);
+            if (left <= 0 || repl_read(fd, &header, sizeof(header), left) < 0 || header.count > REPL_MAX_RECORDS ||
+                repl_read(fd, records, header.count * sizeof(IPLease), replication_failover_ms) < 0) {
+                break;
+            }
+            last_heard = monotonic_ms();
+            int ack = 1;
+            if (header.type == REPL_SNAPSHOT) {
+                // Forget everything; the snapshot brings back what the peer still has
+                pthread_mutex_lock(&lease_mutex);
+                for (int i = 0; i < num_leases; i++) {
+                    if (ip_leases[i].state != 0) {
+                        lease_set_state_locked(i, 0);
+                    }
+                }
+                pthread_mutex_unlock(&lease_mutex);
+                stream = header.stream;
+                ack = 0;
+            } else if (header.type == REPL_RECORDS) {
+                replication_apply(records, header.count);
+                if (header.seq != 0) {
+                    applied = header.seq + header.count - 1;
+                } else {
+                    ack = 0; // part of a snapshot
+                }
+            } else if (header.type == REPL_SNAPSHOT_END) {
+                applied = header.seq;
+            } else if (header.type != REPL_HEARTBEAT) {
+                break;
+            }
+            if (ack) {
+                failed = repl_send(fd, REPL_ACK, applied, stream, NULL, 0) < 0;
+            }
+        }
+        __atomic_store_n(&replication_connected, 0, __ATOMIC_RELEASE);
+        close(fd);
+    }
+    free(records);
+}
+
+int replication_listen() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Replication socket creation failed");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(replication_port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("Replication socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void *replication_thread(void *arg) {
+    (void)arg;
+    if (!__atomic_load_n(&dhcp_serving, __ATOMIC_ACQUIRE)) {
+        replication_follow(replication_primary);
+        if (!__atomic_load_n(&server_running, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        // A new stream: a standby that followed someone else needs the whole table
+        getrandom(&journal_stream, sizeof(journal_stream), 0);
+        __atomic_store_n(&dhcp_serving, 1, __ATOMIC_RELEASE);
+        write_log(replication_primary ? "No active peer, serving DHCP" : "Active peer silent, taking over DHCP");
+    }
+
+    int listen_fd = replication_listen();
+    if (listen_fd < 0) {
+        write_log("Replication unavailable, serving without a standby");
+        return NULL;
+    }
+    while (__atomic_load_n(&server_running, __ATOMIC_RELAXED)) {
+        if (repl_wait(listen_fd, POLLIN, replication_heartbeat_ms) < 0) {
+            continue;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        int timeout = replication_failover_ms;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){ timeout / 1000, (timeout % 1000) * 1000 }, sizeof(struct timeval));
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        replication_serve(fd);
+        close(fd);
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+// Both servers start as standbys; replication_thread decides which one serves
+int start_replication() {
+    char peer[sizeof(replication_peer_text)];
+    strcpy(peer, replication_peer_text);
+    char *colon = strchr(peer, ':');
+    memset(&replication_peer, 0, sizeof(replication_peer));
+    replication_peer.sin_family = AF_INET;
+    if (colon != NULL) {
+        *colon = '\0';
+        replication_peer.sin_port = htons(atoi(colon + 1));
+    }
+    if (colon == NULL || replication_peer.sin_port == 0 || inet_pton(AF_INET, peer, &replication_peer.sin_addr) != 1 ||
+        replication_port <= 0 || replication_port > 65535 || replication_heartbeat_ms <= 0 ||
+        replication_failover_ms <= replication_heartbeat_ms) {
+        write_log("Invalid replication settings: need replication_peer=<ip>:<port>, replication_port and a failover above the heartbeat");
+        return -1;
+    }
+    if (strcmp(replication_role, "primary") != 0 && strcmp(replication_role, "standby") != 0) {
+        write_log("replication_role must be primary or standby");
+        return -1;
+    }
+    replication_primary = strcmp(replication_role, "primary") == 0;
+
+    journal = calloc(REPL_JOURNAL_SIZE, sizeof(JournalEntry));
+    replication_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dhcp_serving = 0;
+    pthread_t thread;
+    if (journal == NULL || replication_event_fd < 0 ||
+        pthread_create(&thread, NULL, replication_thread, NULL) != 0 || pthread_detach(thread) != 0) {
+        write_log("Failed to start replication");
+        return -1;
+    }
+    return 0;
+}
+
+// Servers sharing clients tell each other they're up once a tick; lb_alive follows what was heard
+typedef struct {
+    char magic[8];
+    uint32_t index;
+    uint32_t count; // servers in the sender's lb_servers, which must match ours
+} LBHeartbeat;
+
+int start_load_balancing() {
+    char list[sizeof(lb_servers_text)];
+    strcpy(list, lb_servers_text);
+    char *save = NULL;
+    for (char *entry = strtok_r(list, ", ", &save); entry != NULL; entry = strtok_r(NULL, ", ", &save)) {
+        char *colon = strchr(entry, ':');
+        if (num_lb_servers == MAX_LB_SERVERS || colon == NULL) {
+            num_lb_servers = 0;
+            break;
+        }
+        *colon = '\0';
+        struct sockaddr_in *server = &lb_servers[num_lb_servers];
+        memset(server, 0, sizeof(*server));
+        server->sin_family = AF_INET;
+        server->sin_port = htons(atoi(colon + 1));
+        if (server->sin_port == 0 || inet_pton(AF_INET, entry, &server->sin_addr) != 1) {
+            num_lb_servers = 0;
+            break;
+        }
+        num_lb_servers++;
+    }
+    if (num_lb_servers < 2 || lb_index < 0 || lb_index >= num_lb_servers || lb_failover_secs < 2) {
+        write_log("Invalid load balancing settings: need lb_servers=<ip>:<port>,<ip>:<port>..., this server's lb_index and lb_failover_secs of at least 2");
+        num_lb_servers = 0;
+        return -1;
+    }
+
+    lb_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lb_sock < 0) {
+        perror("socket(load balancing) failed");
+        return -1;
+    }
+    if (bind(lb_sock, (struct sockaddr *)&lb_servers[lb_index], sizeof(lb_servers[lb_index])) < 0) {
+        perror("bind(load balancing) failed");
+        return -1;
+    }
+
+    // Peers count as up until they've had lb_failover_secs to say so, or a restarted server
+    // would answer everyone's clients
+    uint32_t now = monotonic_ms();
+    for (int i = 0; i < num_lb_servers; i++) {
+        lb_last_heard_ms[i] = now;
+    }
+    lb_alive = (1u << num_lb_servers) - 1;
+
+    char log_message[128];
+    snprintf(log_message, sizeof(log_message), "Load balancing as server %d of %d", lb_index, num_lb_servers);
+    write_log(log_message);
+    return 0;
+}
+
+void on_lb_readable() {
+    LBHeartbeat heartbeat;
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t length;
+    while ((length = recvfrom(lb_sock, &heartbeat, sizeof(heartbeat), 0, (struct sockaddr *)&from, &from_len)) >= 0) {
+        from_len = sizeof(from);
+        if (length != sizeof(heartbeat) || memcmp(heartbeat.magic, LB_MAGIC, sizeof(heartbeat.magic)) != 0 ||
+            ntohl(heartbeat.count) != (uint32_t)num_lb_servers || ntohl(heartbeat.index) >= (uint32_t)num_lb_servers) {
+            continue;
+        }
+        uint32_t index = ntohl(heartbeat.index);
+        if (from.sin_addr.s_addr == lb_servers[index].sin_addr.s_addr && from.sin_port == lb_servers[index].sin_port) {
+            lb_last_heard_ms[index] = monotonic_ms();
+        }
+    }
+}
+
+void lb_tick() {
+    LBHeartbeat heartbeat;
+    memcpy(heartbeat.magic, LB_MAGIC, sizeof(heartbeat.magic));
+    heartbeat.index = htonl(lb_index);
+    heartbeat.count = htonl(num_lb_servers);
+
+    uint32_t now = monotonic_ms();
+    uint32_t alive = 1u << lb_index;
+    for (int i = 0; i < num_lb_servers; i++) {
+        if (i == lb_index) {
+            continue;
+        }
+        sendto(lb_sock, &heartbeat, sizeof(heartbeat), 0, (struct sockaddr *)&lb_servers[i], sizeof(lb_servers[i]));
+        if ((int32_t)(now - lb_last_heard_ms[i]) < lb_failover_secs * 1000) {
+            alive |= 1u << i;
+        }
+    }
+
+    uint32_t changed = alive ^ lb_alive;
+    __atomic_store_n(&lb_alive, alive, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_lb_servers; i++) {
+        if (changed & (1u << i)) {
+            char log_message[128];
+            snprintf(log_message, sizeof(log_message), alive & (1u << i) ?
+                     "Load balancing: server %d is back, returning its clients" :
+                     "Load balancing: server %d is silent, its clients go to the next server up", i);
+            write_log(log_message);
+        }
+    }
+}
+
+void on_timer_tick(Worker *w) {
+    uint64_t expirations;
+    if (read(w->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    w->ticks += expirations;
+    if (w->ticks % LEASE_CLEANUP_INTERVAL < expirations) {
+        cleanup_expired_leases(w->config);
+    }
+    if (w->ticks % STATS_INTERVAL < expirations) {
+        print_dhcp_stats(stdout, w->config);
+    }
+    if (lb_sock >= 0) {
+        lb_tick();
+    }
+    dns_expire_pending(w);
+    reclaim_configs();
+}
+
+void on_signal(Worker *w) {
+    struct signalfd_siginfo info;
+    while (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+            printf("Received signal %d. Shutting down...\n", info.ssi_signo);
+            stop_all_workers();
+        } else if (info.ssi_signo == SIGHUP) {
+            pthread_mutex_lock(&log_mutex);
+            log_reopen_requested = 1; // done by the next flush
+            pthread_mutex_unlock(&log_mutex);
+            write_log("Received SIGHUP, log reopened, reloading configuration");
+            request_config_reload();
+        }
+    }
+}
+
+void handle_packet_frame(Worker *w, const uint8_t *frame, uint32_t len, uint64_t rx_ns) {
+    if (len < sizeof(struct ether_header) + sizeof(struct iphdr)) {
+        return;
+    }
+    const struct iphdr *ip = (const struct iphdr *)(frame + sizeof(struct ether_header));
+    size_t ip_len = ip->ihl * 4;
+    size_t headers = sizeof(struct ether_header) + ip_len + sizeof(struct udphdr);
+    if (ip_len < sizeof(struct iphdr) || len < headers) {
+        return;
+    }
+    const struct udphdr *udp = (const struct udphdr *)((const uint8_t *)ip + ip_len);
+
+    DHCPPacket packet;
+    size_t payload_len = len - headers;
+    if (payload_len > sizeof(packet)) {
+        payload_len = sizeof(packet);
+    }
+    memcpy(&packet, frame + headers, payload_len);
+
+    struct sockaddr_in client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sin_family = AF_INET;
+    client_addr.sin_addr.s_addr = ip->saddr;
+    client_addr.sin_port = udp->source;
+    admit_dhcp_packet(w, &packet, payload_len, &client_addr, rx_ns);
+}
+
+// Walks every block the kernel has retired to us, then hands each block straight back
+void on_packet_readable(Worker *w) {
+    PacketRing *p = &w->packet;
+    for (int n = 0; n < PACKET_RX_BLOCKS; n++) {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(p->map + (size_t)p->rx_block * PACKET_BLOCK_SIZE);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+        for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            struct sockaddr_ll *ll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            if (ll->sll_pkttype != PACKET_OUTGOING) {
+                handle_packet_frame(w, (uint8_t *)hdr + hdr->tp_mac, hdr->tp_snaplen,
+                                    (uint64_t)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec);
+            }
+            hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+        }
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        p->rx_block = (p->rx_block + 1) % PACKET_RX_BLOCKS;
+    }
+}
+
+// Admin control socket: line commands in, text out, one "OK"/"ERR" line ends each answer.
+// Only worker 0 serves it. Dumps advance CONTROL_BATCH records per loop pass while the client
+// keeps up and snapshots are written on the task pool, so a huge table never holds up packet
+// processing.
+void control_update_events(Worker *w, ControlConn *c) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // While busy, wait for room to write (and keep the job stepping); otherwise, for commands
+    // A snapshot runs on the task pool and wakes us when done, so nothing to wait for then
+    if (c->out_len > c->out_off || c->job == CONTROL_JOB_DUMP) {
+        ev.events = EPOLLOUT;
+    } else {
+        ev.events = c->job == CONTROL_JOB_NONE ? EPOLLIN : 0;
+    }
+    ev.data.fd = c->fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void control_close(Worker *w, ControlConn *c) {
+    if (c->snapshot != NULL) {
+        c->snapshot->conn = NULL; // it finishes anyway
+        c->snapshot = NULL;
+    }
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Appends to the connection's output; callers check control_room() first for long output
+void control_printf(ControlConn *c, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(c->out + c->out_len, sizeof(c->out) - c->out_len, format, args);
+    va_end(args);
+    if (n > 0) {
+        c->out_len += n < (int)(sizeof(c->out) - c->out_len) ? n : (int)(sizeof(c->out) - c->out_len) - 1;
+    }
+}
+
+int control_room(ControlConn *c) {
+    if (c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    } else if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    return sizeof(c->out) - c->out_len;
+}
+
+// Returns -1 once the peer is gone
+int control_flush(ControlConn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+    return 0;
+}
+
+void control_print_lease(ControlConn *c, const IPLease *lease) {
+    static const char *states[] = { "free", "offered", "leased", "conflict" };
+    char ip[16], mac[18];
+    format_ip(lease->ip, ip);
+    format_mac(lease->mac, mac);
+    long remaining = (long)(lease->lease_start + lease->lease_time - time(NULL));
+    control_printf(c, "%s %s %s %ld\n", ip, mac, lease->state < 4 ? states[lease->state] : "?",
+                   lease->state != 0 && remaining > 0 ? remaining : 0);
+}
+
+// Finds the lease named by an IP or MAC argument; returns its index or -1
+int control_find_lease(const char *arg, IPLease *out) {
+    uint8_t mac[6];
+    uint32_t ip;
+    if (parse_mac(arg, mac) == 0) {
+        return lease_find_by_mac(mac, out);
+    }
+    if (inet_pton(AF_INET, arg, &ip) == 1) {
+        return lease_find_by_ip(ip, out);
+    }
+    return -1;
+}
+
+void control_pool(ControlConn *c, const Config *cfg) {
+    int offered = 0, leased = 0, conflicts = 0;
+    int count = __atomic_load_n(&num_leases, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        IPLease lease;
+        lease_read(&ip_leases[i], &lease);
+        if (lease.state == 1) offered++;
+        else if (lease.state == 2) leased++;
+        else if (lease.state == 3) conflicts++;
+    }
+    for (int i = 0; i < cfg->num_pools; i++) {
+        char start[16], end[16];
+        format_ip(htonl(cfg->pools[i].start), start);
+        format_ip(htonl(cfg->pools[i].end), end);
+        control_printf(c, "range %s-%s lease %d\n", start, end, cfg->pools[i].lease_time);
+    }
+    uint32_t pool_size = config_pool_size(cfg);
+    control_printf(c, "reservations %u\n", cfg->reservations.size);
+    control_printf(c, "size %u\nleased %d\noffered %d\nconflict %d\nfree %d\nutilization %.1f%%\nrecords %d/%d\n",
+                   pool_size, leased, offered, conflicts, (int)pool_size - leased - offered - conflicts,
+                   100.0 * (leased + offered) / pool_size, count, max_leases);
+}
+
+void control_rate_limit(ControlConn *c, const Config *cfg, const char *arg) {
+    if (arg == NULL) {
+        int used = 0;
+        for (int s = 0; s < RATE_LIMIT_SETS; s++) {
+            for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+                used += __atomic_load_n(&rate_limiter[s].entries[i].key, __ATOMIC_RELAXED) != 0;
+            }
+        }
+        control_printf(c, "limits client %u/s relay %u/s circuit %u/s burst %u\nbuckets %d/%d\n",
+                       cfg->rate_limit_mac, cfg->rate_limit_relay, cfg->rate_limit_circuit, cfg->rate_limit_burst, used, RATE_LIMIT_SETS * RATE_LIMIT_WAYS);
+        control_printf(c, "limited client %llu relay %llu circuit %llu evictions %llu\n",
+                       (unsigned long long)__atomic_load_n(&stats.rate_limited_mac, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&stats.rate_limited_relay, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&stats.rate_limited_circuit, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&stats.rate_limit_evictions, __ATOMIC_RELAXED));
+        control_printf(c, "OK\n");
+        return;
+    }
+
+    uint8_t mac[6];
+    uint32_t tokens;
+    if (parse_mac(arg, mac) < 0) {
+        control_printf(c, "ERR expected a MAC address\n");
+    } else if (!rate_limit_peek(hash_bytes(mac, 6, RATE_KEY_MAC), cfg->rate_limit_mac, cfg->rate_limit_burst, monotonic_ms(), &tokens)) {
+        control_printf(c, "%s untracked\nOK\n", arg);
+    } else {
+        control_printf(c, "%s tokens %u.%03u of %u\nOK\n", arg, tokens / 1000, tokens % 1000, cfg->rate_limit_burst);
+    }
+}
+
+// Writes the lease table, in the shared segment's layout, to a temporary file and renames it
+// into place. On the task pool, since a large table means many megabytes of disk writes
+void run_snapshot_task(Task *task) {
+    SnapshotTask *t = (SnapshotTask *)task;
+    FILE *file = fopen(lease_snapshot_tmp, "wb");
+    if (file == NULL) {
+        t->error = errno;
+        return;
+    }
+    LeaseTableHeader header = *lease_table;
+    header.count = t->count;
+    header.capacity = t->count;
+    fwrite(&header, sizeof(header), 1, file);
+    for (int i = 0; i < t->count; i++) {
+        IPLease lease;
+        lease_read(&ip_leases[i], &lease);
+        lease.seq = 0;
+        fwrite(&lease, sizeof(lease), 1, file);
+    }
+    if (fclose(file) != 0 || rename(lease_snapshot_tmp, lease_snapshot_file) < 0) {
+        t->error = errno;
+        unlink(lease_snapshot_tmp);
+    }
+}
+
+void finish_snapshot_task(Worker *w, Task *task) {
+    SnapshotTask *t = (SnapshotTask *)task;
+    ControlConn *c = t->conn;
+    if (c != NULL) {
+        if (t->error != 0) {
+            control_printf(c, "ERR %s\n", strerror(t->error));
+        } else {
+            control_printf(c, "wrote %d leases to %s\nOK\n", t->count, lease_snapshot_file);
+        }
+        c->snapshot = NULL;
+        c->job = CONTROL_JOB_NONE;
+        control_update_events(w, c); // the answer goes out, then buffered commands resume
+    }
+    snapshot_running = 0;
+    free(t);
+}
+
+void control_start_snapshot(Worker *w, ControlConn *c) {
+    if (snapshot_running) {
+        control_printf(c, "ERR snapshot already running\n");
+        return;
+    }
+    SnapshotTask *t = calloc(1, sizeof(SnapshotTask));
+    if (t == NULL) {
+        control_printf(c, "ERR %s\n", strerror(errno));
+        return;
+    }
+    t->task.run = run_snapshot_task;
+    t->task.complete = finish_snapshot_task;
+    t->conn = c;
+    t->count = __atomic_load_n(&lease_table->count, __ATOMIC_ACQUIRE);
+    snapshot_running = 1;
+    c->snapshot = t;
+    c->job = CONTROL_JOB_SNAPSHOT;
+    submit_task(&t->task, w->id);
+}
+
+void control_command(Worker *w, ControlConn *c, char *line) {
+    char *saveptr;
+    char *cmd = strtok_r(line, " \t\r", &saveptr);
+    char *arg = strtok_r(NULL, " \t\r", &saveptr);
+    if (cmd == NULL) {
+        return;
+    }
+
+    if (strcmp(cmd, "help") == 0) {
+        control_printf(c, "commands: stats, pool, lease <ip|mac>, release <ip|mac>, dump [all], ratelimit [mac], snapshot, reload, quit\nOK\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        char *text = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&text, &size);
+        if (out != NULL) {
+            print_dhcp_stats(out, w->config);
+            fclose(out);
+            control_printf(c, "%sOK\n", text);
+            free(text);
+        }
+    } else if (strcmp(cmd, "pool") == 0) {
+        control_pool(c, w->config);
+        control_printf(c, "OK\n");
+    } else if (strcmp(cmd, "lease") == 0 && arg != NULL) {
+        IPLease lease;
+        if (control_find_lease(arg, &lease) < 0 || lease.state == 0) {
+            control_printf(c, "ERR no lease for %s\n", arg);
+        } else {
+            control_print_lease(c, &lease);
+            control_printf(c, "OK\n");
+        }
+    } else if (strcmp(cmd, "release") == 0 && arg != NULL) {
+        IPLease lease;
+        int index = control_find_lease(arg, &lease);
+        if (index < 0 || lease.state == 0) {
+            control_printf(c, "ERR no lease for %s\n", arg);
+        } else {
+            // Only if nobody re-leased it since the lock-free lookup
+            pthread_mutex_lock(&lease_mutex);
+            if (memcmp(ip_leases[index].mac, lease.mac, 6) == 0) {
+                lease_set_state_locked(index, 0);
+            }
+            pthread_mutex_unlock(&lease_mutex);
+            char ip[16];
+            char log_message[256];
+            format_ip(lease.ip, ip);
+            snprintf(log_message, sizeof(log_message), "Released IP: %s (admin)", ip);
+            write_log(log_message);
+            control_printf(c, "released %s\nOK\n", ip);
+        }
+    } else if (strcmp(cmd, "dump") == 0) {
+        c->job = CONTROL_JOB_DUMP;
+        c->dump_all = arg != NULL && strcmp(arg, "all") == 0;
+        c->cursor = 0;
+        c->job_end = __atomic_load_n(&num_leases, __ATOMIC_ACQUIRE);
+    } else if (strcmp(cmd, "ratelimit") == 0) {
+        control_rate_limit(c, w->config, arg);
+    } else if (strcmp(cmd, "reload") == 0) {
+        if (request_config_reload() < 0) {
+            control_printf(c, "ERR reload already running\n");
+        } else {
+            control_printf(c, "reload started, see the log for the result\nOK\n");
+        }
+    } else if (strcmp(cmd, "snapshot") == 0) {
+        control_start_snapshot(w, c);
+    } else if (strcmp(cmd, "quit") == 0) {
+        c->closing = 1;
+    } else {
+        control_printf(c, "ERR unknown command, try help\n");
+    }
+}
+
+// Advances a dump by at most CONTROL_BATCH records
+void control_step_job(ControlConn *c) {
+    int limit = c->cursor + CONTROL_BATCH < c->job_end ? c->cursor + CONTROL_BATCH : c->job_end;
+
+    if (c->job == CONTROL_JOB_DUMP) {
+        while (c->cursor < limit && control_room(c) > 128) {
+            IPLease lease;
+            lease_read(&ip_leases[c->cursor++], &lease);
+            if (lease.state != 0 || c->dump_all) {
+                control_print_lease(c, &lease);
+            }
+        }
+        if (c->cursor == c->job_end && control_room(c) > 8) {
+            control_printf(c, "OK\n");
+            c->job = CONTROL_JOB_NONE;
+        }
+    }
+}
+
+void on_control_accept(Worker *w) {
+    for (;;) {
+        int fd = accept4(w->control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        ControlConn *c = NULL;
+        for (int i = 0; i < MAX_CONTROL_CONNS && c == NULL; i++) {
+            if (control_conns[i].fd < 0) c = &control_conns[i];
+        }
+        if (c == NULL) {
+            write_log("Control socket: too many connections");
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        if (add_to_epoll(w->epoll_fd, fd) < 0) {
+            close(fd);
+            c->fd = -1;
+        }
+    }
+}
+
+void on_control_event(Worker *w, int fd) {
+    ControlConn *c = NULL;
+    for (int i = 0; i < MAX_CONTROL_CONNS && c == NULL; i++) {
+        if (control_conns[i].fd == fd) c = &control_conns[i];
+    }
+    if (c == NULL) {
+        return;
+    }
+
+    if (c->job == CONTROL_JOB_NONE && c->out_off == c->out_len) {
+        ssize_t n = read(fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            control_close(w, c);
+            return;
+        }
+        if (n > 0) {
+            c->in_len += n;
+        }
+    }
+
+    // Run buffered commands until one starts a job; the rest wait for it to finish
+    for (;;) {
+        if (c->job != CONTROL_JOB_NONE) {
+            control_step_job(c);
+        }
+        if (control_flush(c) < 0) {
+            control_close(w, c);
+            return;
+        }
+        if (c->job != CONTROL_JOB_NONE || c->out_off < c->out_len) {
+            break;
+        }
+        if (c->closing) {
+            control_close(w, c);
+            return;
+        }
+        char *newline = memchr(c->in, '\n', c->in_len);
+        if (newline == NULL) {
+            if (c->in_len == sizeof(c->in) - 1) {
+                control_close(w, c); // no command is that long
+                return;
+            }
+            break;
+        }
+        *newline = '\0';
+        control_room(c);
+        control_command(w, c, c->in);
+        c->in_len -= newline + 1 - c->in;
+        memmove(c->in, newline + 1, c->in_len);
+    }
+    control_update_events(w, c);
+}
+
+int create_control_socket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(control_socket_path) >= sizeof(addr.sun_path)) {
+        write_log("Control socket path too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, control_socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Control socket creation failed");
+        return -1;
+    }
+    unlink(control_socket_path); // left over from a previous run
+    mode_t old_mask = umask(0077); // admin only
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(fd, MAX_CONTROL_CONNS) < 0) {
+        perror("Control socket bind failed");
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < MAX_CONTROL_CONNS; i++) {
+        control_conns[i].fd = -1;
+    }
+    return fd;
+}
+
+void close_control_socket(Worker *w) {
+    for (int i = 0; i < MAX_CONTROL_CONNS; i++) {
+        if (control_conns[i].fd >= 0) {
+            control_close(w, &control_conns[i]);
+        }
+    }
+    close(w->control_fd);
+    w->control_fd = -1;
+    unlink(control_socket_path);
+}
+
+// Bulk leasequery, on worker 0 like the control socket. A query naming an address or client
+// gets at most one DHCPLEASEACTIVE; one naming nothing gets every active binding, from a copy
+// of the table made under lease_mutex in one memcpy so the answer is consistent without the
+// lock being held while it streams. Either way DHCPLEASEQUERYDONE ends the answer.
+void bulk_close(Worker *w, BulkConn *c) {
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    free(c->snapshot);
+    c->snapshot = NULL;
+}
 
-    uint32_t server_id = inet_addr(server_ip);
-    add_dhcp_option(response.options, &option_offset, 54, 4, (uint8_t*)&server_id);
+void bulk_update_events(Worker *w, BulkConn *c) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->out_len > c->out_off || c->snapshot != NULL ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+int bulk_room(BulkConn *c) {
+    if (c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    } else if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    return sizeof(c->out) - c->out_len;
+}
 
-    // Add subnet mask option
-    uint32_t subnet_mask = htonl(0xFFFFFF00); // 255.255.255.0
-    add_dhcp_option(response.options, &option_offset, 1, 4, (uint8_t*)&subnet_mask);
+// Returns -1 once the peer is gone
+int bulk_flush(BulkConn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+    return 0;
+}
 
-    // Add router option (default gateway)
-    uint32_t router = inet_addr(server_ip); // Using server IP as gateway
-    add_dhcp_option(response.options, &option_offset, 3, 4, (uint8_t*)&router);
+// Callers make sure there is room for a whole DHCPPacket and its length
+void bulk_append(BulkConn *c, const DHCPPacket *message, int length) {
+    c->out[c->out_len++] = length >> 8;
+    c->out[c->out_len++] = length & 0xff;
+    memcpy(c->out + c->out_len, message, length);
+    c->out_len += length;
+}
 
-    // Add DNS server option
-    add_dhcp_option(response.options, &option_offset, 6, 4, (uint8_t*)&server_id);
+void bulk_send_active(Worker *w, BulkConn *c, const IPLease *lease) {
+    DHCPPacket reply;
+    int length = build_leasequery_reply(w->config, &c->query, 13, lease, c->now, 1, &reply);
+    bulk_append(c, &reply, length);
+}
 
-    response.options[option_offset++] = 255; // End option
+// DHCPLEASEQUERYDONE, with a dhcp-status-code (option 151) unless the query succeeded
+void bulk_send_done(Worker *w, BulkConn *c, uint8_t status, const char *message) {
+    DHCPPacket reply;
+    int length = build_leasequery_reply(w->config, &c->query, 15, NULL, c->now, 1, &reply);
+    if (status != 0) {
+        uint8_t value[64];
+        value[0] = status;
+        int message_len = snprintf((char *)value + 1, sizeof(value) - 1, "%s", message);
+        int option_offset = length - offsetof(DHCPPacket, options) - 1; // over the end option
+        add_dhcp_option(reply.options, &option_offset, 151, 1 + message_len, value);
+        reply.options[option_offset++] = 255; // End option
+        length = offsetof(DHCPPacket, options) + option_offset;
+    }
+    bulk_append(c, &reply, length);
+}
 
-    // Add lease to the list
-    pthread_mutex_lock(&lease_mutex);
-    if (num_leases < MAX_CLIENTS) {
-        struct in_addr addr;
-        addr.s_addr = packet->yiaddr;
-        inet_ntop(AF_INET, &addr, ip_leases[num_leases].ip, sizeof(ip_leases[num_leases].ip));
-        snprintf(ip_leases[num_leases].mac, sizeof(ip_leases[num_leases].mac), "%02x:%02x:%02x:%02x:%02x:%02x",
-                 packet->chaddr[0], packet->chaddr[1], packet->chaddr[2],
-                 packet->chaddr[3], packet->chaddr[4], packet->chaddr[5]);
-        ip_leases[num_leases].lease_start = time(NULL);
-        ip_leases[num_leases].lease_time = ntohl(lease_time);
-        ip_leases[num_leases].state = 2; // Leased
-        num_leases++;
-        snprintf(log_message, sizeof(log_message), "Assigned IP: %s to MAC: %s", ip_leases[num_leases-1].ip, ip_leases[num_leases-1].mac);
-        write_log(log_message);
+void bulk_start_query(Worker *w, BulkConn *c, int length) {
+    STAT_INC(bulk_leasequeries);
+    DHCPPacket *query = &c->query;
+    c->now = time(NULL);
+    uint8_t option_length = 0;
+    uint8_t *option = find_dhcp_option(query, 53, &option_length);
+    if (length < DHCP_MIN_LENGTH || query->op != 1 || ntohl(*(uint32_t *)query->options) != DHCP_MAGIC_COOKIE ||
+        option == NULL || option_length != 1 || option[0] != 14) { // DHCPBULKLEASEQUERY
+        bulk_send_done(w, c, 3, "malformed query"); // MalformedQuery
+        return;
     }
-    else {
-        write_log("No available lease slots");
+    // Relay-id and remote-id queries (option 82 sub-options) need relay information the lease
+    // table doesn't keep, and query-start-time/query-end-time (options 154/155) need lease history
+    if (find_dhcp_option(query, 82, &option_length) != NULL || find_dhcp_option(query, 154, &option_length) != NULL ||
+        find_dhcp_option(query, 155, &option_length) != NULL) {
+        bulk_send_done(w, c, 4, "query type not supported"); // NotAllowed
+        return;
     }
-    pthread_mutex_unlock(&lease_mutex);
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
+    IPLease lease;
+    int type = leasequery_lookup(w->config, query, c->now, &lease);
+    if (type != 0) {
+        if (type == 13) {
+            bulk_send_active(w, c, &lease);
+        }
+        bulk_send_done(w, c, 0, NULL);
         return;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(dhcp_server_port);
-
-    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Bind failed: %s", strerror(errno));
-        write_log(error_msg);
-        perror("Bind failed");
-        close(sock);
-        return ;
+    pthread_mutex_lock(&lease_mutex);
+    c->count = num_leases;
+    c->snapshot = malloc((c->count > 0 ? c->count : 1) * sizeof(IPLease));
+    if (c->snapshot != NULL) {
+        memcpy(c->snapshot, ip_leases, c->count * sizeof(IPLease));
     }
+    pthread_mutex_unlock(&lease_mutex);
+    if (c->snapshot == NULL) {
+        bulk_send_done(w, c, 1, "out of memory"); // UnspecFail
+        return;
+    }
+    c->cursor = 0;
+}
 
-client_addr->sin_port = htons(dhcp_client_port);
-
-    if (sendto(sock, &response, sizeof(DHCPPacket), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("Sendto failed");
-    } else {
-        write_log("Sent DHCP ACK to client");
+// Advances a whole-table answer by at most CONTROL_BATCH records
+void bulk_step(Worker *w, BulkConn *c) {
+    int limit = c->cursor + CONTROL_BATCH < c->count ? c->cursor + CONTROL_BATCH : c->count;
+    while (c->cursor < limit && bulk_room(c) >= (int)sizeof(DHCPPacket) + 2) {
+        IPLease *lease = &c->snapshot[c->cursor++];
+        if (lease->state == 2 && lease->lease_start + lease->lease_time > c->now) {
+            bulk_send_active(w, c, lease);
+        }
+    }
+    if (c->cursor == c->count && bulk_room(c) >= (int)sizeof(DHCPPacket) + 2) {
+        free(c->snapshot);
+        c->snapshot = NULL;
+        bulk_send_done(w, c, 0, NULL);
     }
+}
 
-    close(sock);
+BulkConn *find_bulk_conn(int fd) {
+    for (int i = 0; i < MAX_BULK_CONNS; i++) {
+        if (bulk_conns[i].fd == fd) return &bulk_conns[i];
+    }
+    return NULL;
 }
 
-void handle_dhcp_release(DHCPPacket *packet) {
-    char client_ip[16];
-    inet_ntop(AF_INET, &(packet->ciaddr), client_ip, sizeof(client_ip));
-    
-    pthread_mutex_lock(&lease_mutex);
-    for (int i = 0; i < num_leases; i++) {
-        if (strcmp(ip_leases[i].ip, client_ip) == 0) {
-            ip_leases[i].state = 0; // Free
-            char log_message[256];
-            snprintf(log_message, sizeof(log_message), "Released IP: %s", client_ip);
+void on_bulk_accept(Worker *w) {
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept4(w->bulk_fd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (!leasequery_requestor_allowed(w->config, peer.sin_addr.s_addr)) {
+            STAT_INC(leasequeries_refused);
+            char log_message[64];
+            snprintf(log_message, sizeof(log_message), "Bulk leasequery: refused %s", inet_ntoa(peer.sin_addr));
             write_log(log_message);
-            break;
+            close(fd);
+            continue;
+        }
+        BulkConn *c = find_bulk_conn(-1);
+        if (c == NULL) {
+            write_log("Bulk leasequery: too many connections");
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        if (add_to_epoll(w->epoll_fd, fd) < 0) {
+            close(fd);
+            c->fd = -1;
         }
     }
-    pthread_mutex_unlock(&lease_mutex);
 }
 
-void handle_dhcp_decline(DHCPPacket *packet) {
-    char client_ip[16];
-    inet_ntop(AF_INET, &(packet->ciaddr), client_ip, sizeof(client_ip));
-    
-    pthread_mutex_lock(&lease_mutex);
-    for (int i = 0; i < num_leases; i++) {
-        if (strcmp(ip_leases[i].ip, client_ip) == 0) {
-            ip_leases[i].state = 0; // Free
-            char log_message[256];
-            snprintf(log_message, sizeof(log_message), "Declined IP: %s", client_ip);
-            write_log(log_message);
+void on_bulk_event(Worker *w, BulkConn *c) {
+    if (c->snapshot == NULL && c->out_off == c->out_len) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            bulk_close(w, c);
+            return;
+        }
+        if (n > 0) {
+            c->in_len += n;
+        }
+    }
+
+    // Queries are answered one at a time, in order
+    for (;;) {
+        if (c->snapshot != NULL) {
+            bulk_step(w, c);
+        }
+        if (bulk_flush(c) < 0) {
+            bulk_close(w, c);
+            return;
+        }
+        if (c->snapshot != NULL || c->out_off < c->out_len || c->in_len < 2) {
             break;
         }
+        int length = c->in[0] << 8 | c->in[1];
+        if (length > BULK_MAX_MESSAGE) {
+            bulk_close(w, c);
+            return;
+        }
+        if (c->in_len < 2 + length) {
+            break;
+        }
+        memset(&c->query, 0, sizeof(c->query));
+        memcpy(&c->query, c->in + 2, length < (int)sizeof(c->query) ? length : (int)sizeof(c->query));
+        bulk_room(c);
+        bulk_start_query(w, c, length);
+        c->in_len -= 2 + length;
+        memmove(c->in, c->in + 2 + length, c->in_len);
     }
-    pthread_mutex_unlock(&lease_mutex);
+    bulk_update_events(w, c);
 }
 
-void handle_dhcp_inform(DHCPPacket *packet, struct sockaddr_in *client_addr) {
-    DHCPPacket response;
-    memset(&response, 0, sizeof(DHCPPacket));
-
-    response.op = 2; // Boot Reply
-    response.htype = packet->htype;
-    response.hlen = packet->hlen;
-    response.xid = packet->xid;
-    response.ciaddr = packet->ciaddr;
-    response.siaddr = inet_addr(server_ip);
-    memcpy(response.chaddr, packet->chaddr, 16);
+int create_bulk_socket() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Bulk leasequery socket creation failed");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(bulk_leasequery_port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, MAX_BULK_CONNS) < 0) {
+        perror("Bulk leasequery bind failed");
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < MAX_BULK_CONNS; i++) {
+        bulk_conns[i].fd = -1;
+    }
+    return fd;
+}
 
-    int option_offset = 0;
-    uint8_t dhcp_msg_type = 5; // DHCP ACK
-    add_dhcp_option(response.options, &option_offset, 53, 1, &dhcp_msg_type);
+void close_bulk_socket(Worker *w) {
+    for (int i = 0; i < MAX_BULK_CONNS; i++) {
+        if (bulk_conns[i].fd >= 0) {
+            bulk_close(w, &bulk_conns[i]);
+        }
+    }
+    close(w->bulk_fd);
+    w->bulk_fd = -1;
+}
 
-    uint32_t server_id = inet_addr(server_ip);
-    add_dhcp_option(response.options, &option_offset, 54, 4, (uint8_t*)&server_id);
+// Lease feed socket, on worker 0, for consumers that can't map lease_feed_shm. Each one is sent
+// LeaseEvents from its own cursor, starting with the next change. One the ring overtakes gets a
+// LEASE_EVENT_GAP record and goes on from the oldest event left.
+void feed_close(Worker *w, FeedConn *c) {
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
 
-    // Add subnet mask option
-    uint32_t subnet_mask = htonl(0xFFFFFF00); // 255.255.255.0
-    add_dhcp_option(response.options, &option_offset, 1, 4, (uint8_t*)&subnet_mask);
+// Copies event 'seq' out of the ring; -1 if it has been overwritten or is being written
+int lease_feed_read(uint64_t seq, LeaseEvent *out) {
+    const LeaseEvent *event = &lease_events[seq & (lease_feed_size - 1)];
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != seq) {
+        return -1;
+    }
+    memcpy(out, event, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
 
-    // Add router option (default gateway)
-    uint32_t router = inet_addr(server_ip); // Using server IP as gateway
-    add_dhcp_option(response.options, &option_offset, 3, 4, (uint8_t*)&router);
+// Sends what the consumer hasn't had yet, as far as its socket takes it
+void feed_pump(Worker *w, FeedConn *c) {
+    uint64_t head;
+    for (;;) {
+        if (c->out_off == c->out_len) {
+            c->out_off = c->out_len = 0;
+        } else if (c->out_off > 0) {
+            memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+            c->out_len -= c->out_off;
+            c->out_off = 0;
+        }
+        head = __atomic_load_n(&lease_feed->head, __ATOMIC_ACQUIRE);
+        while (c->cursor <= head && c->out_len + (int)sizeof(LeaseEvent) <= (int)sizeof(c->out)) {
+            LeaseEvent *event = (LeaseEvent *)(c->out + c->out_len);
+            if (head - c->cursor >= (uint64_t)lease_feed_size) {
+                c->cursor = head - lease_feed_size + 1;
+                memset(event, 0, sizeof(*event));
+                event->seq = c->cursor;
+                event->time = time(NULL);
+                event->type = LEASE_EVENT_GAP;
+                STAT_INC(feed_gaps);
+            } else if (lease_feed_read(c->cursor, event) == 0) {
+                c->cursor++;
+            } else {
+                head = __atomic_load_n(&lease_feed->head, __ATOMIC_ACQUIRE); // overtaken meanwhile
+                continue;
+            }
+            c->out_len += sizeof(LeaseEvent);
+        }
 
-    // Add DNS server option
-    add_dhcp_option(response.options, &option_offset, 6, 4, (uint8_t*)&server_id);
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            feed_close(w, c);
+            return;
+        }
+        if (n > 0) {
+            c->out_off += n;
+        }
+        if (c->out_off < c->out_len || c->cursor > head) {
+            break; // socket full, or nothing left to send
+        }
+    }
 
-    response.options[option_offset++] = 255; // End option
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->out_off < c->out_len ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return;
+// A lease writer saw lease_feed_sleeping and woke us. The flag is set again before looking at
+// the head, pairing with the fence in publish_lease_change_locked, so no event is left unsent.
+void on_feed_event(Worker *w) {
+    uint64_t value;
+    if (read(feed_event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
     }
-
-    if (sendto(sock, &response, sizeof(DHCPPacket), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("Sendto failed");
-    } else {
-        write_log("Sent DHCP ACK (Inform) to client");
+    __atomic_store_n(&lease_feed_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < MAX_FEED_CONNS; i++) {
+        if (feed_conns[i].fd >= 0) {
+            feed_pump(w, &feed_conns[i]);
+        }
     }
+}
 
-    close(sock);
+FeedConn *find_feed_conn(int fd) {
+    for (int i = 0; i < MAX_FEED_CONNS; i++) {
+        if (feed_conns[i].fd == fd) return &feed_conns[i];
+    }
+    return NULL;
 }
 
-void cleanup_expired_leases() {
-    time_t current_time = time(NULL);
-    pthread_mutex_lock(&lease_mutex);
-    for (int i = 0; i < num_leases; i++) {
-        if (ip_leases[i].state == 2 && (current_time - ip_leases[i].lease_start) > ip_leases[i].lease_time) {
-            ip_leases[i].state = 0; // Free
-            char log_message[256];
-            snprintf(log_message, sizeof(log_message), "Expired lease for IP: %s", ip_leases[i].ip);
-            write_log(log_message);
+void on_feed_accept(Worker *w) {
+    for (;;) {
+        int fd = accept4(w->feed_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        FeedConn *c = find_feed_conn(-1);
+        if (c == NULL) {
+            write_log("Lease feed socket: too many consumers");
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->cursor = __atomic_load_n(&lease_feed->head, __ATOMIC_ACQUIRE) + 1;
+        if (add_to_epoll(w->epoll_fd, fd) < 0) {
+            close(fd);
+            c->fd = -1;
         }
     }
-    pthread_mutex_unlock(&lease_mutex);
 }
 
-void* lease_cleanup_thread(void* arg) {
-    while (server_running) {
-        cleanup_expired_leases();
-        sleep(60); // Check every minute
+// Consumers have nothing to say; reading only notices them hanging up
+void on_feed_conn_event(Worker *w, FeedConn *c) {
+    char discard[256];
+    ssize_t n = read(c->fd, discard, sizeof(discard));
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        feed_close(w, c);
+        return;
     }
-    return NULL;
+    feed_pump(w, c);
 }
 
-void handle_remote_request(DHCPPacket *packet, struct sockaddr_in *client_addr) {
-    if (packet->giaddr != 0) {
-        // This is a relayed request
-        write_log("Handling relayed DHCP request");
-        // Set the gateway IP address in the response
-        packet->giaddr = packet->giaddr;
-    } else {
-        write_log("Handling direct DHCP request");
+int create_feed_socket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(lease_feed_socket) >= sizeof(addr.sun_path)) {
+        write_log("Lease feed socket path too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, lease_feed_socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Lease feed socket creation failed");
+        return -1;
+    }
+    unlink(lease_feed_socket); // left over from a previous run
+    mode_t old_mask = umask(0077); // like the control socket
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(fd, MAX_FEED_CONNS) < 0) {
+        perror("Lease feed socket bind failed");
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < MAX_FEED_CONNS; i++) {
+        feed_conns[i].fd = -1;
     }
+    return fd;
 }
 
-void print_dhcp_stats() {
-    int total_leases = 0;
-    int active_leases = 0;
-    pthread_mutex_lock(&lease_mutex);
-    for (int i = 0; i < num_leases; i++) {
-        if (ip_leases[i].state != 0) {
-            total_leases++;
-            if (ip_leases[i].state == 2) {
-                active_leases++;
-            }
+void close_feed_socket(Worker *w) {
+    for (int i = 0; i < MAX_FEED_CONNS; i++) {
+        if (feed_conns[i].fd >= 0) {
+            feed_close(w, &feed_conns[i]);
         }
     }
-    pthread_mutex_unlock(&lease_mutex);
+    close(w->feed_fd);
+    w->feed_fd = -1;
+    unlink(lease_feed_socket);
+}
 
-    printf("DHCP Server Statistics:\n");
-    printf("Total leases: %d\n", total_leases);
-    printf("Active leases: %d\n", active_leases);
-    printf("Available leases: %d\n", MAX_CLIENTS - total_leases);
+int init_worker(Worker *w, int id, sigset_t *signal_mask) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->timer_fd = -1;
+    w->signal_fd = -1;
+    w->control_fd = -1;
+    w->bulk_fd = -1;
+    w->feed_fd = -1;
+    w->upstream_sock = -1;
+    w->exchange_timer_fd = -1;
+    w->probe_sock = -1;
+    w->config = current_config;
+    w->config_generation = current_config->generation;
 
-    double lease_usage = (double)total_leases / MAX_CLIENTS;
-    if (lease_usage > LEASE_THRESHOLD) {
-        printf("Warning: Lease usage is high (%.2f%%)\n", lease_usage * 100);
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // Every worker binds its own SO_REUSEPORT sockets, the kernel spreads clients between them
+    w->dhcp_sock = create_and_bind_socket(dhcp_server_port);
+    w->dns_sock = create_and_bind_socket(dns_server_port);
+    if (w->epoll_fd < 0 || w->wake_fd < 0 || w->dhcp_sock < 0 || w->dns_sock < 0) {
+        return -1;
+    }
+    if (set_nonblocking(w->dhcp_sock) < 0 || set_nonblocking(w->dns_sock) < 0) {
+        return -1;
+    }
+    w->upstream_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (w->upstream_sock < 0 || add_to_epoll(w->epoll_fd, w->upstream_sock) < 0) {
+        perror("DNS upstream socket failed");
+        return -1;
+    }
+    for (int c = 0; c < NUM_QUEUES; c++) {
+        w->queues[c].items = malloc(PACKET_QUEUE_DEPTH * sizeof(QueuedPacket));
+        if (w->queues[c].items == NULL) {
+            return -1;
+        }
+    }
+    w->exchanges = calloc(MAX_EXCHANGES, sizeof(Exchange));
+    w->exchange_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->exchanges == NULL || w->exchange_timer_fd < 0 || add_to_epoll(w->epoll_fd, w->exchange_timer_fd) < 0) {
+        perror("Exchange setup failed");
+        return -1;
+    }
+    for (int i = 0; i < MAX_EXCHANGES; i++) {
+        w->exchanges[i].next_free = i + 1 < MAX_EXCHANGES ? i + 1 : -1;
+    }
+    if (open_conflict_probing(w) == 0 && add_to_epoll(w->epoll_fd, w->probe_sock) < 0) {
+        return -1;
+    }
+    int timestamps = 1;
+    if (setsockopt(w->dhcp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPNS) failed"); // queue waits then start at read time
+    }
+    if (attach_dhcp_filter(w->dhcp_sock, w->config) < 0) {
+        write_log("Could not attach the DHCP socket filter, validating in userspace only");
     }
-}
 
-void signal_handler(int signum) {
-    if (signum == SIGINT || signum == SIGTERM) {
-        printf("Received signal %d. Shutting down...\n", signum);
-        server_running = 0;
+    // Worker 0 also owns the housekeeping timer and the signals
+    if (id == 0) {
+        w->timer_fd = create_tick_timer();
+        w->signal_fd = create_signal_fd(signal_mask);
+        if (w->timer_fd < 0 || w->signal_fd < 0) {
+            return -1;
+        }
+        if (add_to_epoll(w->epoll_fd, w->timer_fd) < 0 || add_to_epoll(w->epoll_fd, w->signal_fd) < 0) {
+            return -1;
+        }
+        if (control_socket_path[0] != '\0') {
+            w->control_fd = create_control_socket();
+            if (w->control_fd >= 0 && add_to_epoll(w->epoll_fd, w->control_fd) < 0) {
+                close_control_socket(w);
+            }
+            if (w->control_fd < 0) {
+                write_log("Control socket unavailable, continuing without it");
+            }
+        }
+        if (bulk_leasequery_port > 0) {
+            w->bulk_fd = create_bulk_socket();
+            if (w->bulk_fd >= 0 && add_to_epoll(w->epoll_fd, w->bulk_fd) < 0) {
+                close_bulk_socket(w);
+            }
+            if (w->bulk_fd < 0) {
+                write_log("Bulk leasequery unavailable, continuing without it");
+            }
+        }
+        if (lease_feed_socket[0] != '\0' && lease_feed != NULL) {
+            feed_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            w->feed_fd = feed_event_fd >= 0 ? create_feed_socket() : -1;
+            if (w->feed_fd >= 0 && (add_to_epoll(w->epoll_fd, w->feed_fd) < 0 || add_to_epoll(w->epoll_fd, feed_event_fd) < 0)) {
+                close_feed_socket(w);
+            }
+            if (w->feed_fd < 0) {
+                write_log("Lease feed socket unavailable, continuing without it");
+            } else {
+                __atomic_store_n(&lease_feed_sleeping, 1, __ATOMIC_RELAXED); // nobody to send to yet
+            }
+        }
+        if (lb_sock >= 0 && add_to_epoll(w->epoll_fd, lb_sock) < 0) {
+            return -1;
+        }
     }
-}
 
-void* dhcp_server_thread(void* arg) {
-    write_log("Starting DHCP server...");
+    if (add_to_epoll(w->epoll_fd, w->wake_fd) < 0) {
+        return -1;
+    }
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return NULL;
+    if (io_backend == IO_BACKEND_PACKET) {
+        if (packet_ring_setup(&w->packet, id, w->config) == 0 &&
+            add_to_epoll(w->epoll_fd, w->packet.fd) == 0 &&
+            add_to_epoll(w->epoll_fd, w->dns_sock) == 0 &&
+            attach_drop_all_filter(w->dhcp_sock) == 0) {
+            w->io_backend = IO_BACKEND_PACKET;
+            return 0;
+        }
+        char log_message[256];
+        snprintf(log_message, sizeof(log_message), "Packet ring on %s unavailable (%s), worker %d using sockets", packet_interface, strerror(errno), id);
+        write_log(log_message);
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->dns_sock, NULL);
+        packet_ring_close(&w->packet);
     }
 
-    struct sockaddr_in server_addr, client_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(dhcp_server_port);
+    if (io_backend == IO_BACKEND_URING) {
+        if (uring_setup(&w->ring) == 0 &&
+            uring_arm_recv(&w->ring, w->dhcp_sock, 0) == 0 &&
+            uring_arm_recv(&w->ring, w->dns_sock, 1) == 0 &&
+            add_to_epoll(w->epoll_fd, w->ring.event_fd) == 0) {
+            w->io_backend = IO_BACKEND_URING;
+            uring_submit(&w->ring);
+            return 0;
+        }
+        char log_message[256];
+        snprintf(log_message, sizeof(log_message), "io_uring unavailable (%s), worker %d using sockets", strerror(errno), id);
+        write_log(log_message);
+        uring_close(&w->ring);
+    }
+    return fall_back_to_sockets(w);
+}
 
-    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Bind failed: %s", strerror(errno));
-        write_log(error_msg);
-        perror("Bind failed");
-        close(sock);
-        return NULL;
+void close_worker(Worker *w) {
+    if (w->control_fd >= 0) {
+        close_control_socket(w);
+    }
+    if (w->bulk_fd >= 0) {
+        close_bulk_socket(w);
+    }
+    if (w->feed_fd >= 0) {
+        close_feed_socket(w);
+    }
+    for (int c = 0; c < NUM_QUEUES; c++) {
+        free(w->queues[c].items);
     }
+    free(w->exchanges);
+    if (w->io_backend == IO_BACKEND_URING) {
+        uring_close(&w->ring);
+    } else if (w->io_backend == IO_BACKEND_PACKET) {
+        packet_ring_close(&w->packet);
+    }
+    int fds[] = { w->dhcp_sock, w->dns_sock, w->upstream_sock, w->probe_sock, w->exchange_timer_fd, w->timer_fd, w->signal_fd,
+                  w->wake_fd, w->epoll_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+void* worker_loop(void* arg) {
+    Worker *w = (Worker *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    char log_message[256];
+    snprintf(log_message, sizeof(log_message), "Starting DHCP worker %d...", w->id);
+    write_log(log_message);
 
     while (server_running) {
-        DHCPPacket packet;
-        socklen_t client_len = sizeof(client_addr);
-        write_log("Waiting for DHCP packet...");
+        refresh_worker_config(w);
 
-        ssize_t received = recvfrom(sock, &packet, sizeof(DHCPPacket), 0, (struct sockaddr *)&client_addr, &client_len);
-        if (received < 0) {
+        // Don't sleep while admitted packets are still waiting to be served
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, dhcp_queues_pending(w) ? 0 : -1);
+        if (n < 0) {
             if (errno == EINTR) {
-                continue; // Interrupted by signal, continue loop
+                continue;
             }
-            write_log("Recvfrom failed");
-            continue;
+            perror("epoll_wait failed");
+            break;
         }
 
-        char log_message[256];
-        snprintf(log_message, sizeof(log_message), "Received DHCP packet from %s", inet_ntoa(client_addr.sin_addr));
-        write_log(log_message);
-
-        // Process DHCP packet
-        uint8_t msg_type = 0;
-        for (int i = 0; i < sizeof(packet.options); i++) {
-            if (packet.options[i] == 53 && i + 1 < sizeof(packet.options)) { // DHCP Message Type option
-                msg_type = packet.options[i + 2];
-                break;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == w->dhcp_sock) {
+                on_dhcp_readable(w);
+            } else if (fd == w->dns_sock) {
+                on_dns_readable(w);
+            } else if (fd == w->upstream_sock) {
+                on_upstream_readable(w);
+            } else if (fd == w->probe_sock) {
+                on_probe_readable(w);
+            } else if (fd == w->exchange_timer_fd) {
+                on_exchange_timer(w);
+            } else if (fd == w->timer_fd) {
+                on_timer_tick(w);
+            } else if (fd == w->signal_fd) {
+                on_signal(w);
+            } else if (fd == lb_sock) {
+                on_lb_readable();
+            } else if (w->io_backend == IO_BACKEND_PACKET && fd == w->packet.fd) {
+                on_packet_readable(w);
+            } else if (w->io_backend == IO_BACKEND_URING && fd == w->ring.event_fd) {
+                on_uring_completion(w);
+            } else if (fd == w->wake_fd) {
+                uint64_t value;
+                if (read(w->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    perror("eventfd read failed");
+                }
+                complete_tasks(w);
+                if (w->replication_waiters > 0) {
+                    resume_replicated_exchanges(w);
+                }
+            } else if (fd == w->feed_fd) {
+                on_feed_accept(w);
+            } else if (w->feed_fd >= 0 && fd == feed_event_fd) {
+                on_feed_event(w);
+            } else if (w->feed_fd >= 0 && find_feed_conn(fd) != NULL) {
+                on_feed_conn_event(w, find_feed_conn(fd));
+            } else if (fd == w->bulk_fd) {
+                on_bulk_accept(w);
+            } else if (w->bulk_fd >= 0 && find_bulk_conn(fd) != NULL) {
+                on_bulk_event(w, find_bulk_conn(fd));
+            } else if (fd == w->control_fd) {
+                on_control_accept(w);
+            } else if (w->control_fd >= 0) {
+                on_control_event(w, fd);
             }
         }
 
-        snprintf(log_message, sizeof(log_message), "DHCP message type: %d", msg_type);
-        write_log(log_message);
+        process_dhcp_queues(w, PROCESS_BUDGET);
 
-        switch (msg_type) {
-            case 1: // DHCP Discover
-                handle_dhcp_discover(&packet, &client_addr);
-                break;
-            case 3: // DHCP Request
-                handle_dhcp_request(&packet, &client_addr);
-                break;
-            case 7: // DHCP Release
-                handle_dhcp_release(&packet);
-                break;
-            case 4: // DHCP Decline
-                handle_dhcp_decline(&packet);
-                break;
-            case 8: // DHCP Inform
-                handle_dhcp_inform(&packet, &client_addr);
-                break;
-            default:
-                snprintf(log_message, sizeof(log_message), "Unsupported DHCP message type: %d", msg_type);
-                write_log(log_message);
+        // Replies queued while handling this batch go out in one submission
+        if (w->io_backend == IO_BACKEND_URING) {
+            uring_submit(&w->ring);
+        } else if (w->io_backend == IO_BACKEND_PACKET) {
+            packet_flush(&w->packet);
         }
     }
 
-    close(sock);
     return NULL;
 }
 
@@ -617,37 +7241,95 @@ int main() {
     init_log();
     write_log("DHCP Server starting...");
     
-    load_config();
+    current_config = load_config(1);
+    if (current_config == NULL) {
+        close_log();
+        return 1;
+    }
     
+    // Upstream query IDs must not be guessable, or a spoofed answer could poison the cache
+    if (getrandom(&dns_id_seed, sizeof(dns_id_seed), 0) != sizeof(dns_id_seed)) {
+        dns_id_seed = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    }
+
+    if (dns_zone_file[0] != '\0' && load_dns_zone(dns_zone_file) < 0) {
+        close_log();
+        return 1;
+    }
+
     // Initialize DNS entries
+    dns_update_task.run = apply_dns_updates_task;
     add_dns_entry("example.com", "93.184.216.34");
     add_dns_entry("google.com", "172.217.16.142");
 
-    //signal(SIGINT, signal_handler);
-    //signal(SIGTERM, signal_handler);
+    if (init_lease_table() < 0 || init_lease_feed() < 0) {
+        close_log();
+        return 1;
+    }
 
-    pthread_t server_thread, cleanup_thread;
-    if (pthread_create(&server_thread, NULL, dhcp_server_thread, NULL) != 0) {
-        write_log("Failed to create server thread");
+    // Block the signals before any worker thread exists so they all inherit the mask
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &signal_mask, NULL) != 0) {
+        write_log("Failed to block signals");
         close_log();
         return 1;
     }
 
-    if (pthread_create(&cleanup_thread, NULL, lease_cleanup_thread, NULL) != 0) {
-        write_log("Failed to create cleanup thread");
+    if (start_task_pool() < 0) {
+        write_log("Failed to start the task pool");
         close_log();
         return 1;
     }
 
-    while (server_running) {
-        sleep(60); // Sleep for a minute
-        print_dhcp_stats();
+    if (replication_peer_text[0] != '\0' && start_replication() < 0) {
+        close_log();
+        return 1;
+    }
+    if (lb_servers_text[0] != '\0' && start_load_balancing() < 0) {
+        close_log();
+        return 1;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (init_worker(&workers[i], i, &signal_mask) < 0) {
+            write_log("Failed to initialize worker");
+            for (int j = 0; j <= i; j++) {
+                close_worker(&workers[j]);
+            }
+            close_log();
+            return 1;
+        }
     }
 
-    pthread_join(server_thread, NULL);
-    pthread_join(cleanup_thread, NULL);
+    // Worker 0 runs on the main thread, the rest get a thread each
+    int started = 1;
+    for (int i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            write_log("Failed to create worker thread");
+            stop_all_workers();
+            break;
+        }
+        started++;
+    }
+
+    worker_loop(&workers[0]);
 
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    stop_task_pool(); // runs whatever is still queued
+    for (int i = 0; i < num_workers; i++) {
+        complete_tasks(&workers[i]);
+        close_worker(&workers[i]);
+    }
+
+    close_lease_table();
+    close_lease_feed();
     write_log("DHCP Server shutting down...");
     close_log();
     return 0;
-}
\ No newline at end of file
+}